@@ -0,0 +1,51 @@
+#ifndef __AVI_MP4_H__
+#define __AVI_MP4_H__
+
+#include <event2/buffer.h>
+
+#include "avilib.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif
+#endif
+
+/*
+ * Fragmented MP4 (ISO BMFF) writer with the input of the AVI writer:
+ * the frames and audio chunks given to AVI_write_frame/AVI_write_audio
+ * can go to AVI_mp4_write_frame/AVI_mp4_write_audio as they are. The
+ * output evbuffer gets the init segment (ftyp, moov) with the first
+ * keyframe and then one fragment (moof, mdat) per GOP, emitted when
+ * the next keyframe arrives. Frames and audio before the first
+ * keyframe are dropped. Durations come from fps and the audio sample
+ * counts, like in the AVI headers; rt is not used.
+ *
+ * Video: H.264 Annex B (compressor H264 or AVC1) as avc1, the SPS and
+ * PPS go to avcC. Audio: AAC (raw or ADTS) as mp4a, A-law, mu-law and
+ * 16 bit PCM as alaw, ulaw and sowt. Browsers only play AAC, channels
+ * 0 leaves the audio out. AVI_mp4_new returns NULL for AAC at a rate
+ * the AudioSpecificConfig has no index for. A write that fails leaves
+ * the fragment in progress as it was.
+ */
+
+typedef struct avi_mp4_s avi_mp4_t;
+
+avi_mp4_t *AVI_mp4_new(int width, int height, int fps, const char *compressor,
+                       int channels, int rate, int bits, int format);
+int  AVI_mp4_write_frame(avi_mp4_t *m, unsigned char *data, int bytes, unsigned int rt);
+int  AVI_mp4_write_audio(avi_mp4_t *m, unsigned char *data, int bytes, unsigned int rt);
+int  AVI_mp4_flush(avi_mp4_t *m);                 /* emit the fragment in progress */
+struct evbuffer *AVI_mp4_output(avi_mp4_t *m);    /* to be drained by the caller */
+/* Add the init segment to out, for clients joining later; -1 before
+   the first keyframe */
+int  AVI_mp4_init_segment(avi_mp4_t *m, struct evbuffer *out);
+void AVI_mp4_free(avi_mp4_t *m);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef __AVI_REPAIR_H__
+#define __AVI_REPAIR_H__
+
+#include "avilib.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif
+#endif
+
+/*
+ * Batch repair after an unclean shutdown: finds the .avi files below the
+ * given directories, checks each with AVI_check_file and runs
+ * AVI_deformity_file only on those that were not closed. Files are
+ * taken newest first, so the latest recordings are back first. Symbolic
+ * links are not followed.
+ *
+ * The files are queued per device (st_dev). Each worker has a home
+ * device and takes from it; when that queue is empty or at its limit it
+ * steals from the device whose next file is the newest. At most
+ * per_device files of one device are in work at a time, so a slow disk
+ * does not get more requests queued than it can serve while the others
+ * idle.
+ *
+ * AVI_repair_dirs blocks until all files are done and prints a progress
+ * line every report_ms. The workers check and repair files at the same
+ * time: AVI_errno and the messages avilib prints can belong to any of
+ * them, the result of a file comes with conf.done.
+ */
+
+#define AVI_REPAIR_THREADS     8
+#define AVI_REPAIR_PER_DEVICE  4
+#define AVI_REPAIR_REPORT_MS   1000
+
+/* result of one file */
+#define AVI_REPAIR_VALID       0     /* closed properly, not touched */
+#define AVI_REPAIR_FIXED       1     /* rebuilt by AVI_deformity_file */
+#define AVI_REPAIR_FAILED      (-1)  /* AVI_deformity_file failed */
+#define AVI_REPAIR_UNABLE      2     /* too short or not readable */
+
+typedef struct
+{
+   long   files;             /* found */
+   long   done;              /* checked, and repaired if needed */
+   long   valid;
+   long   fixed;
+   long   failed;
+   long   unable;
+   long   elapsed_ms;
+} avi_repair_stats_t;
+
+typedef struct
+{
+   int    threads;           /* <= 0 selects AVI_REPAIR_THREADS */
+   int    per_device;        /* files of one device in work, <= 0 selects AVI_REPAIR_PER_DEVICE */
+   int    duration;          /* passed to AVI_deformity_file */
+   int    report_ms;         /* progress line interval, 0 selects AVI_REPAIR_REPORT_MS, < 0 none */
+
+   /* called by the workers for each file, one at a time; the workers
+      go on taking files meanwhile. err is the errno the check or repair
+      of this file ended with if result is AVI_REPAIR_FAILED or
+      AVI_REPAIR_UNABLE, 0 if it set none or the file is fine */
+   void (*done)(const char *file_name, int result, int err, void *arg);
+   void  *arg;
+} avi_repair_conf_t;
+
+/* conf may be NULL for the defaults; st gets the summary if not NULL.
+   -1 if the workers could not be started, otherwise the number of
+   files that failed */
+int AVI_repair_dirs(char **dirs, int n, const avi_repair_conf_t *conf, avi_repair_stats_t *st);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef __AVI_SEGMENT_H__
+#define __AVI_SEGMENT_H__
+
+#include "avilib.h"
+
+#ifdef __cplusplus
+#if __cplusplus
+extern "C" {
+#endif
+#endif
+
+/*
+ * Rolling recorder: writes a stream into a series of AVI files and
+ * starts a new one at the first keyframe after max_sec seconds of rt
+ * or max_bytes bytes. A worker thread creates the next file ahead of
+ * time (AVI_Init_fd_fast) and writes header and index of the finished one
+ * (AVI_close_fd_1), so a rotation on the media thread only swaps two
+ * pointers. If the next file is not ready yet, e.g. because it could
+ * not be created, the current one is continued until the next
+ * keyframe.
+ */
+
+#define AVI_SEGMENT_NAME       256
+
+typedef struct avi_segment_s avi_segment_t;
+
+typedef struct
+{
+   const char *pattern;      /* file name, printf format of the segment number, e.g. "/rec/cam0_%05d.avi" */
+   int    first;             /* number of the first segment */
+   int    width;
+   int    height;
+   int    fps;
+   const char *compressor;
+   int    channels;          /* audio, 0 keeps the default of AVI_Init_fd_fast */
+   int    rate;
+   int    bits;
+   int    format;
+   int    max_sec;           /* rt seconds per file, 0 for no limit */
+   long   max_bytes;         /* bytes per file, 0 for no limit */
+
+   /* called by the worker thread after a file is finished, ret is the
+      result of AVI_close_fd_1 */
+   void (*done)(const char *file_name, int ret, void *arg);
+   void  *arg;
+} avi_segment_conf_t;
+
+/* Creates the first file before returning, NULL if that fails */
+avi_segment_t *AVI_segment_open(const avi_segment_conf_t *conf);
+int AVI_segment_write_frame(avi_segment_t *s, unsigned char *data, int bytes, unsigned int rt);
+int AVI_segment_write_audio(avi_segment_t *s, unsigned char *data, int bytes, unsigned int rt);
+const char *AVI_segment_file(avi_segment_t *s);    /* name of the current file */
+/* Finishes all files and removes the one created ahead */
+int AVI_segment_close(avi_segment_t *s);
+
+#ifdef __cplusplus
+#if __cplusplus
+}
+#endif
+#endif
+
+#endif
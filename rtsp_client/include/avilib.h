@@ -74,6 +74,9 @@ typedef __init64				s64;
 #define AVI_ERR_NO_IDX      13     /* The file has been opened with
 										  getIndex==0, but an operation has been
 										  performed that needs an index */
+
+#define AVI_ERR_AGAIN       14     /* The async writer is still busy with
+										  its back buffer, nothing was written */
 /* Possible Audio formats */
 	
 #define WAVE_FORMAT_UNKNOWN             (0x0000)
@@ -89,12 +92,19 @@ typedef __init64				s64;
 #define WAVE_FORMAT_YAMAHA_ADPCM        (0x0020)
 #define WAVE_FORMAT_DSP_TRUESPEECH      (0x0022)
 #define WAVE_FORMAT_GSM610              (0x0031)
+#define WAVE_FORMAT_AAC                 (0x00FF)
 #define IBM_FORMAT_MULAW                (0x0101)
 #define IBM_FORMAT_ALAW                 (0x0102)
 #define IBM_FORMAT_ADPCM                (0x0103)
 
 #define AVI_MAX_TRACKS 8
 
+#define AVI_IDX_PAGE   256   /* idx1 entries per page of the writer index */
+
+/* bIndexType of the OpenDML index chunks */
+#define AVI_INDEX_OF_INDEXES   0x00
+#define AVI_INDEX_OF_CHUNKS    0x01
+
 typedef struct
 {
    off_t pos;
@@ -201,24 +211,64 @@ typedef struct __attribute__((__packed__))
 } alWAVEFORMATEX;
 
 
+/* State of a file opened with AVI_open_input_file, writers don't have
+   it: the index, the read positions, mapping, read-ahead and demuxer */
+typedef struct
+{
+   long   video_pos;         /* Number of next frame to be read
+                                (if index present) */
+   long   audio_posc;        /* Audio position: chunk */
+   long   audio_posb;        /* Audio position: byte within chunk */
+   long    must_use_index;    /* Flag if frames are duplicated */
+   long   movi_start;
+   void		*map;		 /* mmap read state, see AVI_set_mmap */
+   void		*demux;		 /* AVI_read_data buffer */
+   long   ra_window;         /* read-ahead bytes, see AVI_set_readahead */
+   off_t  ra_pos;            /* file offset of the last read */
+   off_t  ra_end;            /* read-ahead asked for up to here */
+   u32 max_len;    /* maximum video chunk present */
+   video_index_entry *video_index;
+   #ifdef AVI_READ
+   audio_index_entry * audio_index;
+   #endif
+   avisuperindex_chunk *video_superindex;  /* index of indices */
+   int comment_fd;      // Read avi header comments from this fd
+   char *index_file;    // read the avi index from this file
+} avi_input_t;
+
+/* The fields of the write path of every chunk come first: what a plain
+   writer uses, then the pointers of the optional features. */
 typedef struct
 {
+   /* the write path of every chunk only uses these */
+   off_t  pos;               /* position in file */
+   long   n_idx;             /* number of index entries actually filled */
+   long   max_idx;           /* number of index entries actually allocated */
+   unsigned char (**idx_page)[16]; /* index pages of a writer, AVI_IDX_PAGE entries each */
    unsigned char	*buf;	 /* дڴռ */
-   unsigned int		buf_len; /* дַ */
+   off_t  last_pos;          /* Position of last frame written */
+   long   last_len;          /* Length of last frame written */
+   long   video_frames;      /* Number of video frames */
+
+   long   audio_bytes;       /* Total number of bytes of audio data */
+   void		*writer;	 /* coalescing writer, see AVI_set_write_coalesce */
+   void		*odml;		 /* OpenDML writer state, see AVI_set_opendml */
+   void		*ckp;		 /* checkpoint journal, see AVI_set_checkpoint */
+   void		*tsix;		 /* per frame rt and keyframes, see AVI_set_time_index */
+   void		*durable;	 /* group commit entry, see AVI_set_durable */
    long				fdes;	 /* дļ */
    long				bt;		 /* ʼʱ */
    long				et;		 /* ʱ */
+   unsigned int		buf_len; /* дַ */
 
+   /* header */
    long   width;             /* Width  of a video frame */
    long   height;            /* Height of a video frame */
    long	  fps;               /* Frames per second */
    char   compressor[8];     /* Type of compressor, 4 bytes + padding for 0 byte */
    char   compressor2[8];     /* Type of compressor, 4 bytes + padding for 0 byte */
    long   video_strn;        /* Video stream number */
-   long   video_frames;      /* Number of video frames */
    char   video_tag[4];      /* Tag of video data */
-   long   video_pos;         /* Number of next frame to be read
-                                (if index present) */
 
    /*add by soctt.liao 2007-7-13*/
    long  dwMicroSecPerFrame;
@@ -229,43 +279,30 @@ typedef struct
    long   a_rate;            /* Rate in Hz */
    long   a_bits;            /* bits per audio sample */
    long   audio_strn;        /* Audio stream number */
-   long   audio_bytes;       /* Total number of bytes of audio data */
    long   audio_chunks;      /* Chunks of audio data in the file */
    char   audio_tag[4];      /* Tag of audio data */
-   long   audio_posc;        /* Audio position: chunk */
-   long   audio_posb;        /* Audio position: byte within chunk */
 
-   long   pos;               /* position in file */
-   long   n_idx;             /* number of index entries actually filled */
-   long   max_idx;           /* number of index entries actually allocated */
-
-   unsigned char (*idx)[16]; /* index entries (AVI idx1 tag) */
-   //unsigned char idx[MAX_INDEX][16];
-   long   last_pos;          /* Position of last frame written */
-   long   last_len;          /* Length of last frame written */
-   long    must_use_index;    /* Flag if frames are duplicated */
-   long   movi_start;
+   long   idx_pages;         /* slots in idx_page */
    void		*idxPtr;
+   int    duration;          /* expected length in seconds, from AVI_Init_fd* */
+   long   init_us;           /* time AVI_Init_fd_1/AVI_Init_fd_fast took */
    long   mode;              /* 0 for reading, 1 for writing */
-   u32 max_len;    /* maximum video chunk present */
-   track_t track[AVI_MAX_TRACKS];  // up to AVI_MAX_TRACKS audio tracks supported
+   int anum;            // total number of audio tracks
+   track_t *track;           /* AVI_MAX_TRACKS audio tracks, allocated by the reader and AVI_set_audio_track */
    off_t  v_codech_off;      /* absolut offset of video codec (strh) info */
    off_t  v_codecf_off;      /* absolut offset of video codec (strf) info */
-   video_index_entry *video_index;
-   #ifdef AVI_READ
-   audio_index_entry * audio_index;
-   #endif
-   avisuperindex_chunk *video_superindex;  /* index of indices */
    int is_opendml;           /* set to 1 if this is an odml file with multiple index chunks */
    int total_frames;         /* total number of frames if dmlh is present */
-   int anum;            // total number of audio tracks
-   int aptr;            // current audio working track
-   int comment_fd;      // Read avi header comments from this fd
-   char *index_file;    // read the avi index from this file
    alBITMAPINFOHEADER *bitmap_info_header;
    alWAVEFORMATEX *wave_format_ex[AVI_MAX_TRACKS];
    void*		extradata;
    unsigned long	extradata_size;
+
+   /* reader, the idx1 it loaded shares the writers' index arena */
+   unsigned char (*idx)[16]; /* index entries (AVI idx1 tag) */
+   //unsigned char idx[MAX_INDEX][16];
+   int aptr;            // current audio working track
+   avi_input_t *input;       /* allocated by AVI_open_input_file, NULL for writers */
 } avi_t;
 
 enum { PAL_CIF,PAL_FIELD,PAL_D1,NTSC_CIF,NTSC_FIELD,NTSC_D1,QCIF,VGA,QVGA };
@@ -276,16 +313,129 @@ void AVI_set_video(avi_t *AVI, int width, int height, int fps, const char *compr
 void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format);
 int AVI_write_frame(avi_t *AVI, unsigned char *data, int bytes, unsigned int rt);
 int AVI_write_audio(avi_t *AVI, unsigned char *data, int bytes, unsigned int rt);
+
+/* More audio tracks: track 0 is the one of AVI_set_audio/AVI_write_audio,
+   track n (< AVI_MAX_TRACKS) is stream n+1 with the tag "0<n+1>wb". Set
+   the tracks in order before the first chunk; not together with
+   AVI_set_opendml or AVI_set_checkpoint. */
+int AVI_set_audio_track(avi_t *AVI, int track, int channels, int rate, int bits, int format);
+int AVI_write_audio_track(avi_t *AVI, int track, unsigned char *data, int bytes, unsigned int rt);
 int AVI_output_file(avi_t *AVI);
 int AVI_close(avi_t *AVI);
 int AVI_close_fd(avi_t *AVI);
 int AVI_close_fd_1(avi_t *AVI);
 int AVI_deformity_file(char  *file_name, int duration,unsigned int *tm_len);
+/* 0 if file_name was closed with its header and idx1, 1 if it needs
+   AVI_deformity_file, RECORD_UNABLE_DEFORM if it is too short or cannot
+   be opened. Reads only the header and the idx1 chunk header. */
+int AVI_check_file(char *file_name);
 int AVI_Init_fd_1(avi_t *AVI, int width, int height, int fps, const char *compressor, int duration, const char *file_name);
+/* Same as AVI_Init_fd_1 without its sleeps and sync(): the header and
+   the directory entry are synced by the group commit thread (see
+   AVI_durable_init, started if needed) right after, in one batch with
+   the other recordings started meanwhile and one fsync per directory.
+   Without the thread the caller syncs them. The marker file is synced
+   once for all recorders of the process. AVI->init_us has the time. */
+int AVI_Init_fd_fast(avi_t *AVI, int width, int height, int fps, const char *compressor, int duration, const char *file_name);
+
+/* Batch the chunk writes of an fd backed avi_t (AVI_Init_fd/AVI_Init_fd_1)
+   and write them with writev once max_bytes are pending or max_ms passed
+   since the last flush (<= 0 and < 0 select the defaults below).
+   Call after AVI_Init_fd*, undone by AVI_close_fd*. */
+#define AVI_COALESCE_BYTES   (256*1024)
+#define AVI_COALESCE_MS      500
+int AVI_set_write_coalesce(avi_t *AVI, int max_bytes, int max_ms);
+
+/* Double buffered writer: AVI_write_frame/AVI_write_audio copy into a
+   front buffer of buf_bytes while a thread writes the back buffer.
+   If both buffers are in use the write fails with AVI_errno set to
+   AVI_ERR_AGAIN and nothing changed, unless block is set, then it waits.
+   A write error of the thread is returned by the next call. */
+int AVI_set_async_write(avi_t *AVI, int buf_bytes, int max_ms, int block);
+long AVI_write_pending(avi_t *AVI);	/* bytes accepted but not yet written */
+int AVI_flush(avi_t *AVI);
+
+/* Same as AVI_set_async_write, but the buffers are slots of a process
+   wide io_uring with registered buffers and all recordings share one
+   completion thread. AVI_uring_init sizes the ring once (<= 0 selects
+   the defaults below), otherwise the first AVI_set_uring_write does.
+   Falls back to AVI_set_async_write when io_uring is not available or
+   all slots are in use; each recording takes two slots. */
+#define AVI_URING_SLOTS        64
+#define AVI_URING_SLOT_BYTES   (256*1024)
+int AVI_uring_init(int slots, int slot_bytes);
+int AVI_set_uring_write(avi_t *AVI, int max_ms, int block);
+/* Stop the completion thread and release the ring; -1 (AVI_ERR_NOT_PERM)
+   while a recording still uses it. A later AVI_uring_init or
+   AVI_set_uring_write sets up a new one. */
+int AVI_uring_shutdown(void);
+
+/* Record with O_DIRECT through a 4 KiB aligned staging buffer, so the
+   recording doesn't fill the page cache. Preallocates duration (from
+   AVI_Init_fd*) * kbps with fallocate, the unused rest is released by
+   AVI_close_fd*. Call right after AVI_Init_fd*, instead of the other
+   writer modes. */
+#define AVI_DIRECT_ALIGN       4096
+#define AVI_DIRECT_BYTES       (1024*1024)
+int AVI_set_direct_io(avi_t *AVI, int kbps);
+
+/* Write an OpenDML (AVI 2.0) file that is not limited by buf_len: the
+   data goes into RIFF segments of riff_mb MB (<= 0 selects 1 GB), the
+   first one stays readable by AVI 1.0 readers. Each segment gets its
+   own ix## standard indexes, the indx super indexes in the header can
+   hold AVI_ODML_MAX_SEGMENTS of them; writing more fails with
+   AVI_ERR_SIZELIM. Call after AVI_Init_fd*, before the first frame.
+   The reader builds its index from the indx/ix## chunks (is_opendml),
+   AVI_deformity_file continues across the 'AVIX' segments and writes
+   the ix## chunks of the last one again. */
+#define AVI_ODML_RIFF_MB       1024
+#define AVI_ODML_MAX_SEGMENTS  40
+int AVI_set_opendml(avi_t *AVI, int riff_mb);
+
+/* Every interval_ms (<= 0 selects AVI_CKP_MS) the index entries of the
+   chunks that reached the file and the header counts for them are
+   appended to the journal file_name.ckp, and the header is rewritten.
+   The writes are done by the group commit thread (see AVI_durable_init,
+   started with the default if needed), chunks the writer still holds
+   go into the next checkpoint. AVI_deformity_file then only scans what
+   was written after the last checkpoint. With sync set, recording and
+   journal are fdatasync()ed at each checkpoint, which also bounds the
+   rescan after a power cut. AVI_close_fd* removes the journal; not
+   available together with AVI_set_opendml. */
+#define AVI_CKP_MS             5000
+int AVI_set_checkpoint(avi_t *AVI, const char *file_name, int interval_ms, int sync);
+
+/* Keep the rt passed to AVI_write_frame and whether the frame is a
+   keyframe (H.264/H.265 IDR, other codecs always), written as a 'tsix'
+   chunk behind idx1. The reader puts the keyframes into
+   video_index[].key and AVI_seek_time can use them. Not together with
+   AVI_set_opendml, files rebuilt by AVI_deformity_file don't have it. */
+int AVI_set_time_index(avi_t *AVI);
+
+/* Group commit: one thread of the process syncs all recordings set with
+   AVI_set_durable that were written to, together every max_ms/2, so
+   about max_ms of the data handed to the file is at risk (<= 0 selects
+   the default; AVI_set_durable starts it with the default if needed).
+   AVI_durable_ticket flushes the staged chunks and returns a ticket,
+   AVI_durable_wait blocks until everything written before the ticket is
+   synced, -1 if that failed. Undone by AVI_close_fd*. */
+#define AVI_DURABLE_MS         1000
+int  AVI_durable_init(int max_ms);
+int  AVI_set_durable(avi_t *AVI);
+long AVI_durable_ticket(avi_t *AVI);
+int  AVI_durable_wait(avi_t *AVI, long ticket);
+
+/* 1 if the frame starts a GOP: H264 IDR/SPS, H265 IRAP/VPS; frames of
+   other compressors all count as keyframes */
+int AVI_frame_is_key(avi_t *AVI, unsigned char *data, int bytes);
 
 #ifdef AVI_READ
 int AVI_close_1(avi_t *AVI);
 avi_t *AVI_open_input_file(char *filename, int getIndex);
+/* Same, but keeps the index in the sidecar file indexfile: it is
+   used while size and mtime of the AVI file match, rewritten otherwise
+   (through indexfile.XXXXXX in the same directory and rename). */
+avi_t *AVI_open_input_indexfile(char *filename, int getIndex, char *indexfile);
 long AVI_video_frames(avi_t *AVI);
 int  AVI_video_width(avi_t *AVI);
 int  AVI_video_height(avi_t *AVI);
@@ -303,14 +453,79 @@ int  AVI_seek_start(avi_t *AVI);
 int  AVI_set_video_position(avi_t *AVI, long frame);
 long AVI_read_frame(avi_t *AVI, char *vidbuf);
 int  AVI_set_audio_position(avi_t *AVI, long byte);
+
+/* Position on the last keyframe with an rt not after rt, or the first
+   keyframe, and return its number. Needs a file written with
+   AVI_set_time_index, AVI_frame_time returns 0 without one. */
+long AVI_seek_time(avi_t *AVI, unsigned int rt);
+unsigned int AVI_frame_time(avi_t *AVI, long frame);
+
+/* Number of the keyframe at or before frame, frame itself if there is
+   none. Uses the time index if the file has one, otherwise reads the
+   start of the frames up to scan (<= 0 selects AVI_KEY_SCAN) back. The
+   position of the avi_t is not changed. */
+#define AVI_KEY_SCAN           1000
+long AVI_key_before(avi_t *AVI, long frame, long scan);
 long AVI_read_audio(avi_t *AVI, char *audbuf, long bytes);
 
 int  AVI_read_data(avi_t *AVI, char *vidbuf, long max_vidbuf,
                                char *audbuf, long max_audbuf,
                                long *len);
+/* Same order and return codes as AVI_read_data, but data points into
+   its read buffer and stays valid until the next call. */
+int  AVI_read_data_view(avi_t *AVI, const unsigned char **data, long *len);
+
+/* Read through a read-only mapping of the file. Files up to
+   AVI_MMAP_BUDGET are mapped as a whole, larger ones through a window
+   of window bytes (<= 0 selects AVI_MMAP_WINDOW). AVI_read_frame and
+   AVI_read_audio copy from the mapping once it is set up.
+   The _view calls return a pointer into the mapping instead of copying
+   (and set it up on first use): the next frame, or up to bytes of the
+   current audio chunk. A view stays valid until AVI_close_1, with a
+   window only until the next read. */
+#define AVI_MMAP_BUDGET        (256L*1024*1024)
+#define AVI_MMAP_WINDOW        (32L*1024*1024)
+int  AVI_set_mmap(avi_t *AVI, long window);
+long AVI_read_frame_view(avi_t *AVI, const unsigned char **data);
+long AVI_read_audio_view(avi_t *AVI, const unsigned char **data, long bytes);
+
+/* Ask the kernel to read window bytes (0 selects AVI_READAHEAD_BYTES,
+   < 0 turns it off) ahead of what AVI_read_frame/AVI_read_audio read.
+   A seek outside the window starts over at the new position. */
+#define AVI_READAHEAD_BYTES    (4L*1024*1024)
+int  AVI_set_readahead(avi_t *AVI, long window);
+
+/* Cursors for reading one opened file from several threads: each has
+   its own video/audio position and reads with pread, the avi_t is only
+   used for its index. Errors are returned as -AVI_ERR_* and leave
+   AVI_errno alone, AVI_errstr gives the text.
+   The index of an avi_t doesn't change after AVI_open_input_file*
+   returned, the cursors only read it. The calls on the avi_t itself
+   (AVI_read_*, AVI_set_*_position, AVI_seek_time, AVI_set_mmap,
+   AVI_set_readahead) change its own position, mapping and read-ahead
+   state: one thread at a time may use them while the cursors read.
+   AVI_close_1 frees the index, free all readers before it. */
+typedef struct avi_reader_s avi_reader_t;
+avi_reader_t *AVI_reader_new(avi_t *AVI);
+void AVI_reader_free(avi_reader_t *r);
+int  AVI_reader_set_video_position(avi_reader_t *r, long frame);
+long AVI_reader_read_frame(avi_reader_t *r, char *vidbuf);
+int  AVI_reader_set_audio_position(avi_reader_t *r, long byte);
+long AVI_reader_read_audio(avi_reader_t *r, char *audbuf, long bytes);
+
+/* Lossless clips: copy the chunks of whole frames into out_file with
+   copy_file_range (shared blocks where the filesystem has reflinks) and
+   write only header and idx1. AVI_trim keeps start..end seconds (end < 0:
+   up to the end) from the keyframe before start (AVI_key_before).
+   AVI_concat appends whole files, which need the same video and audio
+   format. Only the first audio track is kept, the chunks of the others
+   become JUNK in the copy; the time index is not kept. */
+int  AVI_trim(char *in_file, char *out_file, double start, double end);
+int  AVI_concat(char **in_files, int n, char *out_file);
 
 void AVI_print_error(char *str);
 char *AVI_strerror();
+const char *AVI_errstr(int err);
 char *AVI_syserror();
 
 #endif
@@ -0,0 +1,30 @@
+#ifndef HTTP_SERVER_H_
+#define HTTP_SERVER_H_
+
+#include <event2/event.h>
+
+/*
+ * Download server for recorded files: GET and HEAD on
+ * http://ip:port/<path below cRootDir>, with single byte ranges
+ * (Range: bytes=a-b, a-, -n) answered as 206 Partial Content.
+ * The file data is queued with evbuffer_add_file, so the kernel sends
+ * it (sendfile) without copying it through the server.
+ *
+ * A query t=start[,end] (seconds from the start of the recording, as
+ * in media fragment URIs) selects the chunks of an AVI file instead:
+ * from the keyframe at or before start up to the frame at end, found
+ * through the file's index (kept in the RTSP server's sidecar) and
+ * served as 200 OK. A Range header then selects bytes of those chunks.
+ */
+
+#define HTTP_SERVER_PORT			8080
+#define HTTP_SERVER_TIMEOUT			60			/* idle connection timeout in seconds */
+
+typedef struct http_server ty_http_server;
+
+/* cRootDir: directory the request path is resolved against,
+   e.g. http://ip:8080/2016/record_0001.avi -> <cRootDir>/2016/record_0001.avi */
+ty_http_server *http_server_new(struct event_base *pstBase, int iPort, const char *cRootDir);
+void http_server_free(ty_http_server *pstServer);
+
+#endif
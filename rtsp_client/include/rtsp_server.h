@@ -0,0 +1,36 @@
+#ifndef RTSP_SERVER_H_
+#define RTSP_SERVER_H_
+
+#include <event2/event.h>
+
+/*
+ * Minimal RTSP VOD server: plays recorded AVI files (avilib) back to
+ * RTSP clients as RTP interleaved over the RTSP TCP connection.
+ *
+ * Supported methods: OPTIONS, DESCRIBE, SETUP (RTP/AVP/TCP only),
+ * PLAY (with Range: npt=), PAUSE, GET_PARAMETER, TEARDOWN.
+ * Video: H.264 (RFC 6184, single NAL / FU-A).
+ * Audio: PCMU, PCMA and 16 bit PCM as L16.
+ *
+ * All sessions of a server share one event_base; frames are paced with
+ * one timer per session. File reads happen on that event loop too, so
+ * each session reads ahead of the frames it sends and the index of a
+ * file is kept in a sidecar (<file>.idx) written by the first session.
+ */
+
+#define RTSP_SERVER_PORT			554
+#define RTSP_SERVER_MAX_SESSIONS	1024
+#define RTSP_SERVER_RTP_MTU			1400		/* max RTP payload per packet */
+#define RTSP_SERVER_MAX_QUEUE		(2*1024*1024)	/* pause pacing above this many queued bytes */
+#define RTSP_SERVER_READAHEAD		(2*1024*1024)	/* read-ahead per session, see AVI_set_readahead */
+#define RTSP_SERVER_INDEX_EXT		".idx"			/* sidecar index next to each played file */
+
+typedef struct rtsp_server ty_rtsp_server;
+
+/* cRootDir: directory the request path is resolved against,
+   e.g. rtsp://ip:554/2016/record_0001.avi -> <cRootDir>/2016/record_0001.avi */
+ty_rtsp_server *rtsp_server_new(struct event_base *pstBase, int iPort, const char *cRootDir);
+void rtsp_server_free(ty_rtsp_server *pstServer);
+int rtsp_server_session_count(ty_rtsp_server *pstServer);
+
+#endif
@@ -0,0 +1,692 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <event2/buffer.h>
+
+#include "avilib.h"
+#include "avi_mp4.h"
+
+#define AVI_MP4_VIDEO_SCALE    90000
+#define AVI_MP4_AAC_SAMPLES    1024      /* per AAC frame */
+#define AVI_MP4_MAX_PS         256       /* SPS/PPS bytes kept */
+
+#define AVI_MP4_KEY            0x02000000    /* sample_depends_on 2 */
+#define AVI_MP4_NON_KEY        0x01010000    /* depends_on 1, non sync */
+
+typedef struct
+{
+   unsigned char *p;
+   size_t len;
+   size_t size;
+   int    err;
+} avi_mp4_buf_t;
+
+typedef struct
+{
+   u32    size;
+   u32    duration;
+   u32    flags;
+} avi_mp4_sample_t;
+
+typedef struct
+{
+   u32    id;
+   u32    timescale;
+   u64    dts;               /* decode time of the first pending sample */
+   avi_mp4_buf_t data;       /* pending sample data */
+   avi_mp4_sample_t *s;
+   int    n;
+   int    max;
+} avi_mp4_track_t;
+
+struct avi_mp4_s
+{
+   int    width;
+   int    height;
+   int    channels;          /* 0 without audio track */
+   int    rate;
+   int    bits;
+   int    format;
+   u32    frame_dur;         /* in AVI_MP4_VIDEO_SCALE */
+   unsigned char sps[AVI_MP4_MAX_PS];
+   unsigned char pps[AVI_MP4_MAX_PS];
+   int    sps_len;
+   int    pps_len;
+   int    started;           /* init segment written */
+   u32    seq;               /* of the last moof */
+   avi_mp4_buf_t init;       /* ftyp and moov */
+   avi_mp4_buf_t moof;
+   avi_mp4_track_t v;
+   avi_mp4_track_t a;
+   struct evbuffer *out;
+};
+
+/*******************************************************************
+ *                                                                 *
+ *    Boxes                                                        *
+ *                                                                 *
+ *******************************************************************/
+
+static unsigned char *mb_need(avi_mp4_buf_t *b, size_t n)
+{
+   unsigned char *p;
+   size_t size;
+
+   if(b->len + n > b->size)
+   {
+      size = b->size ? b->size : 4096;
+      while(size < b->len + n) size *= 2;
+      p = (unsigned char *)realloc(b->p, size);
+      if(p == NULL)
+      {
+         b->err = 1;
+         return NULL;
+      }
+      b->p = p;
+      b->size = size;
+   }
+   p = b->p + b->len;
+   b->len += n;
+   return p;
+}
+
+static void mb_put(avi_mp4_buf_t *b, const void *data, size_t n)
+{
+   unsigned char *p = mb_need(b, n);
+   if(p) memcpy(p, data, n);
+}
+
+static void mb_u8(avi_mp4_buf_t *b, u32 v)
+{
+   unsigned char *p = mb_need(b, 1);
+   if(p) p[0] = v;
+}
+
+static void mb_u16(avi_mp4_buf_t *b, u32 v)
+{
+   unsigned char *p = mb_need(b, 2);
+   if(p) { p[0] = v>>8; p[1] = v; }
+}
+
+static void mb_u24(avi_mp4_buf_t *b, u32 v)
+{
+   unsigned char *p = mb_need(b, 3);
+   if(p) { p[0] = v>>16; p[1] = v>>8; p[2] = v; }
+}
+
+static void mb_u32(avi_mp4_buf_t *b, u32 v)
+{
+   unsigned char *p = mb_need(b, 4);
+   if(p) { p[0] = v>>24; p[1] = v>>16; p[2] = v>>8; p[3] = v; }
+}
+
+static void mb_u64(avi_mp4_buf_t *b, u64 v)
+{
+   mb_u32(b, (u32)(v>>32));
+   mb_u32(b, (u32)v);
+}
+
+static void mb_zero(avi_mp4_buf_t *b, size_t n)
+{
+   unsigned char *p = mb_need(b, n);
+   if(p) memset(p, 0, n);
+}
+
+static void mb_set32(avi_mp4_buf_t *b, size_t off, u32 v)
+{
+   if(b->err) return;
+   b->p[off] = v>>24; b->p[off+1] = v>>16; b->p[off+2] = v>>8; b->p[off+3] = v;
+}
+
+/* Start a box, returns its offset for mb_end */
+static size_t mb_box(avi_mp4_buf_t *b, const char *type)
+{
+   size_t start = b->len;
+
+   mb_u32(b, 0);
+   mb_put(b, type, 4);
+   return start;
+}
+
+static size_t mb_fullbox(avi_mp4_buf_t *b, const char *type, int version, u32 flags)
+{
+   size_t start = mb_box(b, type);
+
+   mb_u8(b, version);
+   mb_u24(b, flags);
+   return start;
+}
+
+static void mb_end(avi_mp4_buf_t *b, size_t start)
+{
+   mb_set32(b, start, b->len - start);
+}
+
+static void mb_matrix(avi_mp4_buf_t *b)
+{
+   mb_u32(b, 0x00010000); mb_u32(b, 0); mb_u32(b, 0);
+   mb_u32(b, 0); mb_u32(b, 0x00010000); mb_u32(b, 0);
+   mb_u32(b, 0); mb_u32(b, 0); mb_u32(b, 0x40000000);
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Init segment                                                 *
+ *                                                                 *
+ *******************************************************************/
+
+static const u32 avi_mp4_aac_rates[] =
+{
+   96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+/* samplingFrequencyIndex of the AudioSpecificConfig, -1 if rate has none */
+static int avi_mp4_aac_rate(int rate)
+{
+   int i;
+
+   for(i = 0; i < (int)(sizeof(avi_mp4_aac_rates)/sizeof(avi_mp4_aac_rates[0])); i++)
+      if(avi_mp4_aac_rates[i] == (u32)rate) return i;
+   return -1;
+}
+
+static void avi_mp4_esds(avi_mp4_t *m, avi_mp4_buf_t *b)
+{
+   size_t esds;
+   int i = avi_mp4_aac_rate(m->rate);
+
+   esds = mb_fullbox(b, "esds", 0, 0);
+   mb_u8(b, 0x03);              /* ES_Descriptor */
+   mb_u8(b, 25);
+   mb_u16(b, m->a.id);
+   mb_u8(b, 0);
+   mb_u8(b, 0x04);              /* DecoderConfigDescriptor */
+   mb_u8(b, 17);
+   mb_u8(b, 0x40);              /* MPEG-4 audio */
+   mb_u8(b, 0x15);              /* audio stream */
+   mb_u24(b, 0);                /* bufferSizeDB */
+   mb_u32(b, 0);                /* maxBitrate */
+   mb_u32(b, 0);                /* avgBitrate */
+   mb_u8(b, 0x05);              /* DecoderSpecificInfo: AAC-LC AudioSpecificConfig */
+   mb_u8(b, 2);
+   mb_u8(b, (2<<3) | (i>>1));
+   mb_u8(b, ((i&1)<<7) | (m->channels<<3));
+   mb_u8(b, 0x06);              /* SLConfigDescriptor */
+   mb_u8(b, 1);
+   mb_u8(b, 0x02);
+   mb_end(b, esds);
+}
+
+static void avi_mp4_trak(avi_mp4_t *m, avi_mp4_buf_t *b, avi_mp4_track_t *t)
+{
+   size_t trak, mdia, minf, dinf, stbl, stsd, entry, box;
+   int video = (t == &m->v);
+
+   trak = mb_box(b, "trak");
+
+   box = mb_fullbox(b, "tkhd", 0, 3);      /* enabled, in movie */
+   mb_u32(b, 0);                /* creation_time */
+   mb_u32(b, 0);                /* modification_time */
+   mb_u32(b, t->id);
+   mb_u32(b, 0);
+   mb_u32(b, 0);                /* duration */
+   mb_zero(b, 8);
+   mb_u16(b, 0);                /* layer */
+   mb_u16(b, 0);                /* alternate_group */
+   mb_u16(b, video ? 0 : 0x0100);   /* volume */
+   mb_u16(b, 0);
+   mb_matrix(b);
+   mb_u32(b, video ? m->width<<16 : 0);
+   mb_u32(b, video ? m->height<<16 : 0);
+   mb_end(b, box);
+
+   mdia = mb_box(b, "mdia");
+   box = mb_fullbox(b, "mdhd", 0, 0);
+   mb_u32(b, 0);
+   mb_u32(b, 0);
+   mb_u32(b, t->timescale);
+   mb_u32(b, 0);                /* duration */
+   mb_u16(b, 0x55c4);           /* und */
+   mb_u16(b, 0);
+   mb_end(b, box);
+
+   box = mb_fullbox(b, "hdlr", 0, 0);
+   mb_u32(b, 0);
+   mb_put(b, video ? "vide" : "soun", 4);
+   mb_zero(b, 12);
+   mb_put(b, video ? "VideoHandler" : "SoundHandler", 13);
+   mb_end(b, box);
+
+   minf = mb_box(b, "minf");
+   if(video)
+   {
+      box = mb_fullbox(b, "vmhd", 0, 1);
+      mb_zero(b, 8);            /* graphicsmode, opcolor */
+   }
+   else
+   {
+      box = mb_fullbox(b, "smhd", 0, 0);
+      mb_zero(b, 4);            /* balance */
+   }
+   mb_end(b, box);
+
+   dinf = mb_box(b, "dinf");
+   box = mb_fullbox(b, "dref", 0, 0);
+   mb_u32(b, 1);
+   mb_end(b, mb_fullbox(b, "url ", 0, 1));  /* in this file */
+   mb_end(b, box);
+   mb_end(b, dinf);
+
+   stbl = mb_box(b, "stbl");
+   stsd = mb_fullbox(b, "stsd", 0, 0);
+   mb_u32(b, 1);
+   if(video)
+   {
+      entry = mb_box(b, "avc1");
+      mb_zero(b, 6);
+      mb_u16(b, 1);             /* data_reference_index */
+      mb_zero(b, 16);
+      mb_u16(b, m->width);
+      mb_u16(b, m->height);
+      mb_u32(b, 0x00480000);    /* 72 dpi */
+      mb_u32(b, 0x00480000);
+      mb_u32(b, 0);
+      mb_u16(b, 1);             /* frame_count */
+      mb_zero(b, 32);           /* compressorname */
+      mb_u16(b, 0x0018);        /* depth */
+      mb_u16(b, 0xffff);
+
+      box = mb_box(b, "avcC");
+      mb_u8(b, 1);
+      mb_u8(b, m->sps[1]);      /* profile */
+      mb_u8(b, m->sps[2]);      /* compatibility */
+      mb_u8(b, m->sps[3]);      /* level */
+      mb_u8(b, 0xff);           /* 4 byte NAL lengths */
+      mb_u8(b, 0xe1);           /* 1 SPS */
+      mb_u16(b, m->sps_len);
+      mb_put(b, m->sps, m->sps_len);
+      mb_u8(b, 1);              /* 1 PPS */
+      mb_u16(b, m->pps_len);
+      mb_put(b, m->pps, m->pps_len);
+      mb_end(b, box);
+   }
+   else
+   {
+      switch(m->format)
+      {
+         case WAVE_FORMAT_AAC:   entry = mb_box(b, "mp4a"); break;
+         case WAVE_FORMAT_ALAW:  entry = mb_box(b, "alaw"); break;
+         case WAVE_FORMAT_MULAW: entry = mb_box(b, "ulaw"); break;
+         default:                entry = mb_box(b, "sowt"); break;
+      }
+      mb_zero(b, 6);
+      mb_u16(b, 1);             /* data_reference_index */
+      mb_zero(b, 8);
+      mb_u16(b, m->channels);
+      mb_u16(b, 16);            /* samplesize */
+      mb_u32(b, 0);
+      mb_u32(b, (u32)m->rate<<16);
+      if(m->format == WAVE_FORMAT_AAC) avi_mp4_esds(m, b);
+   }
+   mb_end(b, entry);
+   mb_end(b, stsd);
+
+   /* the samples are in the fragments */
+   box = mb_fullbox(b, "stts", 0, 0); mb_u32(b, 0); mb_end(b, box);
+   box = mb_fullbox(b, "stsc", 0, 0); mb_u32(b, 0); mb_end(b, box);
+   box = mb_fullbox(b, "stsz", 0, 0); mb_u32(b, 0); mb_u32(b, 0); mb_end(b, box);
+   box = mb_fullbox(b, "stco", 0, 0); mb_u32(b, 0); mb_end(b, box);
+   mb_end(b, stbl);
+
+   mb_end(b, minf);
+   mb_end(b, mdia);
+   mb_end(b, trak);
+}
+
+static int avi_mp4_build_init(avi_mp4_t *m)
+{
+   avi_mp4_buf_t *b = &m->init;
+   size_t box, moov, mvex;
+
+   b->len = 0;
+
+   box = mb_box(b, "ftyp");
+   mb_put(b, "iso5", 4);
+   mb_u32(b, 512);
+   mb_put(b, "iso5iso6avc1mp41", 16);
+   mb_end(b, box);
+
+   moov = mb_box(b, "moov");
+   box = mb_fullbox(b, "mvhd", 0, 0);
+   mb_u32(b, 0);
+   mb_u32(b, 0);
+   mb_u32(b, 1000);             /* timescale */
+   mb_u32(b, 0);                /* duration */
+   mb_u32(b, 0x00010000);       /* rate */
+   mb_u16(b, 0x0100);           /* volume */
+   mb_zero(b, 10);
+   mb_matrix(b);
+   mb_zero(b, 24);
+   mb_u32(b, m->channels ? 3 : 2);  /* next_track_ID */
+   mb_end(b, box);
+
+   avi_mp4_trak(m, b, &m->v);
+   if(m->channels) avi_mp4_trak(m, b, &m->a);
+
+   mvex = mb_box(b, "mvex");
+   box = mb_fullbox(b, "trex", 0, 0);
+   mb_u32(b, m->v.id); mb_u32(b, 1); mb_u32(b, 0); mb_u32(b, 0); mb_u32(b, 0);
+   mb_end(b, box);
+   if(m->channels)
+   {
+      box = mb_fullbox(b, "trex", 0, 0);
+      mb_u32(b, m->a.id); mb_u32(b, 1); mb_u32(b, 0); mb_u32(b, 0); mb_u32(b, 0);
+      mb_end(b, box);
+   }
+   mb_end(b, mvex);
+   mb_end(b, moov);
+
+   return b->err ? -1 : 0;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Fragments                                                    *
+ *                                                                 *
+ *******************************************************************/
+
+static int avi_mp4_sample(avi_mp4_track_t *t, u32 size, u32 duration, u32 flags)
+{
+   avi_mp4_sample_t *s;
+
+   if(t->n == t->max)
+   {
+      s = (avi_mp4_sample_t *)realloc(t->s, (t->max ? t->max*2 : 64)*sizeof(avi_mp4_sample_t));
+      if(s == NULL) return -1;
+      t->s = s;
+      t->max = t->max ? t->max*2 : 64;
+   }
+   t->s[t->n].size = size;
+   t->s[t->n].duration = duration;
+   t->s[t->n].flags = flags;
+   t->n++;
+   return 0;
+}
+
+/* Drop what a failed write added to the track since n samples and len
+   bytes, so that the fragment stays consistent */
+static int avi_mp4_undo(avi_mp4_track_t *t, int n, size_t len)
+{
+   t->n = n;
+   t->data.len = len;
+   t->data.err = 0;
+   return -1;
+}
+
+static void avi_mp4_traf(avi_mp4_buf_t *b, avi_mp4_track_t *t, size_t *data_offset)
+{
+   size_t traf, box;
+   int i;
+
+   traf = mb_box(b, "traf");
+   box = mb_fullbox(b, "tfhd", 0, 0x020000);    /* default-base-is-moof */
+   mb_u32(b, t->id);
+   mb_end(b, box);
+
+   box = mb_fullbox(b, "tfdt", 1, 0);
+   mb_u64(b, t->dts);
+   mb_end(b, box);
+
+   box = mb_fullbox(b, "trun", 0, 0x000701);    /* data offset, duration, size, flags */
+   mb_u32(b, t->n);
+   *data_offset = b->len;
+   mb_u32(b, 0);
+   for(i = 0; i < t->n; i++)
+   {
+      mb_u32(b, t->s[i].duration);
+      mb_u32(b, t->s[i].size);
+      mb_u32(b, t->s[i].flags);
+   }
+   mb_end(b, box);
+   mb_end(b, traf);
+}
+
+static void avi_mp4_done(avi_mp4_track_t *t)
+{
+   int i;
+
+   for(i = 0; i < t->n; i++) t->dts += t->s[i].duration;
+   t->n = 0;
+   t->data.len = 0;
+}
+
+int AVI_mp4_flush(avi_mp4_t *m)
+{
+   avi_mp4_buf_t *b = &m->moof;
+   size_t moof, box, voff = 0, aoff = 0;
+   unsigned char mdat[8];
+   u32 mdat_len;
+   int ret = 0;
+
+   if(m->v.n == 0 && m->a.n == 0) return 0;
+
+   b->len = 0;
+   moof = mb_box(b, "moof");
+   box = mb_fullbox(b, "mfhd", 0, 0);
+   mb_u32(b, ++m->seq);
+   mb_end(b, box);
+   if(m->v.n) avi_mp4_traf(b, &m->v, &voff);
+   if(m->a.n) avi_mp4_traf(b, &m->a, &aoff);
+   mb_end(b, moof);
+
+   /* samples start behind the mdat header, video first */
+   if(m->v.n) mb_set32(b, voff, b->len + 8);
+   if(m->a.n) mb_set32(b, aoff, b->len + 8 + m->v.data.len);
+
+   mdat_len = 8 + m->v.data.len + m->a.data.len;
+   mdat[0] = mdat_len>>24; mdat[1] = mdat_len>>16; mdat[2] = mdat_len>>8; mdat[3] = mdat_len;
+   memcpy(mdat+4, "mdat", 4);
+
+   if(b->err || m->v.data.err || m->a.data.err ||
+      evbuffer_add(m->out, b->p, b->len) ||
+      evbuffer_add(m->out, mdat, 8) ||
+      evbuffer_add(m->out, m->v.data.p, m->v.data.len) ||
+      evbuffer_add(m->out, m->a.data.p, m->a.data.len))
+      ret = -1;
+
+   b->err = m->v.data.err = m->a.data.err = 0;
+   avi_mp4_done(&m->v);
+   avi_mp4_done(&m->a);
+   return ret;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Input                                                        *
+ *                                                                 *
+ *******************************************************************/
+
+avi_mp4_t *AVI_mp4_new(int width, int height, int fps, const char *compressor,
+                       int channels, int rate, int bits, int format)
+{
+   avi_mp4_t *m;
+
+   if(strncasecmp(compressor, "H264", 4) != 0 && strncasecmp(compressor, "AVC1", 4) != 0)
+      return NULL;
+   if(channels > 0 && (rate <= 0 || rate > 65535)) return NULL;
+   if(channels > 0 && format == WAVE_FORMAT_AAC && avi_mp4_aac_rate(rate) < 0) return NULL;
+
+   m = (avi_mp4_t *)calloc(1, sizeof(avi_mp4_t));
+   if(m == NULL) return NULL;
+   m->out = evbuffer_new();
+   if(m->out == NULL)
+   {
+      free(m);
+      return NULL;
+   }
+
+   m->width = width;
+   m->height = height;
+   m->frame_dur = AVI_MP4_VIDEO_SCALE/(fps > 0 ? fps : 25);
+   m->channels = channels > 0 ? channels : 0;
+   m->rate = rate;
+   m->bits = bits;
+   m->format = format;
+   m->v.id = 1;
+   m->v.timescale = AVI_MP4_VIDEO_SCALE;
+   m->a.id = 2;
+   m->a.timescale = rate;
+
+   return m;
+}
+
+void AVI_mp4_free(avi_mp4_t *m)
+{
+   if(m == NULL) return;
+   evbuffer_free(m->out);
+   free(m->init.p);
+   free(m->moof.p);
+   free(m->v.data.p);
+   free(m->v.s);
+   free(m->a.data.p);
+   free(m->a.s);
+   free(m);
+}
+
+struct evbuffer *AVI_mp4_output(avi_mp4_t *m)
+{
+   return m->out;
+}
+
+int AVI_mp4_init_segment(avi_mp4_t *m, struct evbuffer *out)
+{
+   if(!m->started) return -1;
+   return evbuffer_add(out, m->init.p, m->init.len);
+}
+
+/* Next NAL unit of an Annex B buffer at or after *pos, 0 at the end */
+static int avi_mp4_nal(unsigned char *data, int bytes, int *pos, unsigned char **nal, int *len)
+{
+   int i = *pos, start;
+
+   while(i+3 <= bytes && !(data[i] == 0 && data[i+1] == 0 && data[i+2] == 1)) i++;
+   if(i+3 > bytes) return 0;
+   start = i+3;
+
+   i = start;
+   while(i+3 <= bytes && !(data[i] == 0 && data[i+1] == 0 && (data[i+2] == 1 || data[i+2] == 0))) i++;
+   if(i+3 > bytes) i = bytes;
+
+   *nal = data + start;
+   *len = i - start;
+   *pos = i;
+   return 1;
+}
+
+int AVI_mp4_write_frame(avi_mp4_t *m, unsigned char *data, int bytes, unsigned int rt)
+{
+   unsigned char *nal, *p;
+   int pos, len, type, key, size;
+   size_t start;
+
+   (void)rt;
+
+   key = 0;
+   pos = 0;
+   while(avi_mp4_nal(data, bytes, &pos, &nal, &len))
+   {
+      if(len <= 0) continue;
+      type = nal[0] & 0x1f;
+      if(type == 5) key = 1;
+      if(type == 7 && m->sps_len == 0 && len >= 4 && len <= AVI_MP4_MAX_PS)
+      {
+         memcpy(m->sps, nal, len);
+         m->sps_len = len;
+      }
+      if(type == 8 && m->pps_len == 0 && len <= AVI_MP4_MAX_PS)
+      {
+         memcpy(m->pps, nal, len);
+         m->pps_len = len;
+      }
+   }
+
+   if(!m->started)
+   {
+      if(!key || m->sps_len == 0 || m->pps_len == 0) return 0;
+      if(avi_mp4_build_init(m) || evbuffer_add(m->out, m->init.p, m->init.len)) return -1;
+      m->started = 1;
+   }
+   else if(key && m->v.n > 0)
+   {
+      if(AVI_mp4_flush(m)) return -1;
+   }
+
+   /* length prefixed NAL units, the parameter sets are in avcC */
+   start = m->v.data.len;
+   size = 0;
+   pos = 0;
+   while(avi_mp4_nal(data, bytes, &pos, &nal, &len))
+   {
+      type = len > 0 ? nal[0] & 0x1f : 0;
+      if(len <= 0 || type == 7 || type == 8 || type == 9) continue;
+      p = mb_need(&m->v.data, 4 + len);
+      if(p == NULL) return avi_mp4_undo(&m->v, m->v.n, start);
+      p[0] = len>>24; p[1] = len>>16; p[2] = len>>8; p[3] = len;
+      memcpy(p+4, nal, len);
+      size += 4 + len;
+   }
+   if(size == 0) return 0;
+
+   if(avi_mp4_sample(&m->v, size, m->frame_dur, key ? AVI_MP4_KEY : AVI_MP4_NON_KEY))
+      return avi_mp4_undo(&m->v, m->v.n, start);
+   return 0;
+}
+
+int AVI_mp4_write_audio(avi_mp4_t *m, unsigned char *data, int bytes, unsigned int rt)
+{
+   int hdr, len, sampsize, n;
+   size_t start;
+
+   (void)rt;
+
+   if(!m->started || m->channels == 0 || bytes <= 0) return 0;
+
+   /* a failed chunk takes back its samples, ADTS frames before it too */
+   n = m->a.n;
+   start = m->a.data.len;
+
+   if(m->format != WAVE_FORMAT_AAC)
+   {
+      if(m->format == WAVE_FORMAT_ALAW || m->format == WAVE_FORMAT_MULAW)
+         sampsize = m->channels;
+      else
+         sampsize = ((m->bits+7)/8)*m->channels;
+      mb_put(&m->a.data, data, bytes);
+      if(m->a.data.err || avi_mp4_sample(&m->a, bytes, bytes/sampsize, AVI_MP4_KEY))
+         return avi_mp4_undo(&m->a, n, start);
+      return 0;
+   }
+
+   /* raw AAC frame, or ADTS frames without their headers */
+   if(bytes < 7 || data[0] != 0xff || (data[1] & 0xf6) != 0xf0)
+   {
+      mb_put(&m->a.data, data, bytes);
+      if(m->a.data.err || avi_mp4_sample(&m->a, bytes, AVI_MP4_AAC_SAMPLES, AVI_MP4_KEY))
+         return avi_mp4_undo(&m->a, n, start);
+      return 0;
+   }
+   while(bytes >= 7 && data[0] == 0xff && (data[1] & 0xf6) == 0xf0)
+   {
+      hdr = (data[1] & 1) ? 7 : 9;
+      len = ((data[3] & 3)<<11) | (data[4]<<3) | (data[5]>>5);
+      if(len <= hdr || len > bytes) break;
+      mb_put(&m->a.data, data + hdr, len - hdr);
+      if(m->a.data.err || avi_mp4_sample(&m->a, len - hdr, AVI_MP4_AAC_SAMPLES, AVI_MP4_KEY))
+         return avi_mp4_undo(&m->a, n, start);
+      data  += len;
+      bytes -= len;
+   }
+   return 0;
+}
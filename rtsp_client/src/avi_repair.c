@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "avilib.h"
+#include "avi_repair.h"
+
+typedef struct
+{
+   char  *name;
+   time_t mtime;
+} avi_repair_file_t;
+
+typedef struct
+{
+   dev_t  dev;
+   avi_repair_file_t *f;     /* newest first after the scan */
+   long   n;
+   long   max;
+   long   next;              /* first file not taken yet */
+   int    busy;              /* files in work */
+} avi_repair_dev_t;
+
+typedef struct
+{
+   avi_repair_conf_t conf;
+   avi_repair_dev_t *devs;
+   int    ndevs;
+   avi_repair_stats_t st;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   pthread_mutex_t done_lock;    /* conf.done one at a time, outside lock */
+} avi_repair_t;
+
+typedef struct
+{
+   avi_repair_t *r;
+   int    home;              /* index of the own device */
+} avi_repair_worker_t;
+
+static long avi_repair_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Scan                                                         *
+ *                                                                 *
+ *******************************************************************/
+
+static int avi_repair_add(avi_repair_t *r, char *name, struct stat *s)
+{
+   avi_repair_dev_t *d;
+   void *p;
+   int i;
+
+   for(i = 0; i < r->ndevs && r->devs[i].dev != s->st_dev; i++);
+   if(i == r->ndevs)
+   {
+      p = realloc(r->devs, (r->ndevs+1)*sizeof(avi_repair_dev_t));
+      if(p == NULL) return -1;
+      r->devs = (avi_repair_dev_t *)p;
+      memset(&r->devs[i], 0, sizeof(avi_repair_dev_t));
+      r->devs[i].dev = s->st_dev;
+      r->ndevs++;
+   }
+   d = &r->devs[i];
+
+   if(d->n == d->max)
+   {
+      p = realloc(d->f, (d->max ? d->max*2 : 256)*sizeof(avi_repair_file_t));
+      if(p == NULL) return -1;
+      d->f = (avi_repair_file_t *)p;
+      d->max = d->max ? d->max*2 : 256;
+   }
+   d->f[d->n].name = name;
+   d->f[d->n].mtime = s->st_mtime;
+   d->n++;
+   r->st.files++;
+
+   return 0;
+}
+
+static int avi_repair_scan(avi_repair_t *r, const char *dir)
+{
+   DIR *dp;
+   struct dirent *e;
+   struct stat s;
+   char *name;
+   size_t len;
+   int ret = 0;
+
+   dp = opendir(dir);
+   if(dp == NULL)
+   {
+      printf("repair: can't open %s\n", dir);
+      return 0;
+   }
+   while(ret == 0 && (e = readdir(dp)) != NULL)
+   {
+      if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+
+      len = strlen(e->d_name);
+      name = (char *)malloc(strlen(dir) + len + 2);
+      if(name == NULL) { ret = -1; break; }
+      sprintf(name, "%s/%s", dir, e->d_name);
+
+      /* links are not followed: one to a parent would never end */
+      if(lstat(name, &s) != 0)
+         free(name);
+      else if(S_ISDIR(s.st_mode))
+      {
+         ret = avi_repair_scan(r, name);
+         free(name);
+      }
+      else if(S_ISREG(s.st_mode) && len > 4 && strcasecmp(e->d_name + len - 4, ".avi") == 0)
+      {
+         if((ret = avi_repair_add(r, name, &s)) != 0) free(name);
+      }
+      else
+         free(name);
+   }
+   closedir(dp);
+
+   return ret;
+}
+
+static int avi_repair_newer(const void *a, const void *b)
+{
+   const avi_repair_file_t *fa = (const avi_repair_file_t *)a;
+   const avi_repair_file_t *fb = (const avi_repair_file_t *)b;
+
+   if(fa->mtime != fb->mtime) return fa->mtime > fb->mtime ? -1 : 1;
+   return strcmp(fb->name, fa->name);
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Workers                                                      *
+ *                                                                 *
+ *******************************************************************/
+
+/* *err gets the errno of this thread if the file was unable or failed:
+   AVI_errno is shared by all workers and says nothing about the file */
+
+static int avi_repair_file(avi_repair_t *r, char *name, int *err)
+{
+   unsigned int tm_len = 0;
+   int ret;
+
+   *err = 0;
+   errno = 0;
+   ret = AVI_check_file(name);
+   if(ret == 0) return AVI_REPAIR_VALID;
+   if(ret == RECORD_UNABLE_DEFORM)
+   {
+      *err = errno;
+      return AVI_REPAIR_UNABLE;
+   }
+
+   errno = 0;
+   ret = AVI_deformity_file(name, r->conf.duration, &tm_len);
+   if(ret == RECORD_DEFORM_SUCCESS) return AVI_REPAIR_FIXED;
+   *err = errno;
+   if(ret == RECORD_UNABLE_DEFORM) return AVI_REPAIR_UNABLE;
+   return AVI_REPAIR_FAILED;
+}
+
+/* Device to take the next file from, called with the lock held: the
+   home device if it has a file and a free slot, otherwise the one with
+   the newest next file among those that have. NULL if none has. */
+
+static avi_repair_dev_t *avi_repair_pick(avi_repair_t *r, int home)
+{
+   avi_repair_dev_t *d, *best = NULL;
+   int i;
+
+   d = &r->devs[home];
+   if(d->next < d->n && d->busy < r->conf.per_device) return d;
+
+   for(i = 0; i < r->ndevs; i++)
+   {
+      d = &r->devs[i];
+      if(d->next >= d->n || d->busy >= r->conf.per_device) continue;
+      if(best == NULL || d->f[d->next].mtime > best->f[best->next].mtime) best = d;
+   }
+   return best;
+}
+
+static int avi_repair_left(avi_repair_t *r)
+{
+   int i;
+
+   for(i = 0; i < r->ndevs; i++)
+      if(r->devs[i].next < r->devs[i].n) return 1;
+   return 0;
+}
+
+static void *avi_repair_thread(void *arg)
+{
+   avi_repair_worker_t *w = (avi_repair_worker_t *)arg;
+   avi_repair_t *r = w->r;
+   avi_repair_dev_t *d;
+   char *name;
+   int ret, err;
+
+   pthread_mutex_lock(&r->lock);
+   while(avi_repair_left(r))
+   {
+      if((d = avi_repair_pick(r, w->home)) == NULL)
+      {
+         /* all devices with files left are at their limit */
+         pthread_cond_wait(&r->cond, &r->lock);
+         continue;
+      }
+      name = d->f[d->next++].name;
+      d->busy++;
+      pthread_mutex_unlock(&r->lock);
+
+      ret = avi_repair_file(r, name, &err);
+
+      pthread_mutex_lock(&r->lock);
+      d->busy--;
+      r->st.done++;
+      switch(ret)
+      {
+         case AVI_REPAIR_VALID: r->st.valid++; break;
+         case AVI_REPAIR_FIXED: r->st.fixed++; break;
+         case AVI_REPAIR_UNABLE: r->st.unable++; break;
+         default: r->st.failed++; break;
+      }
+      pthread_cond_broadcast(&r->cond);
+
+      if(r->conf.done)
+      {
+         pthread_mutex_unlock(&r->lock);
+         pthread_mutex_lock(&r->done_lock);
+         r->conf.done(name, ret, err, r->conf.arg);
+         pthread_mutex_unlock(&r->done_lock);
+         pthread_mutex_lock(&r->lock);
+      }
+   }
+   pthread_mutex_unlock(&r->lock);
+
+   return NULL;
+}
+
+static void avi_repair_report(avi_repair_t *r, long start)
+{
+   printf("repair: %ld/%ld files, %ld valid, %ld fixed, %ld failed, %ld unable, %ld ms\n",
+          r->st.done, r->st.files, r->st.valid, r->st.fixed, r->st.failed, r->st.unable,
+          avi_repair_ms() - start);
+}
+
+int AVI_repair_dirs(char **dirs, int n, const avi_repair_conf_t *conf, avi_repair_stats_t *st)
+{
+   avi_repair_t r;
+   avi_repair_worker_t *w = NULL;
+   pthread_t *th = NULL;
+   struct timespec ts;
+   long start, i;
+   int nth, ret = -1;
+
+   start = avi_repair_ms();
+   memset(&r, 0, sizeof(r));
+   if(conf) r.conf = *conf;
+   if(r.conf.threads <= 0) r.conf.threads = AVI_REPAIR_THREADS;
+   if(r.conf.per_device <= 0) r.conf.per_device = AVI_REPAIR_PER_DEVICE;
+   if(r.conf.report_ms == 0) r.conf.report_ms = AVI_REPAIR_REPORT_MS;
+   pthread_mutex_init(&r.lock, NULL);
+   pthread_cond_init(&r.cond, NULL);
+   pthread_mutex_init(&r.done_lock, NULL);
+
+   for(i = 0; i < n; i++)
+      if(avi_repair_scan(&r, dirs[i])) goto __exit_repair;
+   for(i = 0; i < r.ndevs; i++)
+      qsort(r.devs[i].f, r.devs[i].n, sizeof(avi_repair_file_t), avi_repair_newer);
+
+   /* no more workers than files can be in work */
+   nth = r.conf.threads;
+   if(nth > r.ndevs*r.conf.per_device) nth = r.ndevs*r.conf.per_device;
+   if(nth > r.st.files) nth = r.st.files;
+
+   w = (avi_repair_worker_t *)calloc(nth ? nth : 1, sizeof(avi_repair_worker_t));
+   th = (pthread_t *)calloc(nth ? nth : 1, sizeof(pthread_t));
+   if(w == NULL || th == NULL) goto __exit_repair;
+
+   for(i = 0; i < nth; i++)
+   {
+      w[i].r = &r;
+      w[i].home = i % r.ndevs;
+      if(pthread_create(&th[i], NULL, avi_repair_thread, &w[i]) != 0) break;
+   }
+   if(i < nth)
+   {
+      /* run with the workers that started, none left: give up */
+      nth = i;
+      if(nth == 0) goto __exit_repair;
+   }
+
+   pthread_mutex_lock(&r.lock);
+   while(r.st.done < r.st.files)
+   {
+      if(r.conf.report_ms < 0)
+      {
+         pthread_cond_wait(&r.cond, &r.lock);
+         continue;
+      }
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec  += r.conf.report_ms/1000;
+      ts.tv_nsec += (r.conf.report_ms%1000)*1000000L;
+      if(ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+      if(pthread_cond_timedwait(&r.cond, &r.lock, &ts) == ETIMEDOUT)
+         avi_repair_report(&r, start);
+   }
+   pthread_mutex_unlock(&r.lock);
+
+   for(i = 0; i < nth; i++) pthread_join(th[i], NULL);
+   ret = r.st.failed;
+
+__exit_repair:
+   r.st.elapsed_ms = avi_repair_ms() - start;
+   if(r.conf.report_ms >= 0) avi_repair_report(&r, start);
+   if(st) *st = r.st;
+
+   for(i = 0; i < r.ndevs; i++)
+   {
+      while(r.devs[i].n > 0) free(r.devs[i].f[--r.devs[i].n].name);
+      free(r.devs[i].f);
+   }
+   free(r.devs);
+   free(w);
+   free(th);
+   pthread_cond_destroy(&r.cond);
+   pthread_mutex_destroy(&r.lock);
+   pthread_mutex_destroy(&r.done_lock);
+
+   return ret;
+}
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "avilib.h"
+#include "avi_segment.h"
+
+#define AVI_SEGMENT_RETRY_SEC  1     /* wait after a failed AVI_Init_fd_fast */
+
+typedef struct avi_seg_file_s
+{
+   avi_t  avi;
+   char   name[AVI_SEGMENT_NAME];
+   struct avi_seg_file_s *next;
+} avi_seg_file_t;
+
+struct avi_segment_s
+{
+   avi_segment_conf_t conf;
+   char  *pattern;
+   char   compressor[8];
+   int    seq;               /* number of the next file to create */
+
+   avi_seg_file_t *cur;      /* only used by the media thread */
+
+   /* shared with the worker, under lock */
+   avi_seg_file_t *next;     /* created ahead */
+   avi_seg_file_t *done;     /* to be finished, oldest first */
+   int    failed;            /* the last create failed, wait before retrying */
+   int    stop;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+};
+
+static avi_seg_file_t *avi_seg_create(avi_segment_t *s, int seq)
+{
+   avi_seg_file_t *f;
+
+   f = (avi_seg_file_t *)calloc(1, sizeof(avi_seg_file_t));
+   if(f == NULL) return NULL;
+   snprintf(f->name, sizeof(f->name), s->pattern, seq);
+
+   if(AVI_Init_fd_fast(&f->avi, s->conf.width, s->conf.height, s->conf.fps,
+                       s->compressor, s->conf.max_sec, f->name) < 0)
+   {
+      free(f);
+      return NULL;
+   }
+   if(s->conf.channels > 0)
+      AVI_set_audio(&f->avi, s->conf.channels, s->conf.rate, s->conf.bits, s->conf.format);
+
+   return f;
+}
+
+/* A file that never got a chunk is removed instead of finished */
+
+static void avi_seg_discard(avi_seg_file_t *f)
+{
+   close(f->avi.fdes);
+   f->avi.fdes = -1;
+   AVI_close(&f->avi);
+   unlink(f->name);
+   free(f);
+}
+
+static void avi_seg_finish(avi_segment_t *s, avi_seg_file_t *f)
+{
+   int ret;
+
+   if(f->avi.n_idx == 0)
+   {
+      avi_seg_discard(f);
+      return;
+   }
+
+   ret = AVI_close_fd_1(&f->avi);
+   if(s->conf.done) s->conf.done(f->name, ret, s->conf.arg);
+   free(f);
+}
+
+static void *avi_seg_thread(void *arg)
+{
+   avi_segment_t *s = (avi_segment_t *)arg;
+   avi_seg_file_t *f;
+   struct timespec ts;
+
+   pthread_mutex_lock(&s->lock);
+   for(;;)
+   {
+      if(s->done != NULL)
+      {
+         f = s->done;
+         s->done = f->next;
+         pthread_mutex_unlock(&s->lock);
+         avi_seg_finish(s, f);
+         pthread_mutex_lock(&s->lock);
+         continue;
+      }
+      if(s->stop) break;
+
+      if(s->next == NULL && !s->failed)
+      {
+         pthread_mutex_unlock(&s->lock);
+         f = avi_seg_create(s, s->seq);
+         pthread_mutex_lock(&s->lock);
+         if(f != NULL)
+         {
+            s->seq++;
+            s->next = f;
+         }
+         else
+         {
+            printf("segment %d not created, retrying\n", s->seq);
+            s->failed = 1;
+         }
+         continue;
+      }
+
+      if(s->failed)
+      {
+         clock_gettime(CLOCK_REALTIME, &ts);
+         ts.tv_sec += AVI_SEGMENT_RETRY_SEC;
+         if(pthread_cond_timedwait(&s->cond, &s->lock, &ts) == ETIMEDOUT)
+            s->failed = 0;
+      }
+      else
+         pthread_cond_wait(&s->cond, &s->lock);
+   }
+   f = s->next;
+   s->next = NULL;
+   pthread_mutex_unlock(&s->lock);
+
+   if(f != NULL) avi_seg_discard(f);
+
+   return NULL;
+}
+
+/* Queue f for the worker, called with the lock held */
+
+static void avi_seg_queue(avi_segment_t *s, avi_seg_file_t *f)
+{
+   avi_seg_file_t **p;
+
+   f->next = NULL;
+   for(p = &s->done; *p != NULL; p = &(*p)->next);
+   *p = f;
+   pthread_cond_signal(&s->cond);
+}
+
+static int avi_seg_due(avi_segment_t *s, unsigned int rt)
+{
+   avi_t *AVI = &s->cur->avi;
+
+   if(AVI->video_frames == 0) return 0;
+   if(s->conf.max_sec > 0 && rt - AVI->bt >= (unsigned int)s->conf.max_sec) return 1;
+   if(s->conf.max_bytes > 0 && AVI->pos >= s->conf.max_bytes) return 1;
+   return 0;
+}
+
+avi_segment_t *AVI_segment_open(const avi_segment_conf_t *conf)
+{
+   avi_segment_t *s;
+
+   if(conf->pattern == NULL || conf->compressor == NULL) return NULL;
+
+   s = (avi_segment_t *)calloc(1, sizeof(avi_segment_t));
+   if(s == NULL) return NULL;
+   s->conf = *conf;
+   s->pattern = strdup(conf->pattern);
+   if(s->pattern == NULL) goto __exit_open;
+   s->conf.pattern = s->pattern;
+   memcpy(s->compressor, conf->compressor, 4);
+   s->conf.compressor = s->compressor;
+   s->seq = conf->first;
+
+   s->cur = avi_seg_create(s, s->seq);
+   if(s->cur == NULL) goto __exit_open;
+   s->seq++;
+
+   pthread_mutex_init(&s->lock, NULL);
+   pthread_cond_init(&s->cond, NULL);
+   if(pthread_create(&s->thread, NULL, avi_seg_thread, s) != 0)
+   {
+      pthread_cond_destroy(&s->cond);
+      pthread_mutex_destroy(&s->lock);
+      avi_seg_discard(s->cur);
+      goto __exit_open;
+   }
+
+   return s;
+
+__exit_open:
+   free(s->pattern);
+   free(s);
+   return NULL;
+}
+
+int AVI_segment_write_frame(avi_segment_t *s, unsigned char *data, int bytes, unsigned int rt)
+{
+   if(avi_seg_due(s, rt) && AVI_frame_is_key(&s->cur->avi, data, bytes))
+   {
+      pthread_mutex_lock(&s->lock);
+      if(s->next != NULL)
+      {
+         avi_seg_queue(s, s->cur);
+         s->cur = s->next;
+         s->next = NULL;
+      }
+      pthread_mutex_unlock(&s->lock);
+   }
+
+   return AVI_write_frame(&s->cur->avi, data, bytes, rt);
+}
+
+int AVI_segment_write_audio(avi_segment_t *s, unsigned char *data, int bytes, unsigned int rt)
+{
+   return AVI_write_audio(&s->cur->avi, data, bytes, rt);
+}
+
+const char *AVI_segment_file(avi_segment_t *s)
+{
+   return s->cur->name;
+}
+
+int AVI_segment_close(avi_segment_t *s)
+{
+   pthread_mutex_lock(&s->lock);
+   avi_seg_queue(s, s->cur);
+   s->cur = NULL;
+   s->stop = 1;
+   pthread_mutex_unlock(&s->lock);
+
+   pthread_join(s->thread, NULL);
+   pthread_cond_destroy(&s->cond);
+   pthread_mutex_destroy(&s->lock);
+   free(s->pattern);
+   free(s);
+
+   return 0;
+}
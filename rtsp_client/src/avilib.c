@@ -23,19 +23,44 @@
  *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE          /* O_DIRECT, fallocate */
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "avilib.h"
 
+/* io_uring is used through raw system calls, only the kernel header
+   is needed. Older toolchains fall back to the writer thread. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_SINGLE_MMAP)
+#define AVI_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #define MODLE_NAME		"Avilib "
 long AVI_errno = 0;
 #define ERR_EXIT(x) \
@@ -47,6 +72,8 @@ long AVI_errno = 0;
 
 
 int AVI_close_fd(avi_t *AVI);
+int AVI_init_file_header(avi_t *AVI);
+static int avi_file_header(avi_t *AVI, unsigned char *AVI_header);
 
 /*******************************************************************
  *                                                                 *
@@ -71,6 +98,83 @@ static ssize_t avi_write (int fd, char *buf, size_t len)
    return r;
 }
 
+/* Like avi_write, for a vector of buffers. The iovec array is modified. */
+
+static ssize_t avi_writev (int fd, struct iovec *iov, int cnt)
+{
+   ssize_t n = 0;
+   ssize_t r = 0;
+
+   while (cnt > 0)
+   {
+      n = writev(fd, iov, cnt > IOV_MAX ? IOV_MAX : cnt);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return n;
+      r += n;
+      while (cnt > 0 && n >= (ssize_t)iov->iov_len)
+      {
+         n -= iov->iov_len;
+         iov++;
+         cnt--;
+      }
+      if (cnt > 0)
+      {
+         iov->iov_base = (char *)iov->iov_base + n;
+         iov->iov_len -= n;
+      }
+   }
+   return r;
+}
+
+/* Like avi_write and avi_writev, at the file offset off */
+
+static ssize_t avi_pwrite (int fd, char *buf, size_t len, off_t off)
+{
+   ssize_t n = 0;
+   ssize_t r = 0;
+
+   while (r < len)
+   {
+      n = pwrite(fd, buf + r, len - r, off + r);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return n;
+      r += n;
+   }
+   return r;
+}
+
+static ssize_t avi_pwritev (int fd, struct iovec *iov, int cnt, off_t off)
+{
+   ssize_t n = 0;
+   ssize_t r = 0;
+
+   while (cnt > 0)
+   {
+      n = pwritev(fd, iov, cnt > IOV_MAX ? IOV_MAX : cnt, off + r);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return n;
+      r += n;
+      while (cnt > 0 && n >= (ssize_t)iov->iov_len)
+      {
+         n -= iov->iov_len;
+         iov++;
+         cnt--;
+      }
+      if (cnt > 0)
+      {
+         iov->iov_base = (char *)iov->iov_base + n;
+         iov->iov_len -= n;
+      }
+   }
+   return r;
+}
+
 
 /* HEADERBYTES: The number of bytes to reserve for the header */
 
@@ -92,6 +196,10 @@ static void long2str(unsigned char *dst, int n)
    dst[3] = (n>>24)&0xff;
 }
 
+static u32 str2ulong(unsigned char *str);
+static void avi_demux_rewind(avi_t *AVI);
+static void avi_demux_free(avi_t *AVI);
+
 
 /* Calculate audio sample size from number of bits and number of channels.
    This may have to be adjusted for eg. 12 bits and stereo */
@@ -105,208 +213,3111 @@ static int avi_sampsize(avi_t *AVI)
 }
 
 
-/* Add a chunk (=tag and data) to the AVI file,
-   returns -1 on write error, 0 on success */
+/*******************************************************************
+ *                                                                 *
+ *    Coalescing writer for fd backed files                        *
+ *                                                                 *
+ *******************************************************************/
 
-static int avi_add_chunk_fd(avi_t *AVI, unsigned char *tag, unsigned char *data, int length)
+/* Chunks are copied into a staging buffer and written with one pwritev
+   when the buffer is full or max_ms have passed. Payloads too large for
+   the buffer are not copied, they go out in the same pwritev as the
+   pending data. AVI->pos, the index and the counters are updated as if
+   the chunk was written; if a flush fails they are rolled back to the
+   state of the first chunk of the failed batch, the same way a failed
+   avi_add_chunk_fd restores AVI->pos.
+
+   In async mode the staging buffer is the front buffer of a double
+   buffer: when it is full it is swapped with the back buffer, which a
+   background thread writes while the caller keeps appending. If the
+   thread is still busy with the back buffer when the front is full, the
+   write fails with AVI_ERR_AGAIN (or waits, if blocking was requested)
+   before anything is changed. A write error of the thread is reported
+   by the next call and rolls back to the start of the back buffer.
+   A payload larger than a buffer is copied into the spill buffer big
+   and handed to the thread together with the staged chunks, so the
+   caller doesn't write it itself. */
+
+typedef struct
 {
-   unsigned char c[8]={0};
-   char p=0;
+   off_t  pos;
+   long   n_idx;
+   long   video_frames;
+   long   audio_bytes;
+   off_t  last_pos;
+   long   last_len;
+   off_t  track_bytes[AVI_MAX_TRACKS];  /* audio tracks after the first */
+} avi_writer_state_t;
+
+typedef struct
+{
+   unsigned char *stage;     /* staged chunk headers, payloads and pad bytes */
+   long   stage_size;
+   long   stage_len;
+   long   max_ms;
+   long   last_flush;        /* ms timestamp of the last flush */
+   int    marked;            /* base holds the state before the staged chunks */
+   avi_writer_state_t base;  /* base.pos is the file offset of stage[0] */
+
+   /* async mode */
+   int    async;
+   int    block;             /* wait for the thread instead of AVI_ERR_AGAIN */
+   int    fdes;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   unsigned char *back;      /* buffer owned by the thread while busy */
+   long   back_len;
+   avi_writer_state_t back_base;
+   int    busy;
+   int    error;             /* errno of a failed background write */
+   int    quit;
+   int    uring;             /* back buffer is written by the shared io_uring */
+   long   back_done;
+   unsigned char *big;       /* chunk larger than the buffers, written behind back */
+   long   big_size;
+   long   big_len;           /* 0 if the back buffer has no chunk in big */
+   struct iovec big_iov;     /* of the io_uring write of big */
+   void   *uring_next;       /* next recording on the ring */
+
+   /* direct mode */
+   int    direct;
+   int    odirect;           /* O_DIRECT is set on fdes */
+   int    nodirect;          /* the filesystem refused O_DIRECT */
+   off_t  stage_off;         /* aligned file offset of stage[0] */
+   off_t  prealloc;          /* end of the fallocate()d range */
+} avi_writer_t;
+
+static int avi_direct_add(avi_t *AVI, unsigned char *c, unsigned char *data, int length);
+static int avi_direct_flush(avi_t *AVI, int all);
+static int avi_direct_load(avi_t *AVI, off_t pos);
+static void avi_direct_free(avi_writer_t *w);
+
+#ifdef AVI_HAVE_IO_URING
+static int avi_uring_write(avi_writer_t *w);
+static void avi_uring_slot_put(unsigned char *p);
+static void avi_uring_writer_del(avi_writer_t *w);
+#endif
 
-   /* Copy tag and length int c, so that we need only 1 write system call
-      for these two values */
+static long avi_now_ms(void)
+{
+   struct timespec ts;
 
-   memcpy(c,tag,4);
-   long2str(c+4,length);
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
 
-   /* Output tag, length and data, restore previous position
-      if the write fails */
+static long avi_now_us(void)
+{
+   struct timespec ts;
 
-   if( avi_write(AVI->fdes,(char *)c,8) != 8 ||
-       avi_write(AVI->fdes,(char *)data,length) != length ||
-       avi_write(AVI->fdes,&p,length&1) != (length&1)) // if len is uneven, write a pad byte
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* Remember the state to roll back to, if nothing is staged yet */
+
+static void avi_writer_mark(avi_t *AVI)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   int t;
+
+   if(w == NULL || w->marked) return;
+
+   w->marked = 1;
+   w->base.pos = AVI->pos;
+   w->base.n_idx = AVI->n_idx;
+   w->base.video_frames = AVI->video_frames;
+   w->base.audio_bytes = AVI->audio_bytes;
+   w->base.last_pos = AVI->last_pos;
+   w->base.last_len = AVI->last_len;
+   for(t = 1; t < AVI->anum; t++)
+      w->base.track_bytes[t] = AVI->track[t].audio_bytes;
+}
+
+static void avi_writer_rollback(avi_t *AVI, avi_writer_state_t *s)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   int t;
+
+   AVI->pos = s->pos;
+   AVI->n_idx = s->n_idx;
+   AVI->video_frames = s->video_frames;
+   AVI->audio_bytes = s->audio_bytes;
+   AVI->last_pos = s->last_pos;
+   AVI->last_len = s->last_len;
+   for(t = 1; t < AVI->anum; t++)
+      AVI->track[t].audio_bytes = s->track_bytes[t];
+   w->stage_len = 0;
+   w->marked = 0;
+   if(w->direct)
    {
-      lseek(AVI->fdes,AVI->pos,SEEK_SET);
-      return -1;
+      /* keep the staged bytes in front of pos */
+      if(s->pos >= w->stage_off)
+         w->stage_len = s->pos - w->stage_off;
+      else
+         avi_direct_load(AVI, s->pos);
    }
+   lseek(AVI->fdes,AVI->pos,SEEK_SET);
+}
 
-   /* Update file position */
+/* iovecs of the data the thread writes at back_base.pos, returns the
+   number used */
 
-   AVI->pos += 8 + PAD_EVEN(length);
+static int avi_writer_back_iov(avi_writer_t *w, struct iovec *iov)
+{
+   int n = 0;
 
-   return 0;
+   if(w->back_len)
+   {
+      iov[n].iov_base = w->back;
+      iov[n].iov_len = w->back_len;
+      n++;
+   }
+   if(w->big_len)
+   {
+      iov[n].iov_base = w->big;
+      iov[n].iov_len = w->big_len;
+      n++;
+   }
+   return n;
 }
 
+static void *avi_writer_thread(void *arg)
+{
+   avi_writer_t *w = (avi_writer_t *)arg;
+   struct iovec iov[2];
+   ssize_t n;
+   int cnt;
 
+   pthread_mutex_lock(&w->lock);
+   while(1)
+   {
+      while(!w->busy && !w->quit)
+         pthread_cond_wait(&w->cond, &w->lock);
+      if(!w->busy)
+         break;
 
-/* Add a chunk (=tag and data) to the AVI file,
-   returns -1 on write error, 0 on success */
+      cnt = avi_writer_back_iov(w, iov);
+      pthread_mutex_unlock(&w->lock);
+      n = avi_pwritev(w->fdes, iov, cnt, w->back_base.pos);
+      pthread_mutex_lock(&w->lock);
 
-static int avi_add_chunk(avi_t *AVI, unsigned char *tag, unsigned char *data, int length)
-{
-   unsigned char c[8]={0};
-   char p=0;
+      if(n != w->back_len + w->big_len)
+         w->error = errno ? errno : EIO;
+      w->busy = 0;
+      pthread_cond_broadcast(&w->cond);
+   }
+   pthread_mutex_unlock(&w->lock);
 
-   /* Copy tag and length int c, so that we need only 1 write system call
-      for these two values */
+   return NULL;
+}
 
-   memcpy(c,tag,4);
-   long2str(c+4,length);
+/* Wait until the thread has finished the back buffer (if wait is set)
+   and report its error. Returns 1 if the back buffer is still busy. */
 
-   /* Output tag, length and data, restore previous position
-      if the write fails */
+static int avi_writer_sync(avi_t *AVI, int wait)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   int busy, error;
+
+   pthread_mutex_lock(&w->lock);
+   while(wait && w->busy)
+      pthread_cond_wait(&w->cond, &w->lock);
+   busy = w->busy;
+   error = w->error;
+   w->error = 0;
+   pthread_mutex_unlock(&w->lock);
+
+   if(error)
+   {
+      /* everything after the start of the back buffer is lost */
+      avi_writer_rollback(AVI, &w->back_base);
+      errno = error;
+      AVI_errno = AVI_ERR_WRITE;
+      return -1;
+   }
+   return busy;
+}
 
-  memcpy(AVI->buf + AVI->pos, c, 8);
-  memcpy(AVI->buf + AVI->pos + 8, data, length);
-  if(length&1)	// if len is uneven, write a pad byte
-	memcpy(AVI->buf + AVI->pos + 8 + length,&p,length&1);
-   /* Update file position */
+/* Hand the front buffer and big bytes of the spill buffer to the
+   thread. Returns 0 on success, -1 on a write error and 1 if the thread
+   is busy and wait is not set. */
 
-   AVI->pos += 8 + PAD_EVEN(length);
+static int avi_writer_swap(avi_t *AVI, int wait, long big)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   unsigned char *p;
+   int ret;
 
+   ret = avi_writer_sync(AVI, wait);
+   if(ret) return ret;
+
+   w->last_flush = avi_now_ms();
+   if(w->stage_len == 0 && big == 0) return 0;
+
+   pthread_mutex_lock(&w->lock);
+   p = w->back;
+   w->back = w->stage;
+   w->back_len = w->stage_len;
+   w->big_len = big;
+   w->back_base = w->base;
+   w->stage = p;
+   w->stage_len = 0;
+   w->marked = 0;
+   w->busy = 1;
+   pthread_cond_broadcast(&w->cond);
+   pthread_mutex_unlock(&w->lock);
+
+#ifdef AVI_HAVE_IO_URING
+   if(w->uring)
+      return avi_uring_write(w);
+#endif
    return 0;
 }
 
+/* Write the staged data followed by the extra buffers (may be none) */
 
-static int avi_add_index_entry(avi_t *AVI, unsigned char *tag, long flags, long pos, long len)
+static int avi_writer_flush(avi_t *AVI, struct iovec *extra, int nextra)
 {
-   memcpy(AVI->idx[AVI->n_idx],tag,4);
-   long2str(AVI->idx[AVI->n_idx]+ 4,flags);
-   long2str(AVI->idx[AVI->n_idx]+ 8,pos);
-   long2str(AVI->idx[AVI->n_idx]+12,len);
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   struct iovec iov[4];
+   ssize_t total;
+   long off;
+   int i, n = 0;
 
+   if(w->async && avi_writer_sync(AVI, 1) < 0) return -1;
+   if(w->direct) return avi_direct_flush(AVI, 0);
 
-   AVI->n_idx++;
+   off = w->stage_len ? w->base.pos : AVI->pos;
+   if(w->stage_len)
+   {
+      iov[n].iov_base = w->stage;
+      iov[n].iov_len = w->stage_len;
+      n++;
+   }
+   for(i=0; i<nextra; i++)
+      iov[n++] = extra[i];
+
+   total = 0;
+   for(i=0; i<n; i++)
+      total += iov[i].iov_len;
 
+   w->last_flush = avi_now_ms();
+   if(total && avi_pwritev(AVI->fdes, iov, n, off) != total)
+   {
+      avi_writer_rollback(AVI, &w->base);
+      AVI_errno = AVI_ERR_WRITE;
+      return -1;
+   }
+
+   w->stage_len = 0;
+   w->marked = 0;
    return 0;
 }
 
+/* Grow the spill buffer to total bytes, only while the thread is idle */
 
-/*
-   AVI_open_output_file: Open an AVI File and write a bunch
-                         of zero bytes as space for the header.
+static int avi_writer_big(avi_writer_t *w, long total)
+{
+   unsigned char *p;
 
-   returns a pointer to avi_t on success, a zero pointer on error
-*/
+   if(total <= w->big_size) return 0;
+   p = (unsigned char *)realloc(w->big, total);
+   if(p == NULL)
+   {
+      AVI_errno = AVI_ERR_NO_MEM;
+      return -1;
+   }
+   w->big = p;
+   w->big_size = total;
+   return 0;
+}
 
-int AVI_Init_fd(avi_t *AVI, int width, int height, int fps, const char *compressor, int duration, const char *file_name)
-{
-	void *ptr = NULL;
+/* Called before the index entry of a chunk of total bytes is added:
+   make room in the front buffer so that avi_writer_add can't fail with
+   AVI_ERR_AGAIN after the index has been changed. A chunk larger than
+   the buffers needs the thread idle and room in the spill buffer. */
 
-	/* apply for index space */
-    ptr = malloc((duration*80+1024)*16);
-    if(NULL == ptr) 
-	{
-       return -1;
-    }
-	AVI->idx = (unsigned char((*)[16]) ) ptr;
+static int avi_writer_reserve(avi_t *AVI, long total)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   int ret;
 
-    AVI->pos = HEADERBYTES;
-	AVI->buf_len = 1024*1024*512;		
+   if(w == NULL || !w->async) return 0;
 
-	/* write avi head */
-	AVI_set_video(AVI, width, height, fps, compressor);
-	//if(AUDIO_ENC_FMT_AAC == CFG_GetAudioEncType())
-		//AVI_set_audio(AVI, 1, 16000, 16, 1);
-	//else
-		AVI_set_audio(AVI,1,8000,16, 1);
+   if(total > w->stage_size)
+   {
+      ret = avi_writer_sync(AVI, w->block);
+      if(ret > 0)
+      {
+         AVI_errno = AVI_ERR_AGAIN;
+         return -1;
+      }
+      return ret < 0 ? -1 : avi_writer_big(w, total);
+   }
 
-	AVI->fdes = open(file_name, O_RDWR | O_NONBLOCK | O_CREAT | O_TRUNC, 00644);
-	if (AVI->fdes < 0) 
-	{
-		printf("create file %s err!\n",file_name);
-		AVI_close_fd(AVI);
-		return(-1);
-	}
-	/* ƫAVIļдͷHEADERBYTES */
-    if (lseek(AVI->fdes,AVI->pos,SEEK_SET) < 0)
-     {
-		printf("create file %s err!\n",file_name);
-		AVI_close_fd(AVI);
-		return -1;
-     }
+   if(w->stage_len + total <= w->stage_size)
+      return avi_writer_sync(AVI, 0) < 0 ? -1 : 0;
 
-	AVI->buf = NULL;
-	return(1);
+   ret = avi_writer_swap(AVI, w->block, 0);
+   if(ret > 0)
+   {
+      AVI_errno = AVI_ERR_AGAIN;
+      return -1;
+   }
+   return ret;
 }
 
+static int avi_writer_add(avi_t *AVI, unsigned char *c, unsigned char *data, int length)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   struct iovec iov[3];
+   char p = 0;
+   long total = 8 + PAD_EVEN(length);
 
-/*
-   AVI_open_output_file: Open an AVI File and write a bunch
-                         of zero bytes as space for the header.
+   if(w->direct)
+      return avi_direct_add(AVI, c, data, length);
 
-   returns a pointer to avi_t on success, a zero pointer on error
-*/
+   avi_writer_mark(AVI);
 
-int AVI_Init(avi_t *AVI, int file_size, int idx_size)
-{
-	/* apply for index space */
-    AVI->idxPtr = malloc((idx_size+1024)*16);
-    if(NULL == AVI->idxPtr) {
-		printf("malloc error \n");
-       return GS_FAIL;
-    }
-	AVI->idx = (unsigned char((*)[16]))AVI->idxPtr;
+   if(w->async && total > w->stage_size)
+   {
+      /* avi_writer_reserve left the thread idle and big large enough,
+         chunks written without it wait for the thread here */
+      if(avi_writer_sync(AVI, 1) < 0 || avi_writer_big(w, total)) return -1;
+      memcpy(w->big, c, 8);
+      memcpy(w->big + 8, data, length);
+      if(length&1)
+         w->big[8 + length] = 0;
+      if(avi_writer_swap(AVI, 1, total)) return -1;
+      AVI->pos += total;
+      return 0;
+   }
 
-	/* apply for buf space */
-	AVI->buf = (unsigned char*)malloc(file_size+(idx_size+1024)*24);
-	if(NULL == AVI->buf){
-		printf("malloc error \n");
-		return GS_FAIL;
-	}
-    memset(AVI->buf,0,HEADERBYTES);
-    AVI->pos  = HEADERBYTES;
-	AVI->buf_len = file_size+(idx_size+1024)*24;
-	AVI->fdes = -1;
+   if(w->stage_len + total > w->stage_size)
+   {
+      if(!w->async && total > w->stage_size/4)
+      {
+         /* Large payload: don't copy it, write it behind the staged data */
+         iov[0].iov_base = c;    iov[0].iov_len = 8;
+         iov[1].iov_base = data; iov[1].iov_len = length;
+         iov[2].iov_base = &p;   iov[2].iov_len = length&1;
+         if(avi_writer_flush(AVI, iov, 3)) return -1;
+         AVI->pos += total;
+         return 0;
+      }
+      if(w->async ? avi_writer_swap(AVI, 1, 0) : avi_writer_flush(AVI, NULL, 0)) return -1;
+      avi_writer_mark(AVI);
+   }
 
-	return GS_SUCCESS;
-}
+   memcpy(w->stage + w->stage_len, c, 8);
+   memcpy(w->stage + w->stage_len + 8, data, length);
+   if(length&1)
+      w->stage[w->stage_len + 8 + length] = 0;
+   w->stage_len += total;
+   AVI->pos += total;
 
+   if(avi_now_ms() - w->last_flush >= w->max_ms)
+   {
+      if(w->async)
+         return avi_writer_swap(AVI, 0, 0) < 0 ? -1 : 0;
+      return avi_writer_flush(AVI, NULL, 0);
+   }
 
-void AVI_set_video(avi_t *AVI, int width, int height, int fps, const char *compressor)
-{
-	AVI->width  = width; 
-    AVI->height = height;
-	if(((height%288)==0) && width >=352)
-	{
-		/*  PAL CIF */
-		AVI->dwMicroSecPerFrame = 40000;
-        AVI->dwSuggestedBufferSize =144008;
-	}
-	else 
-	{
-		/* С PAL CIF */
-		AVI->dwMicroSecPerFrame = 33366;
-        AVI->dwSuggestedBufferSize =120008;
-	}
-	AVI->fps    = fps;
-	memcpy(AVI->compressor,compressor,4);
-	AVI->compressor[4] = 0;
+   return 0;
 }
 
+/* stage: preallocated front buffer of max_bytes, NULL to allocate one */
 
-void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
+static avi_writer_t *avi_writer_new(avi_t *AVI, int max_bytes, int max_ms, unsigned char *stage)
 {
-   /* may only be called if file is open for writing */
+   avi_writer_t *w;
 
-   AVI->a_chans = channels;
-   AVI->a_rate  = rate;
-   AVI->a_bits  = bits;
-   AVI->a_fmt   = format;
+   if(AVI->fdes < 0 || AVI->buf != NULL || AVI->writer != NULL) return NULL;
+   if(max_bytes <= 0) max_bytes = AVI_COALESCE_BYTES;
+   if(max_ms < 0) max_ms = AVI_COALESCE_MS;
+
+   w = (avi_writer_t *)malloc(sizeof(avi_writer_t));
+   if(w == NULL) return NULL;
+   memset(w, 0, sizeof(avi_writer_t));
+   w->stage = stage ? stage : (unsigned char *)malloc(max_bytes);
+   if(w->stage == NULL)
+   {
+      free(w);
+      return NULL;
+   }
+   w->stage_size = max_bytes;
+   w->max_ms = max_ms;
+   w->last_flush = avi_now_ms();
+   w->fdes = AVI->fdes;
+
+   return w;
 }
 
-#define OUT4CC(s) \
-   if(nhb<=HEADERBYTES-4) memcpy(AVI_header+nhb,s,4); nhb += 4
+int AVI_set_write_coalesce(avi_t *AVI, int max_bytes, int max_ms)
+{
+   avi_writer_t *w;
 
-#define OUTLONG(n) \
-   if(nhb<=HEADERBYTES-4) long2str(AVI_header+nhb,n); nhb += 4
+   if(AVI->writer != NULL) return 0;
+   w = avi_writer_new(AVI, max_bytes, max_ms, NULL);
+   if(w == NULL) return -1;
+   AVI->writer = w;
 
-#define OUTSHRT(n) \
-   if(nhb<=HEADERBYTES-2) { \
-      AVI_header[nhb  ] = (n   )&0xff; \
-      AVI_header[nhb+1] = (n>>8)&0xff; \
-   } \
-   nhb += 2
+   return 0;
+}
+
+int AVI_set_async_write(avi_t *AVI, int buf_bytes, int max_ms, int block)
+{
+   avi_writer_t *w;
+
+   if(AVI->writer != NULL) return -1;
+   w = avi_writer_new(AVI, buf_bytes, max_ms, NULL);
+   if(w == NULL) return -1;
+
+   w->back = (unsigned char *)malloc(w->stage_size);
+   if(w->back == NULL)
+      goto __exit_async_write;
+   w->async = 1;
+   w->block = block;
+   pthread_mutex_init(&w->lock, NULL);
+   pthread_cond_init(&w->cond, NULL);
+   if(pthread_create(&w->thread, NULL, avi_writer_thread, w) != 0)
+   {
+      pthread_cond_destroy(&w->cond);
+      pthread_mutex_destroy(&w->lock);
+      goto __exit_async_write;
+   }
+   AVI->writer = w;
+   return 0;
+
+__exit_async_write:
+   free(w->back);
+   free(w->stage);
+   free(w);
+   return -1;
+}
+
+/* Write all staged chunks and wait for the background thread,
+   returns -1 (and rolls back) on write error */
+
+int AVI_flush(avi_t *AVI)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+
+   if(w == NULL) return 0;
+   if(w->async && (avi_writer_swap(AVI, 1, 0) < 0 || avi_writer_sync(AVI, 1) < 0))
+      return -1;
+   if(w->direct ? avi_direct_flush(AVI, 1) : avi_writer_flush(AVI, NULL, 0)) return -1;
+
+   /* the writer uses pwrite, keep the file offset where the
+      unbuffered functions expect it */
+   lseek(AVI->fdes,AVI->pos,SEEK_SET);
+   return 0;
+}
+
+long AVI_write_pending(avi_t *AVI)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   long n;
+
+   if(w == NULL) return 0;
+   n = w->stage_len;
+   if(w->async)
+   {
+      pthread_mutex_lock(&w->lock);
+      if(w->busy) n += w->back_len + w->big_len;
+      pthread_mutex_unlock(&w->lock);
+   }
+   return n;
+}
+
+static void avi_writer_free(avi_t *AVI)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+
+   if(w == NULL) return;
+   AVI_flush(AVI);
+#ifdef AVI_HAVE_IO_URING
+   if(w->uring)
+   {
+      avi_uring_writer_del(w);
+      pthread_cond_destroy(&w->cond);
+      pthread_mutex_destroy(&w->lock);
+      avi_uring_slot_put(w->back);
+      avi_uring_slot_put(w->stage);
+      free(w->big);
+      free(w);
+      AVI->writer = NULL;
+      return;
+   }
+#endif
+   if(w->async)
+   {
+      pthread_mutex_lock(&w->lock);
+      w->quit = 1;
+      pthread_cond_broadcast(&w->cond);
+      pthread_mutex_unlock(&w->lock);
+      pthread_join(w->thread, NULL);
+      pthread_cond_destroy(&w->cond);
+      pthread_mutex_destroy(&w->lock);
+      free(w->back);
+      free(w->big);
+   }
+   if(w->direct)
+      avi_direct_free(w);
+   free(w->stage);
+   free(w);
+   AVI->writer = NULL;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    io_uring backend for the async writer                        *
+ *                                                                 *
+ *******************************************************************/
+
+/* One ring is shared by all recordings of the process. The front and
+   back buffers of a recording are slots of one registered buffer area,
+   the back buffer is written with IORING_OP_WRITE_FIXED and a single
+   reaper thread handles the completions of all recordings. Without
+   io_uring support (old kernel headers, setup or buffer registration
+   refused) AVI_set_uring_write falls back to the writer thread.
+
+   If waiting for completions fails for another reason than a signal or
+   a full completion queue, the ring is given up: the recordings with a
+   write in flight get the error (AVI_ERR_WRITE from their next call),
+   later writes are done with pwrite by the caller and new recordings
+   use the writer thread. AVI_uring_shutdown releases an unused ring. */
+
+#ifdef AVI_HAVE_IO_URING
+
+typedef struct
+{
+   int      fd;
+   unsigned sq_entries;
+   unsigned *sq_head;
+   unsigned *sq_tail;
+   unsigned *sq_mask;
+   unsigned *sq_array;
+   struct io_uring_sqe *sqes;
+   unsigned *cq_head;
+   unsigned *cq_tail;
+   unsigned *cq_mask;
+   struct io_uring_cqe *cqes;
+   unsigned char *slots;     /* registered buffers, slot_bytes each */
+   int      nslots;
+   int      slot_bytes;
+   int      *free_slots;
+   int      nfree;
+   pthread_mutex_t lock;     /* submission queue, free slots and writers */
+   pthread_t reaper;
+   avi_writer_t *writers;    /* recordings using the ring, by uring_next */
+   int      error;           /* errno that made the reaper give up */
+   int      quit;            /* set by AVI_uring_shutdown */
+   void     *sq_ring;        /* mappings, for AVI_uring_shutdown */
+   void     *cq_ring;
+   size_t   sq_ring_len;
+   size_t   cq_ring_len;
+   size_t   sqes_len;
+} avi_uring_t;
+
+static void avi_uring_free(avi_uring_t *r);
+
+static avi_uring_t *avi_uring = NULL;
+static int avi_uring_failed = 0;
+static pthread_mutex_t avi_uring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int avi_uring_submit(avi_writer_t *w, unsigned char *buf, unsigned len, off_t off)
+{
+   avi_uring_t *r = avi_uring;
+   struct io_uring_sqe *sqe;
+   unsigned tail, idx;
+   int ret;
+
+   pthread_mutex_lock(&r->lock);
+   if(r->error)
+   {
+      pthread_mutex_unlock(&r->lock);
+      return -1;
+   }
+   tail = *r->sq_tail;
+   idx = tail & *r->sq_mask;
+   sqe = &r->sqes[idx];
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->fd = w->fdes;
+   sqe->off = off;
+   if(buf >= r->slots && buf < r->slots + (size_t)r->nslots*r->slot_bytes)
+   {
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->addr = (unsigned long)buf;
+      sqe->len = len;
+      sqe->buf_index = (buf - r->slots) / r->slot_bytes;
+   }
+   else
+   {
+      /* the spill buffer is not registered */
+      w->big_iov.iov_base = buf;
+      w->big_iov.iov_len = len;
+      sqe->opcode = IORING_OP_WRITEV;
+      sqe->addr = (unsigned long)&w->big_iov;
+      sqe->len = 1;
+   }
+   sqe->user_data = (unsigned long)w;
+   r->sq_array[idx] = idx;
+   __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+   do
+      ret = syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+   while(ret < 0 && errno == EINTR);
+   if(ret != 1)
+      __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&r->lock);
+
+   return ret == 1 ? 0 : -1;
+}
+
+/* Queue the part of back and big not written yet, from back_done on */
+
+static int avi_uring_next(avi_writer_t *w)
+{
+   long done = w->back_done;
+
+   if(done < w->back_len)
+      return avi_uring_submit(w, w->back + done, w->back_len - done, w->back_base.pos + done);
+   return avi_uring_submit(w, w->big + (done - w->back_len), w->back_len + w->big_len - done,
+                           w->back_base.pos + done);
+}
+
+/* Start writing the back buffer of w (called with busy set) */
+
+static int avi_uring_write(avi_writer_t *w)
+{
+   struct iovec iov[2];
+   ssize_t n;
+   int cnt;
+
+   w->back_done = 0;
+   if(avi_uring_next(w) == 0)
+      return 0;
+
+   /* the ring refused the request, write it ourselves */
+   cnt = avi_writer_back_iov(w, iov);
+   n = avi_pwritev(w->fdes, iov, cnt, w->back_base.pos);
+   pthread_mutex_lock(&w->lock);
+   if(n != w->back_len + w->big_len)
+      w->error = errno ? errno : EIO;
+   w->busy = 0;
+   pthread_cond_broadcast(&w->cond);
+   pthread_mutex_unlock(&w->lock);
+   return 0;
+}
+
+static void avi_uring_complete(struct io_uring_cqe *cqe)
+{
+   avi_writer_t *w = (avi_writer_t *)(unsigned long)cqe->user_data;
+   long left;
+
+   if(w == NULL) return;   /* the nop of AVI_uring_shutdown */
+
+   pthread_mutex_lock(&w->lock);
+   if(cqe->res <= 0)
+   {
+      w->error = cqe->res < 0 ? -cqe->res : EIO;
+   }
+   else
+   {
+      w->back_done += cqe->res;
+      left = w->back_len + w->big_len - w->back_done;
+      if(left > 0)
+      {
+         /* short write or big still to go, queue the rest */
+         pthread_mutex_unlock(&w->lock);
+         if(avi_uring_next(w) == 0)
+            return;
+         pthread_mutex_lock(&w->lock);
+         w->error = EIO;
+      }
+   }
+   w->busy = 0;
+   pthread_cond_broadcast(&w->cond);
+   pthread_mutex_unlock(&w->lock);
+}
+
+/* The ring can't be used any more: fail the writes in flight with err */
+
+static void avi_uring_fail(avi_uring_t *r, int err)
+{
+   avi_writer_t *w;
+
+   pthread_mutex_lock(&r->lock);
+   r->error = err;
+   for(w = r->writers; w != NULL; w = (avi_writer_t *)w->uring_next)
+   {
+      pthread_mutex_lock(&w->lock);
+      if(w->busy)
+      {
+         w->error = err;
+         w->busy = 0;
+         pthread_cond_broadcast(&w->cond);
+      }
+      pthread_mutex_unlock(&w->lock);
+   }
+   pthread_mutex_unlock(&r->lock);
+}
+
+static void *avi_uring_reaper(void *arg)
+{
+   avi_uring_t *r = (avi_uring_t *)arg;
+   unsigned head, tail;
+
+   while(!__atomic_load_n(&r->quit, __ATOMIC_ACQUIRE))
+   {
+      if(syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+      {
+         if(errno == EAGAIN || errno == EBUSY)
+            usleep(1000);
+         else if(errno != EINTR)
+         {
+            avi_uring_fail(r, errno);
+            break;
+         }
+      }
+
+      head = *r->cq_head;
+      tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+      while(head != tail)
+      {
+         avi_uring_complete(&r->cqes[head & *r->cq_mask]);
+         head++;
+      }
+      __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+   }
+
+   return NULL;
+}
+
+static avi_uring_t *avi_uring_setup(int nslots, int slot_bytes)
+{
+   avi_uring_t *r;
+   struct io_uring_params p;
+   struct iovec *iov;
+   unsigned char *sq, *cq;
+   size_t sq_len, cq_len;
+   int i;
+
+   r = (avi_uring_t *)malloc(sizeof(avi_uring_t));
+   if(r == NULL) return NULL;
+   memset(r, 0, sizeof(avi_uring_t));
+   memset(&p, 0, sizeof(p));
+
+   /* each slot has at most one write in flight, one more entry for
+      the nop of AVI_uring_shutdown */
+   r->fd = syscall(__NR_io_uring_setup, nslots + 1, &p);
+   if(r->fd < 0)
+   {
+      free(r);
+      return NULL;
+   }
+
+   sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+   cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+   if(p.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if(cq_len > sq_len) sq_len = cq_len;
+      cq_len = sq_len;
+   }
+   sq = mmap(NULL, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+   if(sq == MAP_FAILED) goto __exit_uring_setup;
+   r->sq_ring = sq;
+   r->sq_ring_len = sq_len;
+   if(p.features & IORING_FEAT_SINGLE_MMAP)
+      cq = sq;
+   else
+   {
+      cq = mmap(NULL, cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+      if(cq == MAP_FAILED) goto __exit_uring_setup;
+      r->cq_ring = cq;
+      r->cq_ring_len = cq_len;
+   }
+   sq = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+             MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+   if(sq == MAP_FAILED) goto __exit_uring_setup;
+   r->sqes = (struct io_uring_sqe *)sq;
+   r->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+
+   sq = (unsigned char *)r->sq_ring;
+   r->sq_entries = p.sq_entries;
+   r->sq_head  = (unsigned *)(sq + p.sq_off.head);
+   r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+   r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+   r->sq_array = (unsigned *)(sq + p.sq_off.array);
+   r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+   r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+   r->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+   r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+   /* one registered buffer per slot */
+   r->nslots = nslots;
+   r->slot_bytes = slot_bytes;
+   if(posix_memalign((void **)&r->slots, 4096, (size_t)nslots*slot_bytes) != 0)
+      goto __exit_uring_setup;
+   r->free_slots = (int *)malloc(nslots*sizeof(int));
+   iov = (struct iovec *)malloc(nslots*sizeof(struct iovec));
+   if(r->free_slots == NULL || iov == NULL)
+   {
+      free(iov);
+      goto __exit_uring_setup;
+   }
+   for(i=0; i<nslots; i++)
+   {
+      iov[i].iov_base = r->slots + (size_t)i*slot_bytes;
+      iov[i].iov_len = slot_bytes;
+      r->free_slots[i] = nslots-1-i;
+   }
+   r->nfree = nslots;
+   i = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, nslots);
+   free(iov);
+   if(i < 0)
+   {
+      printf("io_uring buffer registration failed: %s\n", strerror(errno));
+      goto __exit_uring_setup;
+   }
+
+   pthread_mutex_init(&r->lock, NULL);
+   if(pthread_create(&r->reaper, NULL, avi_uring_reaper, r) != 0)
+   {
+      pthread_mutex_destroy(&r->lock);
+      goto __exit_uring_setup;
+   }
+
+   return r;
+
+__exit_uring_setup:
+   avi_uring_free(r);
+   return NULL;
+}
+
+/* Release the mappings, the ring and the buffers (reaper stopped) */
+
+static void avi_uring_free(avi_uring_t *r)
+{
+   if(r->sqes) munmap(r->sqes, r->sqes_len);
+   if(r->cq_ring) munmap(r->cq_ring, r->cq_ring_len);
+   if(r->sq_ring) munmap(r->sq_ring, r->sq_ring_len);
+   close(r->fd);
+   free(r->slots);
+   free(r->free_slots);
+   free(r);
+}
+
+/* Wake the reaper with a nop and wait until it has quit */
+
+static void avi_uring_stop(avi_uring_t *r)
+{
+   struct io_uring_sqe *sqe;
+   unsigned tail, idx;
+   int ret;
+
+   pthread_mutex_lock(&r->lock);
+   __atomic_store_n(&r->quit, 1, __ATOMIC_RELEASE);
+   if(!r->error)
+   {
+      tail = *r->sq_tail;
+      idx = tail & *r->sq_mask;
+      sqe = &r->sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_NOP;
+      r->sq_array[idx] = idx;
+      __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+      do
+         ret = syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+      while(ret < 0 && errno == EINTR);
+   }
+   pthread_mutex_unlock(&r->lock);
+
+   pthread_join(r->reaper, NULL);
+   pthread_mutex_destroy(&r->lock);
+}
+
+static unsigned char *avi_uring_slot_get(void)
+{
+   unsigned char *p = NULL;
+
+   pthread_mutex_lock(&avi_uring->lock);
+   if(avi_uring->nfree > 0)
+      p = avi_uring->slots + (size_t)avi_uring->free_slots[--avi_uring->nfree]*avi_uring->slot_bytes;
+   pthread_mutex_unlock(&avi_uring->lock);
+   return p;
+}
+
+static void avi_uring_slot_put(unsigned char *p)
+{
+   pthread_mutex_lock(&avi_uring->lock);
+   avi_uring->free_slots[avi_uring->nfree++] = (p - avi_uring->slots)/avi_uring->slot_bytes;
+   pthread_mutex_unlock(&avi_uring->lock);
+}
+
+static void avi_uring_writer_del(avi_writer_t *w)
+{
+   avi_writer_t **p;
+
+   pthread_mutex_lock(&avi_uring->lock);
+   for(p = &avi_uring->writers; *p != w; p = (avi_writer_t **)&(*p)->uring_next);
+   *p = (avi_writer_t *)w->uring_next;
+   pthread_mutex_unlock(&avi_uring->lock);
+}
+
+#endif /* AVI_HAVE_IO_URING */
+
+int AVI_uring_init(int slots, int slot_bytes)
+{
+#ifdef AVI_HAVE_IO_URING
+   pthread_mutex_lock(&avi_uring_lock);
+   if(avi_uring == NULL && !avi_uring_failed)
+   {
+      if(slots <= 0) slots = AVI_URING_SLOTS;
+      if(slot_bytes <= 0) slot_bytes = AVI_URING_SLOT_BYTES;
+      avi_uring = avi_uring_setup(slots, (slot_bytes + 4095) & ~4095);
+      avi_uring_failed = (avi_uring == NULL);
+   }
+   pthread_mutex_unlock(&avi_uring_lock);
+   return avi_uring ? 0 : -1;
+#else
+   return -1;
+#endif
+}
+
+int AVI_uring_shutdown(void)
+{
+#ifdef AVI_HAVE_IO_URING
+   avi_uring_t *r;
+
+   pthread_mutex_lock(&avi_uring_lock);
+   r = avi_uring;
+   if(r != NULL)
+   {
+      pthread_mutex_lock(&r->lock);
+      if(r->writers != NULL)
+      {
+         pthread_mutex_unlock(&r->lock);
+         pthread_mutex_unlock(&avi_uring_lock);
+         AVI_errno = AVI_ERR_NOT_PERM;
+         return -1;
+      }
+      pthread_mutex_unlock(&r->lock);
+      avi_uring_stop(r);
+      avi_uring_free(r);
+      avi_uring = NULL;
+   }
+   avi_uring_failed = 0;
+   pthread_mutex_unlock(&avi_uring_lock);
+#endif
+   return 0;
+}
+
+int AVI_set_uring_write(avi_t *AVI, int max_ms, int block)
+{
+#ifdef AVI_HAVE_IO_URING
+   avi_writer_t *w;
+   unsigned char *front, *back;
+
+   if(AVI->writer != NULL) return -1;
+   if(AVI_uring_init(0, 0) == 0 && !avi_uring->error)
+   {
+      front = avi_uring_slot_get();
+      back = front ? avi_uring_slot_get() : NULL;
+      if(back != NULL)
+      {
+         w = avi_writer_new(AVI, avi_uring->slot_bytes, max_ms, front);
+         if(w != NULL)
+         {
+            w->back = back;
+            w->async = 1;
+            w->uring = 1;
+            w->block = block;
+            pthread_mutex_init(&w->lock, NULL);
+            pthread_cond_init(&w->cond, NULL);
+            pthread_mutex_lock(&avi_uring->lock);
+            w->uring_next = avi_uring->writers;
+            avi_uring->writers = w;
+            pthread_mutex_unlock(&avi_uring->lock);
+            AVI->writer = w;
+            return 0;
+         }
+      }
+      if(front) avi_uring_slot_put(front);
+      if(back) avi_uring_slot_put(back);
+   }
+   return AVI_set_async_write(AVI, avi_uring ? avi_uring->slot_bytes : AVI_URING_SLOT_BYTES, max_ms, block);
+#else
+   return AVI_set_async_write(AVI, AVI_URING_SLOT_BYTES, max_ms, block);
+#endif
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    O_DIRECT recording                                           *
+ *                                                                 *
+ *******************************************************************/
+
+/* In direct mode the staging buffer is 4 KiB aligned and stage[0] is
+   the aligned file offset stage_off, so it starts with the bytes of the
+   file between stage_off and the first staged chunk. Only whole blocks
+   are written with O_DIRECT, the partial block at the end stays in the
+   buffer. AVI_flush writes it through the page cache with O_DIRECT
+   cleared (the header and idx1 are unaligned anyway); the next aligned
+   write turns O_DIRECT back on and overwrites it. */
+
+static void avi_direct_mode(avi_writer_t *w, int on)
+{
+   int flags;
+
+   if(w->odirect == on || (on && w->nodirect)) return;
+
+   flags = fcntl(w->fdes, F_GETFL);
+   if(flags >= 0 && fcntl(w->fdes, F_SETFL, on ? flags|O_DIRECT : flags&~O_DIRECT) == 0)
+      w->odirect = on;
+   else if(on)
+   {
+      /* e.g. tmpfs, keep writing aligned blocks through the cache */
+      printf("O_DIRECT not supported: %s\n", strerror(errno));
+      w->nodirect = 1;
+   }
+}
+
+/* Make pos the end of the staged data, reading the start of its block */
+
+static int avi_direct_load(avi_t *AVI, off_t pos)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   ssize_t n = 0;
+
+   w->stage_off = pos & ~(off_t)(AVI_DIRECT_ALIGN-1);
+   w->stage_len = pos - w->stage_off;
+   if(w->stage_len)
+      n = pread(w->fdes, w->stage, AVI_DIRECT_ALIGN, w->stage_off);
+   if(n < 0)
+   {
+      w->stage_len = 0;
+      return -1;
+   }
+   /* AVI_Init_fd leaves the header space unwritten */
+   if(n < w->stage_len)
+      memset(w->stage + n, 0, w->stage_len - n);
+   return 0;
+}
+
+/* Write the whole blocks of the staging buffer, and with all set the
+   partial block behind them too */
+
+static int avi_direct_flush(avi_t *AVI, int all)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   long n = w->stage_len & ~(long)(AVI_DIRECT_ALIGN-1);
+
+   w->last_flush = avi_now_ms();
+   if(n)
+   {
+      avi_direct_mode(w, 1);
+      if(avi_pwrite(w->fdes, (char *)w->stage, n, w->stage_off) != n)
+         goto __exit_direct_flush;
+      memmove(w->stage, w->stage + n, w->stage_len - n);
+      w->stage_off += n;
+      w->stage_len -= n;
+   }
+   if(all && w->stage_len)
+   {
+      avi_direct_mode(w, 0);
+      if(avi_pwrite(w->fdes, (char *)w->stage, w->stage_len, w->stage_off) != w->stage_len)
+         goto __exit_direct_flush;
+   }
+   w->marked = 0;
+   return 0;
+
+__exit_direct_flush:
+   avi_writer_rollback(AVI, &w->base);
+   AVI_errno = AVI_ERR_WRITE;
+   return -1;
+}
+
+static int avi_direct_copy(avi_t *AVI, unsigned char *data, long length)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   long n;
+
+   while(length > 0)
+   {
+      n = w->stage_size - w->stage_len;
+      if(n > length) n = length;
+      memcpy(w->stage + w->stage_len, data, n);
+      w->stage_len += n;
+      data += n;
+      length -= n;
+      if(w->stage_len == w->stage_size && avi_direct_flush(AVI, 0))
+         return -1;
+   }
+   return 0;
+}
+
+static int avi_direct_add(avi_t *AVI, unsigned char *c, unsigned char *data, int length)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   unsigned char p = 0;
+
+   avi_writer_mark(AVI);
+   if(avi_direct_copy(AVI, c, 8) ||
+      avi_direct_copy(AVI, data, length) ||
+      avi_direct_copy(AVI, &p, length&1))
+      return -1;
+   AVI->pos += 8 + PAD_EVEN(length);
+
+   if(avi_now_ms() - w->last_flush >= w->max_ms)
+      return avi_direct_flush(AVI, 0);
+   return 0;
+}
+
+int AVI_set_direct_io(avi_t *AVI, int kbps)
+{
+   avi_writer_t *w;
+   unsigned char *stage;
+   off_t len;
+
+   if(AVI->writer != NULL) return -1;
+   if(posix_memalign((void **)&stage, AVI_DIRECT_ALIGN, AVI_DIRECT_BYTES) != 0)
+      return -1;
+   w = avi_writer_new(AVI, AVI_DIRECT_BYTES, -1, stage);
+   if(w == NULL)
+   {
+      free(stage);
+      return -1;
+   }
+   w->direct = 1;
+   AVI->writer = w;
+   if(avi_direct_load(AVI, AVI->pos))
+   {
+      AVI->writer = NULL;
+      free(w->stage);
+      free(w);
+      return -1;
+   }
+
+   /* Reserve the expected size in one extent, without changing the
+      file size the reader and AVI_deformity_file see */
+   if(kbps > 0 && AVI->duration > 0)
+   {
+      len = (off_t)AVI->duration*kbps*125;
+      if(len > AVI->buf_len) len = AVI->buf_len;
+      if(fallocate(w->fdes, FALLOC_FL_KEEP_SIZE, 0, len) == 0)
+         w->prealloc = len;
+   }
+
+   avi_direct_mode(w, 1);
+   return 0;
+}
+
+/* Release the preallocated blocks behind the end of the file, truncating
+   to the current size drops them (punching a hole past EOF does not on
+   every filesystem) */
+
+static void avi_direct_free(avi_writer_t *w)
+{
+   struct stat st;
+
+   avi_direct_mode(w, 0);
+   if(w->prealloc && fstat(w->fdes, &st) == 0 && st.st_size < w->prealloc)
+      ftruncate(w->fdes, st.st_size);
+}
+
+
+/* Add a chunk (=tag and data) to the AVI file,
+   returns -1 on write error, 0 on success */
+
+static int avi_add_chunk_fd(avi_t *AVI, unsigned char *tag, unsigned char *data, int length)
+{
+   unsigned char c[8]={0};
+   char p=0;
+   struct iovec iov[3];
+   ssize_t total = 8 + PAD_EVEN(length);
+
+   memcpy(c,tag,4);
+   long2str(c+4,length);
+
+   if(AVI->writer)
+      return avi_writer_add(AVI, c, data, length);
+
+   /* Output tag, length, data and the pad byte of an uneven length
+      with one system call, restore previous position if the write fails */
+
+   iov[0].iov_base = c;    iov[0].iov_len = 8;
+   iov[1].iov_base = data; iov[1].iov_len = length;
+   iov[2].iov_base = &p;   iov[2].iov_len = length&1;
+
+   if( avi_writev(AVI->fdes,iov,3) != total )
+   {
+      lseek(AVI->fdes,AVI->pos,SEEK_SET);
+      return -1;
+   }
+
+   /* Update file position */
+
+   AVI->pos += total;
+
+   return 0;
+}
+
+
+
+/* Add a chunk (=tag and data) to the AVI file,
+   returns -1 on write error, 0 on success */
+
+static int avi_add_chunk(avi_t *AVI, unsigned char *tag, unsigned char *data, int length)
+{
+   unsigned char c[8]={0};
+   char p=0;
+
+   /* Copy tag and length int c, so that we need only 1 write system call
+      for these two values */
+
+   memcpy(c,tag,4);
+   long2str(c+4,length);
+
+   /* Output tag, length and data, restore previous position
+      if the write fails */
+
+  memcpy(AVI->buf + AVI->pos, c, 8);
+  memcpy(AVI->buf + AVI->pos + 8, data, length);
+  if(length&1)	// if len is uneven, write a pad byte
+	memcpy(AVI->buf + AVI->pos + 8 + length,&p,length&1);
+   /* Update file position */
+
+   AVI->pos += 8 + PAD_EVEN(length);
+
+   return 0;
+}
+
+
+/*******************************************************************
+ *                                                                 *
+ *    Index arena of the writers                                   *
+ *                                                                 *
+ *******************************************************************/
+
+/* The idx1 entries of a file being written live in pages of
+   AVI_IDX_PAGE entries that are allocated as the recording grows and
+   never moved, only the small page table is reallocated. Readers keep
+   the idx1 chunk they loaded in AVI->idx. */
+
+static int avi_idx_grow(avi_t *AVI)
+{
+   long n = AVI->max_idx / AVI_IDX_PAGE;   /* pages in use */
+   long slots;
+   void *p;
+
+   if(n == AVI->idx_pages)
+   {
+      slots = n ? 2*n : 16;
+      p = realloc(AVI->idx_page, slots*sizeof(*AVI->idx_page));
+      if(p == NULL) return -1;
+      AVI->idx_page = (unsigned char (**)[16])p;
+      AVI->idx_pages = slots;
+   }
+
+   AVI->idx_page[n] = (unsigned char (*)[16])malloc(AVI_IDX_PAGE*16);
+   if(AVI->idx_page[n] == NULL) return -1;
+   AVI->max_idx += AVI_IDX_PAGE;
+
+   return 0;
+}
+
+static void avi_idx_init(avi_t *AVI)
+{
+   AVI->idx = NULL;
+   AVI->idx_page = NULL;
+   AVI->idx_pages = 0;
+   AVI->n_idx = 0;
+   AVI->max_idx = 0;
+}
+
+static void avi_idx_free(avi_t *AVI)
+{
+   long i;
+
+   /* a reader has max_idx entries in AVI->idx and no pages */
+   if(AVI->idx_page != NULL)
+   {
+      for(i=0; i<AVI->max_idx/AVI_IDX_PAGE; i++)
+         free(AVI->idx_page[i]);
+      free(AVI->idx_page);
+   }
+   free(AVI->idx);
+   avi_idx_init(AVI);
+}
+
+static int avi_add_index_entry(avi_t *AVI, unsigned char *tag, long flags, off_t pos, long len)
+{
+   unsigned char *e;
+
+   if(AVI->n_idx >= AVI->max_idx && avi_idx_grow(AVI))
+   {
+      AVI_errno = AVI_ERR_NO_MEM;
+      return -1;
+   }
+   e = AVI->idx_page[AVI->n_idx/AVI_IDX_PAGE][AVI->n_idx%AVI_IDX_PAGE];
+
+   memcpy(e,tag,4);
+   long2str(e+ 4,flags);
+   long2str(e+ 8,pos);
+   long2str(e+12,len);
+
+   AVI->n_idx++;
+
+   return 0;
+}
+
+/* Copy the pages into one AVI->idx table, for the reader */
+
+static int avi_idx_flatten(avi_t *AVI)
+{
+   unsigned char (*idx)[16];
+   long i, n;
+
+   idx = (unsigned char (*)[16])malloc(AVI->n_idx ? AVI->n_idx*16 : 16);
+   if(idx == NULL) return -1;
+   for(i=0; i<AVI->n_idx; i+=n)
+   {
+      n = AVI->n_idx - i < AVI_IDX_PAGE ? AVI->n_idx - i : AVI_IDX_PAGE;
+      memcpy(idx[i], AVI->idx_page[i/AVI_IDX_PAGE], n*16);
+   }
+   n = AVI->n_idx;
+   avi_idx_free(AVI);
+   AVI->idx = idx;
+   AVI->n_idx = AVI->max_idx = n;
+
+   return 0;
+}
+
+/* Write data that is not a chunk (or doesn't go through the writer) at
+   AVI->pos, behind everything a writer has staged */
+
+static int avi_write_raw(avi_t *AVI, struct iovec *iov, int cnt)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   ssize_t total = 0;
+   int i;
+
+   if(AVI_flush(AVI)) return -1;
+   if(w != NULL && w->direct)
+      avi_direct_mode(w, 0);
+
+   for(i=0; i<cnt; i++)
+      total += iov[i].iov_len;
+   if(avi_pwritev(AVI->fdes, iov, cnt, AVI->pos) != total)
+   {
+      lseek(AVI->fdes,AVI->pos,SEEK_SET);
+      return -1;
+   }
+   AVI->pos += total;
+   lseek(AVI->fdes,AVI->pos,SEEK_SET);
+
+   /* the direct writer goes on from the block holding the new end */
+   if(w != NULL && w->direct && avi_direct_load(AVI, AVI->pos))
+      return -1;
+
+   return 0;
+}
+
+/* Append the idx1 chunk, writing one buffer per index page.
+   Returns -1 on write error, 0 on success */
+
+static int avi_add_index_chunk(avi_t *AVI)
+{
+   unsigned char c[8];
+   struct iovec *iov;
+   long len = AVI->n_idx*16;
+   long off, n;
+   int i, cnt;
+
+   memcpy(c,"idx1",4);
+   long2str(c+4,len);
+
+   if(AVI->buf != NULL)
+   {
+      if(AVI->pos + 8 + len > AVI->buf_len) return -1;
+      memcpy(AVI->buf + AVI->pos, c, 8);
+      for(i=0, off=0; off<len; i++, off+=n)
+      {
+         n = len - off < AVI_IDX_PAGE*16 ? len - off : AVI_IDX_PAGE*16;
+         memcpy(AVI->buf + AVI->pos + 8 + off, AVI->idx_page[i], n);
+      }
+      AVI->pos += 8 + len;
+      return 0;
+   }
+
+   cnt = 1 + (AVI->n_idx + AVI_IDX_PAGE - 1)/AVI_IDX_PAGE;
+   iov = (struct iovec *)malloc(cnt*sizeof(struct iovec));
+   if(iov == NULL) return -1;
+   iov[0].iov_base = c;
+   iov[0].iov_len = 8;
+   for(i=1, off=0; off<len; i++, off+=n)
+   {
+      n = len - off < AVI_IDX_PAGE*16 ? len - off : AVI_IDX_PAGE*16;
+      iov[i].iov_base = AVI->idx_page[i-1];
+      iov[i].iov_len = n;
+   }
+
+   n = avi_write_raw(AVI, iov, cnt);
+   free(iov);
+
+   return n;
+}
+
+
+/*
+   AVI_open_output_file: Open an AVI File and write a bunch
+                         of zero bytes as space for the header.
+
+   returns a pointer to avi_t on success, a zero pointer on error
+*/
+
+int AVI_Init_fd(avi_t *AVI, int width, int height, int fps, const char *compressor, int duration, const char *file_name)
+{
+	/* the index grows with the recording */
+	avi_idx_init(AVI);
+	AVI->writer = NULL;
+	AVI->odml = NULL;
+	AVI->ckp = NULL;
+	AVI->tsix = NULL;
+	AVI->durable = NULL;
+	AVI->input = NULL;
+	AVI->track = NULL;
+	AVI->anum = 0;
+	AVI->duration = duration;
+
+    AVI->pos = HEADERBYTES;
+	AVI->buf_len = 1024*1024*512;		
+
+	/* write avi head */
+	AVI_set_video(AVI, width, height, fps, compressor);
+	//if(AUDIO_ENC_FMT_AAC == CFG_GetAudioEncType())
+		//AVI_set_audio(AVI, 1, 16000, 16, 1);
+	//else
+		AVI_set_audio(AVI,1,8000,16, 1);
+
+	AVI->fdes = open(file_name, O_RDWR | O_NONBLOCK | O_CREAT | O_TRUNC, 00644);
+	if (AVI->fdes < 0) 
+	{
+		printf("create file %s err!\n",file_name);
+		AVI_close_fd(AVI);
+		return(-1);
+	}
+	/* ƫAVIļдͷHEADERBYTES */
+    if (lseek(AVI->fdes,AVI->pos,SEEK_SET) < 0)
+     {
+		printf("create file %s err!\n",file_name);
+		AVI_close_fd(AVI);
+		return -1;
+     }
+
+	AVI->buf = NULL;
+	return(1);
+}
+
+
+/*
+   AVI_open_output_file: Open an AVI File and write a bunch
+                         of zero bytes as space for the header.
+
+   returns a pointer to avi_t on success, a zero pointer on error
+*/
+
+int AVI_Init(avi_t *AVI, int file_size, int idx_size)
+{
+	/* the index grows with the recording, idx_size only sizes the buffer */
+	AVI->idxPtr = NULL;
+	AVI->writer = NULL;
+	AVI->odml = NULL;
+	AVI->ckp = NULL;
+	AVI->tsix = NULL;
+	AVI->durable = NULL;
+	AVI->input = NULL;
+	AVI->track = NULL;
+	AVI->anum = 0;
+	avi_idx_init(AVI);
+
+	/* apply for buf space */
+	AVI->buf = (unsigned char*)malloc(file_size+(idx_size+1024)*24);
+	if(NULL == AVI->buf){
+		printf("malloc error \n");
+		return GS_FAIL;
+	}
+    memset(AVI->buf,0,HEADERBYTES);
+    AVI->pos  = HEADERBYTES;
+	AVI->buf_len = file_size+(idx_size+1024)*24;
+	AVI->fdes = -1;
+
+	return GS_SUCCESS;
+}
+
+
+void AVI_set_video(avi_t *AVI, int width, int height, int fps, const char *compressor)
+{
+	AVI->width  = width; 
+    AVI->height = height;
+	if(((height%288)==0) && width >=352)
+	{
+		/*  PAL CIF */
+		AVI->dwMicroSecPerFrame = 40000;
+        AVI->dwSuggestedBufferSize =144008;
+	}
+	else 
+	{
+		/* С PAL CIF */
+		AVI->dwMicroSecPerFrame = 33366;
+        AVI->dwSuggestedBufferSize =120008;
+	}
+	AVI->fps    = fps;
+	memcpy(AVI->compressor,compressor,4);
+	AVI->compressor[4] = 0;
+}
+
+
+void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
+{
+   /* may only be called if file is open for writing */
+
+   AVI->a_chans = channels;
+   AVI->a_rate  = rate;
+   AVI->a_bits  = bits;
+   AVI->a_fmt   = format;
+}
+
+#define OUT4CC(s) \
+   if(nhb<=HEADERBYTES-4) memcpy(AVI_header+nhb,s,4); nhb += 4
+
+#define OUTLONG(n) \
+   if(nhb<=HEADERBYTES-4) long2str(AVI_header+nhb,n); nhb += 4
+
+#define OUTSHRT(n) \
+   if(nhb<=HEADERBYTES-2) { \
+      AVI_header[nhb  ] = (n   )&0xff; \
+      AVI_header[nhb+1] = (n>>8)&0xff; \
+   } \
+   nhb += 2
+
+
+/*******************************************************************
+ *                                                                 *
+ *    OpenDML (AVI 2.0) writer                                     *
+ *                                                                 *
+ *******************************************************************/
+
+/* The file is split into RIFF segments of at most riff_bytes. The first
+   one is the usual RIFF 'AVI ' with the header, a movi list and an idx1
+   for AVI 1.0 readers that covers this segment only; the others are
+   RIFF 'AVIX' with just a movi list. Every movi list ends with a
+   standard index per stream (ix00, ix01) and the indx super index in
+   each stream header points to them. The index arena only holds the
+   entries of the current segment, relative to the segment start. */
+
+typedef struct
+{
+   u64    offset;            /* of the ix## chunk */
+   u32    size;              /* of the ix## chunk, including its header */
+   u32    duration;          /* frames or audio samples */
+} avi_odml_entry_t;
+
+typedef struct
+{
+   off_t  riff_bytes;
+   off_t  riff_start;        /* offset of the current RIFF, 0 for the first */
+   int    nseg;              /* finished segments */
+   long   first_frames;      /* video frames of the first RIFF */
+   long   first_movi_len;
+   off_t  first_riff_end;
+   int    nvix;
+   int    naix;
+   avi_odml_entry_t vix[AVI_ODML_MAX_SEGMENTS];
+   avi_odml_entry_t aix[AVI_ODML_MAX_SEGMENTS];
+
+   /* repair: ix## chunks of the current segment found so far */
+   off_t  ix_pos;
+   avi_odml_entry_t pend_v;
+   avi_odml_entry_t pend_a;
+} avi_odml_t;
+
+/* Overwrite bytes that have already been written */
+
+static int avi_patch(avi_t *AVI, off_t off, unsigned char *c, long len)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   off_t from, to;
+
+   if(avi_pwrite(AVI->fdes, (char *)c, len, off) != len) return -1;
+
+   /* the direct writer may hold the block in its buffer */
+   if(w != NULL && w->direct)
+   {
+      from = off > w->stage_off ? off : w->stage_off;
+      to = off + len < w->stage_off + w->stage_len ? off + len : w->stage_off + w->stage_len;
+      if(from < to)
+         memcpy(w->stage + (from - w->stage_off), c + (from - off), to - from);
+   }
+   return 0;
+}
+
+static int avi_patch_long(avi_t *AVI, off_t off, long n)
+{
+   unsigned char c[4];
+
+   long2str(c, n);
+   return avi_patch(AVI, off, c, 4);
+}
+
+/* Write the standard index of one stream for the current segment,
+   returns 1 if the stream has no chunks in it */
+
+static int avi_odml_write_ix(avi_t *AVI, const char *fcc, const char *chunk_id,
+                             avi_odml_entry_t *e, int sampsize)
+{
+   avi_odml_t *o = (avi_odml_t *)AVI->odml;
+   unsigned char *ix, *p, *ent;
+   struct iovec iov;
+   long i, n = 0, len;
+   u64 bytes = 0;
+   u32 size;
+   int ret;
+
+   for(i=0; i<AVI->n_idx; i++)
+      if(memcmp(AVI->idx_page[i/AVI_IDX_PAGE][i%AVI_IDX_PAGE], chunk_id, 4) == 0) n++;
+   if(n == 0) return 1;
+
+   len = 32 + 8*n;
+   ix = (unsigned char *)malloc(len);
+   if(ix == NULL)
+   {
+      AVI_errno = AVI_ERR_NO_MEM;
+      return -1;
+   }
+
+   memcpy(ix, fcc, 4);
+   long2str(ix+4, len-8);
+   ix[8] = 2;                         /* wLongsPerEntry */
+   ix[9] = 0;
+   ix[10] = 0;                        /* bIndexSubType */
+   ix[11] = AVI_INDEX_OF_CHUNKS;
+   long2str(ix+12, n);
+   memcpy(ix+16, chunk_id, 4);
+   long2str(ix+20, (u64)o->riff_start & 0xffffffff);   /* qwBaseOffset */
+   long2str(ix+24, (u64)o->riff_start >> 32);
+   long2str(ix+28, 0);
+
+   p = ix + 32;
+   for(i=0; i<AVI->n_idx; i++)
+   {
+      ent = AVI->idx_page[i/AVI_IDX_PAGE][i%AVI_IDX_PAGE];
+      if(memcmp(ent, chunk_id, 4)) continue;
+      size = str2ulong(ent+12);
+      long2str(p, str2ulong(ent+8) + 8);        /* offset of the data */
+      long2str(p+4, (str2ulong(ent+4) & 0x10) ? size : size|0x80000000);
+      bytes += size;
+      p += 8;
+   }
+
+   e->offset = AVI->pos;
+   e->size = len;
+   e->duration = sampsize ? bytes/sampsize : n;
+
+   iov.iov_base = ix;
+   iov.iov_len = len;
+   ret = avi_write_raw(AVI, &iov, 1);
+   free(ix);
+   if(ret) AVI_errno = AVI_ERR_WRITE;
+
+   return ret;
+}
+
+/* Close the movi list of the current segment */
+
+static int avi_odml_end_segment(avi_t *AVI)
+{
+   avi_odml_t *o = (avi_odml_t *)AVI->odml;
+   int ret;
+
+   ret = avi_odml_write_ix(AVI, "ix00", "00dc", &o->vix[o->nvix], 0);
+   if(ret < 0) return -1;
+   if(ret == 0) o->nvix++;
+   ret = avi_odml_write_ix(AVI, "ix01", "01wb", &o->aix[o->naix], avi_sampsize(AVI));
+   if(ret < 0) return -1;
+   if(ret == 0) o->naix++;
+
+   if(o->riff_start == 0)
+   {
+      o->first_movi_len = AVI->pos - HEADERBYTES + 4;
+      o->first_frames = AVI->video_frames;
+      if(avi_add_index_chunk(AVI))
+      {
+         AVI_errno = AVI_ERR_WRITE_INDEX;
+         return -1;
+      }
+      o->first_riff_end = AVI->pos;
+   }
+   else if(avi_patch_long(AVI, o->riff_start+4, AVI->pos - o->riff_start - 8) ||
+           avi_patch_long(AVI, o->riff_start+16, AVI->pos - o->riff_start - 20))
+   {
+      AVI_errno = AVI_ERR_WRITE;
+      return -1;
+   }
+
+   o->nseg++;
+   AVI->n_idx = 0;
+   return 0;
+}
+
+/* Called before a chunk of total bytes is added: start a new RIFF 'AVIX'
+   if the chunk and the indexes would not fit into the current one */
+
+static int avi_odml_reserve(avi_t *AVI, long total)
+{
+   avi_odml_t *o = (avi_odml_t *)AVI->odml;
+   unsigned char h[24];
+   struct iovec iov;
+   off_t need;
+
+   need = AVI->pos - o->riff_start + total + 2*32 + (AVI->n_idx+1)*8;
+   if(o->riff_start == 0)
+      need += 8 + (AVI->n_idx+1)*16;     /* idx1 */
+   if(need <= o->riff_bytes || AVI->n_idx == 0)
+      return 0;
+
+   /* the super indexes have to fit into the header */
+   if(o->nseg + 2 > AVI_ODML_MAX_SEGMENTS)
+   {
+      printf("avifile had beyond %d RIFF segments\n", AVI_ODML_MAX_SEGMENTS);
+      AVI_errno = AVI_ERR_SIZELIM;
+      return -1;
+   }
+
+   if(avi_odml_end_segment(AVI)) return -1;
+
+   memcpy(h, "RIFF", 4);
+   long2str(h+4, 0);                 /* patched when the segment ends */
+   memcpy(h+8, "AVIX", 4);
+   memcpy(h+12, "LIST", 4);
+   long2str(h+16, 0);
+   memcpy(h+20, "movi", 4);
+
+   o->riff_start = AVI->pos;
+   iov.iov_base = h;
+   iov.iov_len = sizeof(h);
+   if(avi_write_raw(AVI, &iov, 1))
+   {
+      AVI_errno = AVI_ERR_WRITE;
+      return -1;
+   }
+   return 0;
+}
+
+/* Write the indexes of the last segment, used instead of the idx1 chunk
+   when the file is closed */
+
+static int avi_odml_finish(avi_t *AVI)
+{
+   avi_odml_t *o = (avi_odml_t *)AVI->odml;
+
+   if(o->riff_start == 0 && o->nseg)
+      return 0;                      /* already done */
+   return avi_odml_end_segment(AVI);
+}
+
+/* Offset the index entries of the current segment are relative to */
+
+static off_t avi_odml_base(avi_t *AVI)
+{
+   return AVI->odml ? ((avi_odml_t *)AVI->odml)->riff_start : 0;
+}
+
+/* Length of the first RIFF and its movi list, and the frames in it */
+
+static void avi_odml_first_riff(avi_t *AVI, off_t *riff_end, int *movi_len, long *frames)
+{
+   avi_odml_t *o = (avi_odml_t *)AVI->odml;
+
+   if(o == NULL || o->nseg == 0) return;
+   *riff_end = o->first_riff_end;
+   *movi_len = o->first_movi_len;
+   *frames = o->first_frames;
+}
+
+/* Super index of a stream, goes into its strl list */
+
+static long avi_odml_indx(avi_t *AVI, unsigned char *AVI_header, long nhb, int audio)
+{
+   avi_odml_t *o = (avi_odml_t *)AVI->odml;
+   avi_odml_entry_t *e;
+   int i, n;
+
+   if(o == NULL) return nhb;
+   e = audio ? o->aix : o->vix;
+   n = audio ? o->naix : o->nvix;
+   if(nhb + 32 + 16*n > HEADERBYTES) return nhb;
+
+   OUT4CC ("indx");
+   OUTLONG(24 + 16*n);          /* # of bytes to follow */
+   OUTSHRT(4);                  /* wLongsPerEntry */
+   AVI_header[nhb++] = 0;       /* bIndexSubType */
+   AVI_header[nhb++] = AVI_INDEX_OF_INDEXES;
+   OUTLONG(n);                  /* nEntriesInUse */
+   OUT4CC (audio ? "01wb" : "00dc");
+   OUTLONG(0);                  /* Reserved */
+   OUTLONG(0);
+   OUTLONG(0);
+   for(i=0; i<n; i++)
+   {
+      OUTLONG(e[i].offset & 0xffffffff);
+      OUTLONG(e[i].offset >> 32);
+      OUTLONG(e[i].size);
+      OUTLONG(e[i].duration);
+   }
+
+   return nhb;
+}
+
+/* Extended header with the total number of frames, goes into hdrl */
+
+static long avi_odml_dmlh(avi_t *AVI, unsigned char *AVI_header, long nhb)
+{
+   if(AVI->odml == NULL || nhb + 268 > HEADERBYTES) return nhb;
+
+   OUT4CC ("LIST");
+   OUTLONG(4 + 8 + 248);        /* # of bytes to follow */
+   OUT4CC ("odml");
+   OUT4CC ("dmlh");
+   OUTLONG(248);
+   OUTLONG(AVI->video_frames);  /* dwTotalFrames */
+   memset(AVI_header+nhb, 0, 244);
+   nhb += 244;
+
+   return nhb;
+}
+
+/* Repair of a file cut off while it was written: AVI_deformity_file
+   hands the chunks that are not stream data here. The ix## chunks of a
+   segment only count once the idx1 or the next RIFF shows that the
+   segment was finished; otherwise AVI->pos goes back to them and the
+   close writes them again. Returns 1 if the chunk was OpenDML structure
+   (AVI->pos is then behind it), 0 if not, -1 on error. */
+
+static void avi_odml_repair_ix(avi_t *AVI, avi_odml_entry_t *e, off_t pos, long len, const char *chunk_id, int sampsize)
+{
+   unsigned char *ent;
+   u64 bytes = 0;
+   long i, n = 0;
+
+   for(i=0; i<AVI->n_idx; i++)
+   {
+      ent = AVI->idx_page[i/AVI_IDX_PAGE][i%AVI_IDX_PAGE];
+      if(memcmp(ent, chunk_id, 4)) continue;
+      bytes += str2ulong(ent+12);
+      n++;
+   }
+   e->offset = pos;
+   e->size = 8 + len;
+   e->duration = sampsize ? bytes/sampsize : n;
+}
+
+static int avi_odml_repair_commit(avi_t *AVI)
+{
+   avi_odml_t *o = (avi_odml_t *)AVI->odml;
+
+   if(o->nvix >= AVI_ODML_MAX_SEGMENTS || o->naix >= AVI_ODML_MAX_SEGMENTS) return -1;
+   if(o->pend_v.size) o->vix[o->nvix++] = o->pend_v;
+   if(o->pend_a.size) o->aix[o->naix++] = o->pend_a;
+   memset(&o->pend_v, 0, sizeof(avi_odml_entry_t));
+   memset(&o->pend_a, 0, sizeof(avi_odml_entry_t));
+   o->ix_pos = 0;
+   o->nseg++;
+   AVI->n_idx = 0;
+   return 0;
+}
+
+static int avi_odml_repair_chunk(avi_t *AVI, unsigned char *hdr, off_t pos, off_t size)
+{
+   avi_odml_t *o = (avi_odml_t *)AVI->odml;
+   long len = str2ulong(hdr+4);
+
+   /* a RIFF may be cut off, the chunks of its index may not */
+   if(strncasecmp((char *)hdr, "RIFF", 4) && pos + 8 + PAD_EVEN(len) > size) return 0;
+
+   if(strncasecmp((char *)hdr, "ix00", 4) == 0 || strncasecmp((char *)hdr, "ix01", 4) == 0)
+   {
+      if(o == NULL)
+      {
+         o = (avi_odml_t *)malloc(sizeof(avi_odml_t));
+         if(o == NULL) return -1;
+         memset(o, 0, sizeof(avi_odml_t));
+         o->riff_bytes = (off_t)AVI_ODML_RIFF_MB*1024*1024;
+         AVI->odml = o;
+      }
+      if(o->ix_pos == 0) o->ix_pos = pos;
+      if(hdr[3] == '0')
+         avi_odml_repair_ix(AVI, &o->pend_v, pos, len, "00dc", 0);
+      else
+         avi_odml_repair_ix(AVI, &o->pend_a, pos, len, "01wb", avi_sampsize(AVI));
+      AVI->pos = pos + 8 + PAD_EVEN(len);
+      return 1;
+   }
+   if(o == NULL) return 0;
+
+   if(strncasecmp((char *)hdr, "idx1", 4) == 0 && o->riff_start == 0 && o->nseg == 0)
+   {
+      o->first_movi_len = pos - HEADERBYTES + 4;
+      o->first_frames = AVI->video_frames;
+      if(avi_odml_repair_commit(AVI)) return -1;
+      o->first_riff_end = pos + 8 + PAD_EVEN(len);
+      AVI->pos = o->first_riff_end;
+      return 1;
+   }
+   if(strncasecmp((char *)hdr, "RIFF", 4) == 0 && o->nseg > 0)
+   {
+      /* the segment before was finished, its sizes are patched */
+      if(o->riff_start != 0 && avi_odml_repair_commit(AVI)) return -1;
+      o->riff_start = pos;
+      AVI->pos = pos + 24;           /* RIFF 'AVIX', LIST 'movi' */
+      return 1;
+   }
+   return 0;
+}
+
+/* End of the repair walk: unfinished ix## chunks are written again */
+
+static void avi_odml_repair_end(avi_t *AVI)
+{
+   avi_odml_t *o = (avi_odml_t *)AVI->odml;
+
+   if(o == NULL || o->ix_pos == 0) return;
+   AVI->pos = o->ix_pos;
+   memset(&o->pend_v, 0, sizeof(avi_odml_entry_t));
+   memset(&o->pend_a, 0, sizeof(avi_odml_entry_t));
+   o->ix_pos = 0;
+}
+
+int AVI_set_opendml(avi_t *AVI, int riff_mb)
+{
+   avi_odml_t *o;
+
+   if(AVI->fdes < 0 || AVI->buf != NULL || AVI->odml != NULL || AVI->ckp != NULL || AVI->tsix != NULL || AVI->anum > 1) return -1;
+   if(AVI->pos != HEADERBYTES) return -1;        /* before the first chunk */
+
+   o = (avi_odml_t *)malloc(sizeof(avi_odml_t));
+   if(o == NULL) return -1;
+   memset(o, 0, sizeof(avi_odml_t));
+   if(riff_mb <= 0) riff_mb = AVI_ODML_RIFF_MB;
+   if(riff_mb > 4095) riff_mb = 4095;          /* 32 bit RIFF size */
+   o->riff_bytes = (off_t)riff_mb*1024*1024;
+   AVI->odml = o;
+
+   return 0;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Index checkpoints                                            *
+ *                                                                 *
+ *******************************************************************/
+
+/* Every interval_ms the writer hands the index entries of the chunks
+   that reached the file since the last checkpoint, behind a record with
+   the counts the header needs, and the header for these counts to the
+   group commit thread. That thread rewrites the header and appends the
+   record to <file>.ckp, so the recording thread does no I/O for it.
+   Chunks the writer still holds are left for the next checkpoint.
+   AVI_deformity_file continues from the last record whose entries check
+   out against the file and only scans what follows it. A clean close
+   removes the journal. */
+
+#define AVI_CKP_SUFFIX         ".ckp"
+
+typedef struct
+{
+   char  tag[4];             /* "ckpt" */
+   u32   count;              /* index entries following the record */
+   u32   n_idx;              /* entries in the journal up to here */
+   u32   video_frames;
+   u64   pos;
+   u64   audio_bytes;
+   u32   sum;                /* of the entries */
+   u32   reserved;
+} avi_ckp_rec_t;
+
+typedef struct avi_ckp_s
+{
+   int    fd;
+   int    file_fd;           /* the recording, without O_DIRECT */
+   int    sync;
+   long   interval_ms;
+   long   last_ms;
+   char  *name;
+
+   /* owned by the group commit thread while busy */
+   long   n_idx;             /* entries in the journal */
+   off_t  end;               /* journal length */
+   avi_ckp_rec_t *rec;       /* record and entries to append */
+   size_t rec_len;
+   unsigned char header[HEADERBYTES];
+   int    busy;
+   int    err;               /* the last checkpoint failed */
+   struct avi_ckp_s *queue;
+} avi_ckp_t;
+
+/* in the group commit section */
+static int  avi_ckp_pending(avi_ckp_t *c);
+static void avi_ckp_post(avi_ckp_t *c);
+static void avi_ckp_wait(avi_t *AVI);
+
+static char *avi_ckp_name(const char *file_name)
+{
+   char *name = (char *)malloc(strlen(file_name) + sizeof(AVI_CKP_SUFFIX));
+
+   if(name != NULL)
+   {
+      strcpy(name, file_name);
+      strcat(name, AVI_CKP_SUFFIX);
+   }
+   return name;
+}
+
+static u32 avi_ckp_sum(const unsigned char *p, long n)
+{
+   u32 h = 2166136261u;
+
+   while(n-- > 0) h = (h ^ *p++) * 16777619u;
+   return h;
+}
+
+int AVI_set_checkpoint(avi_t *AVI, const char *file_name, int interval_ms, int sync)
+{
+   avi_ckp_t *c;
+
+   if(AVI->fdes < 0 || AVI->buf != NULL || AVI->odml != NULL || AVI->ckp != NULL || AVI->anum > 1) return -1;
+   if(AVI_durable_init(0)) return -1;
+
+   c = (avi_ckp_t *)malloc(sizeof(avi_ckp_t));
+   if(c == NULL) return -1;
+   memset(c, 0, sizeof(avi_ckp_t));
+   c->fd = -1;
+   c->file_fd = open(file_name, O_WRONLY);
+   if(c->file_fd < 0) goto __exit_ckp;
+   c->name = avi_ckp_name(file_name);
+   if(c->name == NULL) goto __exit_ckp;
+   c->fd = open(c->name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+   if(c->fd < 0) goto __exit_ckp;
+
+   c->sync = sync;
+   c->interval_ms = interval_ms > 0 ? interval_ms : AVI_CKP_MS;
+   c->last_ms = avi_now_ms();
+   AVI->ckp = c;
+   return 0;
+
+__exit_ckp:
+   if(c->file_fd >= 0) close(c->file_fd);
+   free(c->name);
+   free(c);
+   return -1;
+}
+
+/* End of the chunks that reached the file, the writer may hold more */
+
+static off_t avi_ckp_file_end(avi_t *AVI)
+{
+   avi_writer_t *w = (avi_writer_t *)AVI->writer;
+   off_t end;
+
+   if(w == NULL) return AVI->pos;
+   if(w->direct) return w->stage_off;
+
+   end = w->marked ? w->base.pos : AVI->pos;
+   if(w->async)
+   {
+      pthread_mutex_lock(&w->lock);
+      if(w->busy || w->error) end = w->back_base.pos;
+      pthread_mutex_unlock(&w->lock);
+   }
+   return end;
+}
+
+/* Prepare the record of the entries up to the file end and the header
+   for their counts, returns 1 if there is nothing new */
+
+static int avi_ckp_prepare(avi_t *AVI)
+{
+   avi_ckp_t *c = (avi_ckp_t *)AVI->ckp;
+   avi_ckp_rec_t *r;
+   unsigned char *e;
+   off_t end, pos, save_pos;
+   long i, k, n, frames, save_frames;
+   u64 bytes, save_bytes;
+   size_t len;
+   int ret;
+
+   /* drop the entries of the chunks behind the file end from the counts */
+   end = avi_ckp_file_end(AVI);
+   n = AVI->n_idx;
+   pos = AVI->pos;
+   frames = AVI->video_frames;
+   bytes = AVI->audio_bytes;
+   while(n > c->n_idx)
+   {
+      e = AVI->idx_page[(n-1)/AVI_IDX_PAGE][(n-1)%AVI_IDX_PAGE];
+      if(str2ulong(e+8) + 8 + PAD_EVEN(str2ulong(e+12)) <= (u64)end) break;
+      if(e[2] == 'w')
+         bytes -= str2ulong(e+12);
+      else
+         frames--;
+      pos = str2ulong(e+8);
+      n--;
+   }
+   if(n == c->n_idx) return 1;
+
+   len = sizeof(avi_ckp_rec_t) + (n - c->n_idx)*16;
+   r = (avi_ckp_rec_t *)malloc(len);
+   if(r == NULL) return -1;
+
+   e = (unsigned char *)(r + 1);
+   for(i=0;i<n-c->n_idx;i++)
+   {
+      k = c->n_idx + i;
+      memcpy(e + i*16, AVI->idx_page[k/AVI_IDX_PAGE][k%AVI_IDX_PAGE], 16);
+   }
+   memset(r, 0, sizeof(avi_ckp_rec_t));
+   memcpy(r->tag, "ckpt", 4);
+   r->count        = n - c->n_idx;
+   r->n_idx        = n;
+   r->video_frames = frames;
+   r->pos          = pos;
+   r->audio_bytes  = bytes;
+   r->sum          = avi_ckp_sum(e, r->count*16);
+
+   /* the header as AVI_init_file_header writes it for these counts */
+   save_pos = AVI->pos;
+   save_frames = AVI->video_frames;
+   save_bytes = AVI->audio_bytes;
+   AVI->pos = pos;
+   AVI->video_frames = frames;
+   AVI->audio_bytes = bytes;
+   ret = avi_file_header(AVI, c->header);
+   AVI->pos = save_pos;
+   AVI->video_frames = save_frames;
+   AVI->audio_bytes = save_bytes;
+   if(ret)
+   {
+      free(r);
+      return -1;
+   }
+
+   c->rec = r;
+   c->rec_len = len;
+   return 0;
+}
+
+/* Run by the group commit thread: header, then the record. The entries
+   must not point at data that isn't in the file, with sync the file is
+   synced before the record is written. */
+
+static int avi_ckp_write(avi_ckp_t *c)
+{
+   avi_ckp_rec_t *r = c->rec;
+   int ret = -1;
+
+   if(avi_pwrite(c->file_fd, (char *)c->header, HEADERBYTES, 0) != HEADERBYTES ||
+      (c->sync && fdatasync(c->file_fd)))
+      goto __exit_ckp_write;
+
+   /* a torn record fails its check and the next one overwrites it */
+   if(avi_pwrite(c->fd, (char *)r, c->rec_len, c->end) != (ssize_t)c->rec_len ||
+      (c->sync && fdatasync(c->fd)))
+      goto __exit_ckp_write;
+
+   c->end += c->rec_len;
+   c->n_idx = r->n_idx;
+   ret = 0;
+
+__exit_ckp_write:
+   free(r);
+   c->rec = NULL;
+   return ret;
+}
+
+static void avi_ckp_tick(avi_t *AVI)
+{
+   avi_ckp_t *c = (avi_ckp_t *)AVI->ckp;
+   int ret;
+
+   if(avi_now_ms() - c->last_ms < c->interval_ms) return;
+   c->last_ms = avi_now_ms();
+
+   /* the last one is still in work, try again at the next interval */
+   ret = avi_ckp_pending(c);
+   if(ret > 0) return;
+   if(ret < 0) printf("avi checkpoint to %s failed\n", c->name);
+
+   ret = avi_ckp_prepare(AVI);
+   if(ret == 0)
+      avi_ckp_post(c);
+   else if(ret < 0)
+      printf("avi checkpoint to %s failed\n", c->name);
+}
+
+/* clean is set when header and index made it into the file */
+static void avi_ckp_free(avi_t *AVI, int clean)
+{
+   avi_ckp_t *c = (avi_ckp_t *)AVI->ckp;
+
+   if(c == NULL) return;
+   avi_ckp_wait(AVI);
+   close(c->fd);
+   close(c->file_fd);
+   if(clean && (!c->sync || fdatasync(AVI->fdes) == 0))
+      unlink(c->name);
+   free(c->name);
+   free(c);
+   AVI->ckp = NULL;
+}
+
+/* Take the index, pos and counts of the last checkpoint of file_name
+   that matches the file, returns the number of index entries loaded */
+static long avi_ckp_load(avi_t *AVI, const char *file_name, off_t size)
+{
+   avi_ckp_rec_t r;
+   unsigned char *e, hdr[8], *last;
+   char *name;
+   off_t off = 0;
+   long i, n = 0;
+   int fd;
+
+   name = avi_ckp_name(file_name);
+   if(name == NULL) return 0;
+   fd = open(name, O_RDONLY);
+   free(name);
+   if(fd < 0) return 0;
+
+   while(pread(fd, &r, sizeof(r), off) == sizeof(r))
+   {
+      if(memcmp(r.tag, "ckpt", 4) != 0 || r.n_idx != n + r.count ||
+         r.pos < HEADERBYTES || r.pos > (u64)size)
+         break;
+
+      e = (unsigned char *)malloc(r.count*16 + 1);
+      if(e == NULL) break;
+      if(pread(fd, e, r.count*16, off + sizeof(r)) != (ssize_t)(r.count*16) ||
+         avi_ckp_sum(e, r.count*16) != r.sum)
+      {
+         free(e);
+         break;
+      }
+
+      /* without fdatasync the journal may be ahead of the file */
+      if(r.count)
+      {
+         last = e + (r.count-1)*16;
+         if(pread(AVI->fdes, hdr, 8, str2ulong(last+8)) != 8 ||
+            memcmp(hdr, last, 4) != 0 || str2ulong(hdr+4) != str2ulong(last+12))
+         {
+            free(e);
+            break;
+         }
+      }
+
+      for(i=0;i<r.count;i++)
+         if(avi_add_index_entry(AVI, e+i*16, str2ulong(e+i*16+4),
+                                str2ulong(e+i*16+8), str2ulong(e+i*16+12)))
+            break;
+      free(e);
+      if(i < r.count)
+      {
+         AVI->n_idx = n;
+         break;
+      }
+
+      AVI->pos          = r.pos;
+      AVI->video_frames = r.video_frames;
+      AVI->audio_bytes  = r.audio_bytes;
+      n = r.n_idx;
+      off += sizeof(r) + r.count*16;
+   }
+
+   close(fd);
+   return n;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Time index                                                   *
+ *                                                                 *
+ *******************************************************************/
+
+/* The writer keeps the rt of every video frame and whether it is a
+   keyframe, and appends them behind idx1 as a 'tsix' chunk:
+   u32 count, u32 reserved, u32 rt[count], keyframe bitmap[(count+7)/8].
+   The reader loads it into video_index[].key plus a list of the
+   keyframes, which AVI_seek_time searches. */
+
+typedef struct
+{
+   u32   *pts;               /* little endian in the writer */
+   unsigned char *key;       /* bitmap, writer only */
+   long   n;
+   long   max;
+   long  *keys;              /* keyframe numbers, reader only */
+   long   nkeys;
+} avi_tsix_t;
+
+int AVI_set_time_index(avi_t *AVI)
+{
+   avi_tsix_t *t;
+
+   if(AVI->fdes < 0 || AVI->buf != NULL || AVI->odml != NULL || AVI->tsix != NULL) return -1;
+
+   t = (avi_tsix_t *)malloc(sizeof(avi_tsix_t));
+   if(t == NULL) return -1;
+   memset(t, 0, sizeof(avi_tsix_t));
+   AVI->tsix = t;
+
+   return 0;
+}
+
+static void avi_tsix_free(avi_t *AVI)
+{
+   avi_tsix_t *t = (avi_tsix_t *)AVI->tsix;
+
+   if(t == NULL) return;
+   free(t->pts);
+   free(t->key);
+   free(t->keys);
+   free(t);
+   AVI->tsix = NULL;
+}
+
+/* Whether a frame starts a GOP: an H.264 IDR or SPS, an H.265 IRAP or
+   VPS within the first NAL units. Other codecs only have keyframes. */
+
+int AVI_frame_is_key(avi_t *AVI, unsigned char *data, int bytes)
+{
+   int i, n = bytes < 256 ? bytes : 256;
+   int hevc, type;
+
+   hevc = strncasecmp(AVI->compressor, "H265", 4) == 0 || strncasecmp(AVI->compressor, "HEVC", 4) == 0;
+   if(!hevc && strncasecmp(AVI->compressor, "H264", 4) != 0 && strncasecmp(AVI->compressor, "AVC1", 4) != 0)
+      return 1;
+
+   for(i=0; i+3<n; i++)
+   {
+      if(data[i] != 0 || data[i+1] != 0 || data[i+2] != 1) continue;
+      if(hevc)
+      {
+         type = (data[i+3] >> 1) & 0x3f;
+         if((type >= 16 && type <= 23) || type == 32) return 1;
+      }
+      else
+      {
+         type = data[i+3] & 0x1f;
+         if(type == 5 || type == 7) return 1;
+      }
+      i += 2;
+   }
+   return 0;
+}
+
+/* Make room for one more frame before the frame is written */
+
+static int avi_tsix_reserve(avi_t *AVI)
+{
+   avi_tsix_t *t = (avi_tsix_t *)AVI->tsix;
+   unsigned char *key;
+   u32 *pts;
+   long max;
+
+   if(t->n < t->max) return 0;
+
+   max = t->max ? t->max*2 : 4096;
+   pts = (u32 *)realloc(t->pts, max*sizeof(u32));
+   if(pts == NULL) return -1;
+   t->pts = pts;
+   key = (unsigned char *)realloc(t->key, max/8);
+   if(key == NULL) return -1;
+   memset(key + t->max/8, 0, (max - t->max)/8);
+   t->key = key;
+   t->max = max;
+
+   return 0;
+}
+
+static void avi_tsix_add(avi_t *AVI, unsigned int rt, int key)
+{
+   avi_tsix_t *t = (avi_tsix_t *)AVI->tsix;
+
+   long2str((unsigned char *)&t->pts[t->n], rt);   /* as it goes into the file */
+   if(key) t->key[t->n/8] |= 1 << (t->n%8);
+   t->n++;
+}
+
+static int avi_add_tsix_chunk(avi_t *AVI)
+{
+   avi_tsix_t *t = (avi_tsix_t *)AVI->tsix;
+   unsigned char c[16];
+   struct iovec iov[3];
+   long nkey = (t->n + 7)/8;
+
+   memcpy(c,"tsix",4);
+   long2str(c+4, 8 + t->n*4 + nkey);
+   long2str(c+8, t->n);
+   long2str(c+12, 0);
+   iov[0].iov_base = c;
+   iov[0].iov_len = 16;
+   iov[1].iov_base = t->pts;
+   iov[1].iov_len = t->n*4;
+   iov[2].iov_base = t->key;
+   iov[2].iov_len = PAD_EVEN(nkey);     /* the bitmap has room for it */
+
+   return avi_write_raw(AVI, iov, 3);
+}
+
+/* Load a 'tsix' chunk that matches video_index, ignore it otherwise */
+
+static void avi_tsix_load(avi_t *AVI, int fd, off_t off, long len)
+{
+   avi_tsix_t *t;
+   unsigned char *b;
+   long i, n;
+
+   b = (unsigned char *)malloc(len);
+   if(b == NULL) return;
+   if(len < 8 || pread(fd, b, len, off) != len ||
+      (n = str2ulong(b)) != AVI->video_frames || 8 + n*4 + (n+7)/8 > len)
+   {
+      free(b);
+      return;
+   }
+
+   t = (avi_tsix_t *)malloc(sizeof(avi_tsix_t));
+   if(t == NULL) { free(b); return; }
+   memset(t, 0, sizeof(avi_tsix_t));
+   t->pts = (u32 *)malloc(n*sizeof(u32));
+   t->keys = (long *)malloc(n*sizeof(long));
+   if(t->pts == NULL || t->keys == NULL)
+   {
+      free(t->pts);
+      free(t->keys);
+      free(t);
+      free(b);
+      return;
+   }
+
+   for(i=0;i<n;i++)
+   {
+      t->pts[i] = str2ulong(b + 8 + i*4);
+      AVI->input->video_index[i].key = (b[8 + n*4 + i/8] >> (i%8)) & 1 ? 0x10 : 0;
+      if(AVI->input->video_index[i].key) t->keys[t->nkeys++] = i;
+   }
+   t->n = n;
+   free(b);
+
+   AVI->tsix = t;
+}
+
+unsigned int AVI_frame_time(avi_t *AVI, long frame)
+{
+   avi_tsix_t *t = (avi_tsix_t *)AVI->tsix;
+
+   if(t == NULL || frame < 0 || frame >= t->n) return 0;
+   return t->pts[frame];
+}
+
+long AVI_seek_time(avi_t *AVI, unsigned int rt)
+{
+   avi_tsix_t *t = (avi_tsix_t *)AVI->tsix;
+   long n0, n1, n;
+
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(t == NULL || t->nkeys == 0) { AVI_errno = AVI_ERR_NO_IDX; return -1; }
+
+   /* last keyframe not after rt, the first one if all are */
+
+   n0 = 0;
+   n1 = t->nkeys;
+
+   while(n0<n1-1)
+   {
+      n = (n0+n1)/2;
+      if(t->pts[t->keys[n]]>rt)
+         n1 = n;
+      else
+         n0 = n;
+   }
+
+   n = t->keys[n0];
+   if(AVI_set_video_position(AVI, n)) return -1;
+   return n;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Group commit                                                 *
+ *                                                                 *
+ *******************************************************************/
+
+/* One thread syncs all recordings registered with AVI_set_durable. Every
+   max_ms/2 it starts the write-back of each file written to since the
+   last pass with sync_file_range() and then waits for them one by one
+   with fdatasync(), so the disks get one batch per pass instead of
+   sync() storms. A waiting ticket starts a pass right away. Queued
+   checkpoints (AVI_set_checkpoint) and files started with
+   AVI_Init_fd_fast are written and synced as soon as the thread wakes
+   up for them, without a pass. */
+
+typedef struct avi_durable_s
+{
+   int    fd;
+   long   dirty_ms;          /* first write since the last pass, 0 if clean */
+   long   want;              /* last ticket handed out */
+   long   done;              /* tickets covered by a finished pass */
+   int    err;               /* fdatasync of the last pass failed */
+   int    busy;              /* in a pass, not to be freed */
+   struct avi_durable_s *next;
+   struct avi_durable_s *pass;   /* files of the current pass */
+} avi_durable_t;
+
+static pthread_mutex_t avi_group_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t avi_group_wake = PTHREAD_COND_INITIALIZER;    /* for the thread */
+static pthread_cond_t avi_group_synced = PTHREAD_COND_INITIALIZER;  /* for the writers */
+static avi_durable_t *avi_group = NULL;
+static avi_ckp_t *avi_group_ckp = NULL;   /* checkpoints to write, by queue */
+static int avi_group_ms = 0;     /* pass interval, 0 before AVI_durable_init */
+
+/* A file started with AVI_Init_fd_fast whose header and directory entry
+   are still to be synced */
+
+typedef struct avi_new_file_s
+{
+   int    fd;                /* dup of the recording's */
+   char  *dir;
+   struct avi_new_file_s *next;
+} avi_new_file_t;
+
+static avi_new_file_t *avi_group_new = NULL;
+
+/* Cut the file name off path, leaving its directory; path needs room
+   for one more byte */
+
+static void avi_dir_of(char *path)
+{
+   char *p = strrchr(path, '/');
+
+   if(p == NULL)
+      strcpy(path, ".");
+   else if(p == path)
+      p[1] = 0;
+   else
+      *p = 0;
+}
+
+/* Make the directory entries of new files in dir durable */
+
+static void avi_sync_dir(const char *dir)
+{
+   int fd;
+
+   fd = open(dir, O_RDONLY | O_DIRECTORY);
+   if(fd >= 0)
+   {
+      fsync(fd);
+      close(fd);
+   }
+}
+
+/* Write the queued checkpoints, called and returns with the lock held */
+
+static void avi_group_ckp_run(void)
+{
+   avi_ckp_t *c, *next;
+   int err;
+
+   while(avi_group_ckp != NULL)
+   {
+      c = avi_group_ckp;
+      avi_group_ckp = NULL;
+      pthread_mutex_unlock(&avi_group_lock);
+
+      for(; c != NULL; c = next)
+      {
+         err = avi_ckp_write(c) != 0;
+         pthread_mutex_lock(&avi_group_lock);
+         next = c->queue;
+         c->err = err;
+         c->busy = 0;          /* c may be freed from now on */
+         pthread_cond_broadcast(&avi_group_synced);
+         pthread_mutex_unlock(&avi_group_lock);
+      }
+
+      pthread_mutex_lock(&avi_group_lock);
+   }
+}
+
+/* Sync the new files, then each of their directories once; called and
+   returns with the lock held */
+
+static void avi_group_new_run(void)
+{
+   avi_new_file_t *s, *f, *g, *next;
+
+   while(avi_group_new != NULL)
+   {
+      s = avi_group_new;
+      avi_group_new = NULL;
+      pthread_mutex_unlock(&avi_group_lock);
+
+#ifdef SYNC_FILE_RANGE_WRITE
+      for(f = s; f != NULL; f = f->next)
+         sync_file_range(f->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+      for(f = s; f != NULL; f = f->next)
+         if(fdatasync(f->fd) != 0)
+            printf("avi sync of a new file in %s failed\n", f->dir);
+      for(f = s; f != NULL; f = f->next)
+      {
+         for(g = s; g != f && strcmp(g->dir, f->dir) != 0; g = g->next);
+         if(g == f) avi_sync_dir(f->dir);
+      }
+      for(f = s; f != NULL; f = next)
+      {
+         next = f->next;
+         close(f->fd);
+         free(f);
+      }
+
+      pthread_mutex_lock(&avi_group_lock);
+   }
+}
+
+static void avi_group_deadline(struct timespec *ts)
+{
+   clock_gettime(CLOCK_REALTIME, ts);
+   ts->tv_sec  += avi_group_ms/1000;
+   ts->tv_nsec += (avi_group_ms%1000)*1000000L;
+   if(ts->tv_nsec >= 1000000000L)
+   {
+      ts->tv_sec++;
+      ts->tv_nsec -= 1000000000L;
+   }
+}
+
+static void *avi_group_thread(void *arg)
+{
+   avi_durable_t *d, *pass, *next;
+   struct timespec ts;
+   long want;
+   int urgent, err;
+
+   (void)arg;
+   pthread_mutex_lock(&avi_group_lock);
+   avi_group_deadline(&ts);
+   while(1)
+   {
+      /* checkpoints and new files are written when queued, without
+         starting a pass */
+      while(avi_group_ckp != NULL || avi_group_new != NULL)
+      {
+         avi_group_ckp_run();
+         avi_group_new_run();
+      }
+
+      urgent = 0;
+      for(d = avi_group; d != NULL; d = d->next)
+         if(d->want > d->done) urgent = 1;
+      if(!urgent && pthread_cond_timedwait(&avi_group_wake, &avi_group_lock, &ts) != ETIMEDOUT)
+         continue;
+
+      /* take the dirty files, writers mark them again from now on */
+      pass = NULL;
+      for(d = avi_group; d != NULL; d = d->next)
+      {
+         if(__atomic_exchange_n(&d->dirty_ms, 0, __ATOMIC_ACQ_REL) == 0 && d->want == d->done)
+            continue;
+         d->busy = 1;
+         d->pass = pass;
+         pass = d;
+      }
+      pthread_mutex_unlock(&avi_group_lock);
+
+#ifdef SYNC_FILE_RANGE_WRITE
+      for(d = pass; d != NULL; d = d->pass)
+         sync_file_range(d->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+
+      for(d = pass; d != NULL; d = next)
+      {
+         pthread_mutex_lock(&avi_group_lock);
+         want = d->want;
+         pthread_mutex_unlock(&avi_group_lock);
+         err = fdatasync(d->fd) != 0;
+         pthread_mutex_lock(&avi_group_lock);
+         next = d->pass;
+         d->err = err;
+         d->done = want;
+         d->busy = 0;          /* d may be freed from now on */
+         pthread_cond_broadcast(&avi_group_synced);
+         pthread_mutex_unlock(&avi_group_lock);
+      }
+
+      pthread_mutex_lock(&avi_group_lock);
+      avi_group_deadline(&ts);
+   }
+
+   return NULL;
+}
+
+int AVI_durable_init(int max_ms)
+{
+   pthread_t thread;
+   int ret = 0;
+
+   pthread_mutex_lock(&avi_group_lock);
+   if(avi_group_ms == 0)
+   {
+      if(max_ms <= 0) max_ms = AVI_DURABLE_MS;
+      avi_group_ms = max_ms/2 > 0 ? max_ms/2 : 1;
+      if(pthread_create(&thread, NULL, avi_group_thread, NULL) == 0)
+         pthread_detach(thread);
+      else
+      {
+         avi_group_ms = 0;
+         ret = -1;
+      }
+   }
+   pthread_mutex_unlock(&avi_group_lock);
+
+   return ret;
+}
+
+int AVI_set_durable(avi_t *AVI)
+{
+   avi_durable_t *d;
+
+   if(AVI->fdes < 0 || AVI->buf != NULL || AVI->durable != NULL) return -1;
+   if(AVI_durable_init(0)) return -1;
+
+   d = (avi_durable_t *)malloc(sizeof(avi_durable_t));
+   if(d == NULL) return -1;
+   memset(d, 0, sizeof(avi_durable_t));
+   d->fd = AVI->fdes;
+
+   pthread_mutex_lock(&avi_group_lock);
+   d->next = avi_group;
+   avi_group = d;
+   pthread_mutex_unlock(&avi_group_lock);
+   AVI->durable = d;
+
+   return 0;
+}
+
+/* After a chunk went to the file, or to the writer */
+
+static void avi_durable_note(avi_t *AVI)
+{
+   avi_durable_t *d = (avi_durable_t *)AVI->durable;
+   long zero = 0;
+
+   if(__atomic_load_n(&d->dirty_ms, __ATOMIC_RELAXED) == 0)
+      __atomic_compare_exchange_n(&d->dirty_ms, &zero, avi_now_ms(), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+long AVI_durable_ticket(avi_t *AVI)
+{
+   avi_durable_t *d = (avi_durable_t *)AVI->durable;
+   long ticket;
+
+   if(d == NULL) return -1;
+   if(AVI_flush(AVI)) return -1;
+
+   pthread_mutex_lock(&avi_group_lock);
+   ticket = ++d->want;
+   pthread_cond_signal(&avi_group_wake);
+   pthread_mutex_unlock(&avi_group_lock);
+
+   return ticket;
+}
+
+int AVI_durable_wait(avi_t *AVI, long ticket)
+{
+   avi_durable_t *d = (avi_durable_t *)AVI->durable;
+   int ret;
+
+   if(d == NULL || ticket <= 0) return -1;
+
+   pthread_mutex_lock(&avi_group_lock);
+   while(d->done < ticket)
+      pthread_cond_wait(&avi_group_synced, &avi_group_lock);
+   ret = d->err ? -1 : 0;
+   pthread_mutex_unlock(&avi_group_lock);
+
+   return ret;
+}
+
+/* Queue the syncs of a new file, -1 if there is no thread for them */
+
+static int avi_group_new_file(int fd, const char *file_name)
+{
+   avi_new_file_t *f;
+
+   if(AVI_durable_init(0)) return -1;
+
+   f = (avi_new_file_t *)malloc(sizeof(avi_new_file_t) + strlen(file_name) + 2);
+   if(f == NULL) return -1;
+   f->dir = (char *)(f + 1);
+   strcpy(f->dir, file_name);
+   avi_dir_of(f->dir);
+   f->fd = dup(fd);
+   if(f->fd < 0)
+   {
+      free(f);
+      return -1;
+   }
+
+   pthread_mutex_lock(&avi_group_lock);
+   f->next = avi_group_new;
+   avi_group_new = f;
+   pthread_cond_signal(&avi_group_wake);
+   pthread_mutex_unlock(&avi_group_lock);
+
+   return 0;
+}
+
+/* 1 while the last checkpoint is queued or written, otherwise -1 if it
+   failed and 0 */
+
+static int avi_ckp_pending(avi_ckp_t *c)
+{
+   int ret;
+
+   pthread_mutex_lock(&avi_group_lock);
+   ret = c->busy ? 1 : -c->err;
+   if(!c->busy) c->err = 0;
+   pthread_mutex_unlock(&avi_group_lock);
+
+   return ret;
+}
+
+static void avi_ckp_post(avi_ckp_t *c)
+{
+   pthread_mutex_lock(&avi_group_lock);
+   c->busy = 1;
+   c->queue = avi_group_ckp;
+   avi_group_ckp = c;
+   pthread_cond_signal(&avi_group_wake);
+   pthread_mutex_unlock(&avi_group_lock);
+}
+
+/* Before the final header is written */
+
+static void avi_ckp_wait(avi_t *AVI)
+{
+   avi_ckp_t *c = (avi_ckp_t *)AVI->ckp;
+
+   if(c == NULL) return;
+   pthread_mutex_lock(&avi_group_lock);
+   while(c->busy)
+      pthread_cond_wait(&avi_group_synced, &avi_group_lock);
+   pthread_mutex_unlock(&avi_group_lock);
+}
+
+/* Before the file is closed */
+
+static void avi_durable_free(avi_t *AVI)
+{
+   avi_durable_t *d = (avi_durable_t *)AVI->durable;
+   avi_durable_t **p;
+
+   if(d == NULL) return;
+
+   pthread_mutex_lock(&avi_group_lock);
+   while(d->busy)
+      pthread_cond_wait(&avi_group_synced, &avi_group_lock);
+   for(p = &avi_group; *p != NULL; p = &(*p)->next)
+   {
+      if(*p == d)
+      {
+         *p = d->next;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&avi_group_lock);
+
+   free(d);
+   AVI->durable = NULL;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Audio tracks                                                 *
+ *                                                                 *
+ *******************************************************************/
+
+/* Track 0 is the audio of AVI_set_audio and AVI_write_audio, track n
+   of AVI_set_audio_track is described by AVI->track[n] and written as
+   stream n+1. AVI->anum stays 0 until a second track is set, then the
+   header lists every track so the stream numbers match the tags. */
+
+/* The tracks are only allocated for files that use them, so a recorder
+   of one audio track does not carry AVI_MAX_TRACKS of them */
+
+static track_t *avi_tracks(avi_t *AVI)
+{
+   if(AVI->track == NULL)
+      AVI->track = (track_t *)calloc(AVI_MAX_TRACKS, sizeof(track_t));
+   return AVI->track;
+}
+
+static void avi_tracks_free(avi_t *AVI)
+{
+   free(AVI->track);
+   AVI->track = NULL;
+}
+
+static int avi_track_sampsize(track_t *t)
+{
+   int s;
+   s = ((t->a_bits+7)/8)*t->a_chans;
+   if(s==0) s=1; /* avoid possible zero divisions */
+   return s;
+}
+
+static long avi_streams(avi_t *AVI)
+{
+   if(AVI->anum > 1) return 1 + AVI->anum;
+   return AVI->audio_bytes ? 2 : 1;
+}
+
+/* The stream list of one audio track */
+
+static long avi_out_audio_strl(avi_t *AVI, unsigned char *AVI_header, long nhb, int track)
+{
+   long fmt, chans, rate, bits, sampsize, strl_start;
+   off_t bytes;
+
+   if(track == 0)
+   {
+      fmt   = AVI->a_fmt;
+      chans = AVI->a_chans;
+      rate  = AVI->a_rate;
+      bits  = AVI->a_bits;
+      bytes = AVI->audio_bytes;
+      sampsize = avi_sampsize(AVI);
+   }
+   else
+   {
+      fmt   = AVI->track[track].a_fmt;
+      chans = AVI->track[track].a_chans;
+      rate  = AVI->track[track].a_rate;
+      bits  = AVI->track[track].a_bits;
+      bytes = AVI->track[track].audio_bytes;
+      sampsize = avi_track_sampsize(&AVI->track[track]);
+   }
+
+   /* Start the audio stream list ---------------------------------- */
+
+   OUT4CC ("LIST");
+   OUTLONG(0);        /* Length of list in bytes, don't know yet */
+   strl_start = nhb;  /* Store start position */
+   OUT4CC ("strl");
+
+   /* The audio stream header */
+
+   OUT4CC ("strh");
+   OUTLONG(64);            /* # of bytes to follow */
+   OUT4CC ("auds");
+   OUT4CC ("\0\0\0\0");
+   OUTLONG(0);             /* Flags */
+   OUTLONG(0);             /* Reserved, MS says: wPriority, wLanguage */
+   OUTLONG(0);             /* InitialFrames */
+   OUTLONG(sampsize);      /* Scale */
+   OUTLONG(sampsize*rate); /* Rate: Rate/Scale == samples/second */
+   OUTLONG(0);             /* Start */
+   OUTLONG(bytes/sampsize);   /* Length */
+   OUTLONG(0);             /* SuggestedBufferSize */
+   OUTLONG(-1);            /* Quality */
+   OUTLONG(sampsize);      /* SampleSize */
+   OUTLONG(0);             /* Frame */
+   OUTLONG(0);             /* Frame */
+   OUTLONG(0);             /* Frame */
+   OUTLONG(0);             /* Frame */
+
+   /* The audio stream format */
+
+   OUT4CC ("strf");
+   OUTLONG(16);                   /* # of bytes to follow */
+   OUTSHRT(fmt);                  /* Format */
+   OUTSHRT(chans);                /* Number of channels */
+   OUTLONG(rate);                 /* SamplesPerSec */
+   OUTLONG(sampsize*rate);        /* AvgBytesPerSec */
+   OUTSHRT(sampsize);             /* BlockAlign */
+   OUTSHRT(bits);                 /* BitsPerSample */
+
+   /* Finish stream list, i.e. put number of bytes in the list to proper pos */
+
+   if(track == 0) nhb = avi_odml_indx(AVI, AVI_header, nhb, 1);
+
+   long2str(AVI_header+strl_start-4,nhb-strl_start);
+
+   return nhb;
+}
+
+/* All audio stream lists; always lists track 0 even before any audio
+   was written, as AVI_init_file_header does */
+
+static long avi_out_audio(avi_t *AVI, unsigned char *AVI_header, long nhb, int always)
+{
+   int track;
+
+   if(AVI->a_chans && (always || AVI->audio_bytes || AVI->anum > 1))
+      nhb = avi_out_audio_strl(AVI, AVI_header, nhb, 0);
+   for(track = 1; track < AVI->anum; track++)
+      nhb = avi_out_audio_strl(AVI, AVI_header, nhb, track);
+
+   return nhb;
+}
+
+int AVI_set_audio_track(avi_t *AVI, int track, int channels, int rate, int bits, int format)
+{
+   track_t *t;
+
+   if(track == 0)
+   {
+      AVI_set_audio(AVI, channels, rate, bits, format);
+      return 0;
+   }
+
+   if(track < 0 || track >= AVI_MAX_TRACKS) return -1;
+   if(track > AVI->anum && !(track == 1 && AVI->anum == 0)) return -1;   /* in order */
+   if(AVI->a_chans == 0 || channels <= 0) return -1;
+   if(AVI->odml != NULL || AVI->ckp != NULL) return -1;
+   if(AVI->n_idx > 0) return -1;                  /* before the first chunk */
+   if(avi_tracks(AVI) == NULL) return -1;
+
+   t = &AVI->track[track];
+   memset(t, 0, sizeof(track_t));
+   t->a_chans = channels;
+   t->a_rate  = rate;
+   t->a_bits  = bits;
+   t->a_fmt   = format;
+   t->audio_strn = track + 1;
+   t->audio_tag[0] = t->audio_strn/10 + '0';
+   t->audio_tag[1] = t->audio_strn%10 + '0';
+   t->audio_tag[2] = 'w';
+   t->audio_tag[3] = 'b';
+   if(AVI->anum <= track) AVI->anum = track + 1;
+
+   return 0;
+}
 
 /*
   Write the header of an AVI file and close it.
@@ -316,10 +3327,15 @@ void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
  int AVI_output_file_fd(avi_t *AVI)
 {
 
-   int ret, njunk, sampsize, hasIndex,  idxerror;
+   int ret, njunk, hasIndex,  idxerror;
    int movi_len, hdrl_start, strl_start;
    unsigned char AVI_header[HEADERBYTES];
    long nhb;
+   off_t riff_end;
+   long riff_frames;
+
+   /* a checkpoint must not overwrite the final header */
+   avi_ckp_wait(AVI);
 
    /* Calculate accurate fps */
     if((AVI->et) > (AVI->bt))
@@ -336,8 +3352,14 @@ void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
       readable in the most cases */
 
   idxerror = 0;
-  ret = avi_add_chunk_fd(AVI,(unsigned char *)"idx1",
-  					(unsigned char *)AVI->idx,(int)AVI->n_idx*16);
+  ret = AVI->odml ? avi_odml_finish(AVI) : avi_add_index_chunk(AVI);
+  if(ret == 0 && AVI->tsix) ret = avi_add_tsix_chunk(AVI);
+  if(AVI_flush(AVI)) ret = -1;
+
+  /* an OpenDML header describes the first RIFF */
+  riff_end = AVI->pos;
+  riff_frames = AVI->video_frames;
+  avi_odml_first_riff(AVI, &riff_end, &movi_len, &riff_frames);
 
    hasIndex = (ret==0);
    if(ret)
@@ -352,7 +3374,7 @@ void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
    /* The RIFF header */
 
    OUT4CC ("RIFF");
-   OUTLONG(AVI->pos - 8);    /* # of bytes to follow */
+   OUTLONG(riff_end - 8);    /* # of bytes to follow */
    OUT4CC ("AVI ");
 
    /* Start the header list */
@@ -374,12 +3396,9 @@ void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
                                 /* Other sources call it 'reserved' */
 
    OUTLONG(2064);               /* Flags */
-   OUTLONG(AVI->video_frames);  /* TotalFrames */
+   OUTLONG(riff_frames);        /* TotalFrames */
    OUTLONG(0);                  /* InitialFrames */
-   if (AVI->audio_bytes)
-      { OUTLONG(2); }           /* Streams */
-   else
-      { OUTLONG(1); }           /* Streams */
+   OUTLONG(avi_streams(AVI));   /* Streams */
    OUTLONG(AVI->dwSuggestedBufferSize);                  /* SuggestedBufferSize */
    OUTLONG(AVI->width);         /* Width */
    OUTLONG(AVI->height);        /* Height */
@@ -436,57 +3455,13 @@ void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
 
    /* Finish stream list, i.e. put number of bytes in the list to proper pos */
 
-   long2str(AVI_header+strl_start-4,nhb-strl_start);
-
-   if (AVI->a_chans && AVI->audio_bytes)
-   {
-
-   sampsize = avi_sampsize(AVI);
-
-   /* Start the audio stream list ---------------------------------- */
-
-   OUT4CC ("LIST");
-   OUTLONG(0);        /* Length of list in bytes, don't know yet */
-   strl_start = nhb;  /* Store start position */
-   OUT4CC ("strl");
-
-   /* The audio stream header */
-
-   OUT4CC ("strh");
-   OUTLONG(64);            /* # of bytes to follow */
-   OUT4CC ("auds");
-   OUT4CC ("\0\0\0\0");
-   OUTLONG(0);             /* Flags */
-   OUTLONG(0);             /* Reserved, MS says: wPriority, wLanguage */
-   OUTLONG(0);             /* InitialFrames */
-   OUTLONG(sampsize);      /* Scale */
-   OUTLONG(sampsize*AVI->a_rate); /* Rate: Rate/Scale == samples/second */
-   OUTLONG(0);             /* Start */
-   OUTLONG(AVI->audio_bytes/sampsize);   /* Length */
-   OUTLONG(0);             /* SuggestedBufferSize */
-   OUTLONG(-1);            /* Quality */
-   OUTLONG(sampsize);      /* SampleSize */
-   OUTLONG(0);             /* Frame */
-   OUTLONG(0);             /* Frame */
-   OUTLONG(0);             /* Frame */
-   OUTLONG(0);             /* Frame */
-
-   /* The audio stream format */
-
-   OUT4CC ("strf");
-   OUTLONG(16);                   /* # of bytes to follow */
-   OUTSHRT(AVI->a_fmt);           /* Format */
-   OUTSHRT(AVI->a_chans);         /* Number of channels */
-   OUTLONG(AVI->a_rate);          /* SamplesPerSec */
-   OUTLONG(sampsize*AVI->a_rate); /* AvgBytesPerSec */
-   OUTSHRT(sampsize);             /* BlockAlign */
-   OUTSHRT(AVI->a_bits);          /* BitsPerSample */
-
-   /* Finish stream list, i.e. put number of bytes in the list to proper pos */
+   nhb = avi_odml_indx(AVI, AVI_header, nhb, 0);
 
    long2str(AVI_header+strl_start-4,nhb-strl_start);
 
-   }
+   nhb = avi_out_audio(AVI, AVI_header, nhb, 0);
+
+   nhb = avi_odml_dmlh(AVI, AVI_header, nhb);
 
    /* Finish header list */
 
@@ -545,7 +3520,7 @@ void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
  int AVI_output_file(avi_t *AVI)
 {
 
-   int ret, njunk, sampsize, hasIndex,  idxerror;
+   int ret, njunk, hasIndex,  idxerror;
    int movi_len, hdrl_start, strl_start;
    unsigned char AVI_header[HEADERBYTES];
    long nhb;
@@ -560,7 +3535,7 @@ void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
       readable in the most cases */
 
   idxerror = 0;
-  ret = avi_add_chunk(AVI,(unsigned char *)"idx1",(void*)AVI->idx,AVI->n_idx*16);
+  ret = avi_add_index_chunk(AVI);
 
    hasIndex = (ret==0);
    if(ret)
@@ -600,10 +3575,7 @@ void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
    OUTLONG(2064);               /* Flags */
    OUTLONG(AVI->video_frames);  /* TotalFrames */
    OUTLONG(0);                  /* InitialFrames */
-   if (AVI->audio_bytes)
-      { OUTLONG(2); }           /* Streams */
-   else
-      { OUTLONG(1); }           /* Streams */
+   OUTLONG(avi_streams(AVI));   /* Streams */
    OUTLONG(AVI->dwSuggestedBufferSize);                  /* SuggestedBufferSize */
    OUTLONG(AVI->width);         /* Width */
    OUTLONG(AVI->height);        /* Height */
@@ -662,55 +3634,7 @@ void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
 
    long2str(AVI_header+strl_start-4,nhb-strl_start);
 
-   if (AVI->a_chans && AVI->audio_bytes)
-   {
-
-   sampsize = avi_sampsize(AVI);
-
-   /* Start the audio stream list ---------------------------------- */
-
-   OUT4CC ("LIST");
-   OUTLONG(0);        /* Length of list in bytes, don't know yet */
-   strl_start = nhb;  /* Store start position */
-   OUT4CC ("strl");
-
-   /* The audio stream header */
-
-   OUT4CC ("strh");
-   OUTLONG(64);            /* # of bytes to follow */
-   OUT4CC ("auds");
-   OUT4CC ("\0\0\0\0");
-   OUTLONG(0);             /* Flags */
-   OUTLONG(0);             /* Reserved, MS says: wPriority, wLanguage */
-   OUTLONG(0);             /* InitialFrames */
-   OUTLONG(sampsize);      /* Scale */
-   OUTLONG(sampsize*AVI->a_rate); /* Rate: Rate/Scale == samples/second */
-   OUTLONG(0);             /* Start */
-   OUTLONG(AVI->audio_bytes/sampsize);   /* Length */
-   OUTLONG(0);             /* SuggestedBufferSize */
-   OUTLONG(-1);            /* Quality */
-   OUTLONG(sampsize);      /* SampleSize */
-   OUTLONG(0);             /* Frame */
-   OUTLONG(0);             /* Frame */
-   OUTLONG(0);             /* Frame */
-   OUTLONG(0);             /* Frame */
-
-   /* The audio stream format */
-
-   OUT4CC ("strf");
-   OUTLONG(16);                   /* # of bytes to follow */
-   OUTSHRT(AVI->a_fmt);           /* Format */
-   OUTSHRT(AVI->a_chans);         /* Number of channels */
-   OUTLONG(AVI->a_rate);          /* SamplesPerSec */
-   OUTLONG(sampsize*AVI->a_rate); /* AvgBytesPerSec */
-   OUTSHRT(sampsize);             /* BlockAlign */
-   OUTSHRT(AVI->a_bits);          /* BitsPerSample */
-
-   /* Finish stream list, i.e. put number of bytes in the list to proper pos */
-
-   long2str(AVI_header+strl_start-4,nhb-strl_start);
-
-   }
+   nhb = avi_out_audio(AVI, AVI_header, nhb, 0);
 
    /* Finish header list */
 
@@ -764,24 +3688,45 @@ void AVI_set_audio(avi_t *AVI, int channels, int rate, int bits, int format)
 
 */
 
+/* audio is 0 for video, track+1 for audio */
+
 static int avi_write_data(avi_t *AVI, unsigned char *data, long length, int audio)
 {
+   unsigned char tag[4];
    int n;
 
    /* Check for maximum file length */
 
-   if ( (AVI->pos + 8 + length + 8 + (AVI->n_idx+1)*16) > AVI->buf_len )
+   if(AVI->odml)
+   {
+      if(avi_odml_reserve(AVI, 8 + PAD_EVEN(length)))
+         return -1;
+   }
+   else if ( (AVI->pos + 8 + length + 8 + (AVI->n_idx+1)*16) > AVI->buf_len )
    {
       printf("avifile had beyond buf_len %d\n",AVI->buf_len);
       return -1;
    }
 
+   if(avi_writer_reserve(AVI, 8 + PAD_EVEN(length)))
+   {
+      return -1;
+   }
+   avi_writer_mark(AVI);
+
    /* Add index entry */
 
    if(audio)
-      n = avi_add_index_entry(AVI,(u8 *)"01wb",0x00,AVI->pos,length);
+   {
+      memcpy(tag, "01wb", 4);
+      tag[1] = '0' + audio;
+      n = avi_add_index_entry(AVI,tag,0x00,AVI->pos - avi_odml_base(AVI),length);
+   }
    else
-      n = avi_add_index_entry(AVI,(u8 *)"00dc",0x10,AVI->pos,length);
+   {
+      memcpy(tag, "00dc", 4);
+      n = avi_add_index_entry(AVI,tag,0x10,AVI->pos - avi_odml_base(AVI),length);
+   }
 
    if(n)
    {
@@ -790,21 +3735,13 @@ static int avi_write_data(avi_t *AVI, unsigned char *data, long length, int audi
 
    /* Output tag and data */
 
-   if((1 == audio)&&(NULL != AVI->buf))
-	{
-      n = avi_add_chunk(AVI,(u8 *)"01wb",data,length);
-	}
-   else if((1 == audio)&&(AVI->fdes > 1))
-	{
-      n = avi_add_chunk_fd(AVI,(u8 *)"01wb",data,length);
-	}
-   else if((0 == audio)&&(NULL != AVI->buf))
+   if(NULL != AVI->buf)
 	{
-	   n = avi_add_chunk(AVI,(u8 *)"00dc",data,length);
+      n = avi_add_chunk(AVI,tag,data,length);
 	}
-   else if((0 == audio)&&(AVI->fdes > 1))
+   else if(AVI->fdes > 1)
 	{
-	   n = avi_add_chunk_fd(AVI,(u8 *)"00dc",data,length);
+      n = avi_add_chunk_fd(AVI,tag,data,length);
 	}
 
    if(n)
@@ -817,13 +3754,20 @@ static int avi_write_data(avi_t *AVI, unsigned char *data, long length, int audi
 
 int AVI_write_frame(avi_t *AVI, unsigned char *data, int bytes, unsigned int rt)
 {
-	long pos;
+	off_t pos;
+
+	if(AVI->tsix && avi_tsix_reserve(AVI))
+	{
+	   AVI_errno = AVI_ERR_NO_MEM;
+	   return -1;
+	}
 
 	pos = AVI->pos;
 	if(avi_write_data(AVI,data,bytes,0) != 1) 
 	{
 	   return -1;
 	}
+	if(AVI->tsix) avi_tsix_add(AVI, rt, AVI_frame_is_key(AVI, data, bytes));
 
 	AVI->last_pos = pos;
 	AVI->last_len = bytes;
@@ -834,6 +3778,9 @@ int AVI_write_frame(avi_t *AVI, unsigned char *data, int bytes, unsigned int rt)
 		 AVI->bt = rt;
 	AVI->et = rt;
 
+	if(AVI->ckp) avi_ckp_tick(AVI);
+	if(AVI->durable) avi_durable_note(AVI);
+
    return 0;
 }
 
@@ -847,6 +3794,27 @@ int AVI_write_audio(avi_t *AVI, unsigned char *data, int bytes, unsigned int rt)
    AVI->audio_bytes += bytes;
    AVI->et = rt;
 
+   if(AVI->ckp) avi_ckp_tick(AVI);
+   if(AVI->durable) avi_durable_note(AVI);
+
+   return 0;
+}
+
+int AVI_write_audio_track(avi_t *AVI, int track, unsigned char *data, int bytes, unsigned int rt)
+{
+   if(track == 0) return AVI_write_audio(AVI, data, bytes, rt);
+   if(track < 0 || track >= AVI->anum) return -1;
+
+   if( avi_write_data(AVI,data,bytes,track+1) != 1)
+   {
+	   return -1;
+   }
+   AVI->track[track].audio_bytes += bytes;
+   AVI->track[track].audio_chunks++;
+   AVI->et = rt;
+
+   if(AVI->durable) avi_durable_note(AVI);
+
    return 0;
 }
 
@@ -860,6 +3828,8 @@ int AVI_close(avi_t *AVI)
 		free(AVI->idxPtr);
 		AVI->idxPtr = NULL;
 	}
+   avi_idx_free(AVI);
+   avi_tracks_free(AVI);
     
 	//dbg(Dbg, DbgNoPerror, "free buf\n");
    /* ͷռ */
@@ -876,7 +3846,12 @@ int AVI_close_fd(avi_t *AVI)
 	if(AVI->fdes >0)
 	{
 		 /* AVIͷ */
-		 AVI_output_file_fd(AVI);
+		 avi_ckp_free(AVI, AVI_output_file_fd(AVI) == 0);
+		 avi_durable_free(AVI);
+		 avi_tsix_free(AVI);
+		 avi_writer_free(AVI);
+		 free(AVI->odml);
+		 AVI->odml = NULL;
 		 /* д */
 		 //avi_add_chunk_fd(AVI,"idx1",(void*)AVI->idx,AVI->n_idx*16);
 		 /* رAVIļ */
@@ -885,21 +3860,23 @@ int AVI_close_fd(avi_t *AVI)
 	}
 
 	/* ͷռ */
-	if(NULL != AVI->idx)
-	{
-		free(AVI->idx);
-		AVI->idx= NULL;
-	}
+	avi_idx_free(AVI);
+	avi_tracks_free(AVI);
 
 	return(0);
 }
 
 int AVI_output_file_fd_1(avi_t *AVI)
 {
-   int ret, njunk, sampsize, hasIndex,  idxerror;
+   int ret, njunk, hasIndex,  idxerror;
    int movi_len, hdrl_start, strl_start;
    unsigned char AVI_header[HEADERBYTES];
    long nhb;
+   off_t riff_end;
+   long riff_frames;
+
+   /* a checkpoint must not overwrite the final header */
+   avi_ckp_wait(AVI);
 
    /* Calculate accurate fps */
    
@@ -921,7 +3898,14 @@ int AVI_output_file_fd_1(avi_t *AVI)
 
   idxerror = 0;
 
-  ret = avi_add_chunk_fd(AVI,(unsigned char *)"idx1",(unsigned char *)AVI->idx,AVI->n_idx*16);
+  ret = AVI->odml ? avi_odml_finish(AVI) : avi_add_index_chunk(AVI);
+  if(ret == 0 && AVI->tsix) ret = avi_add_tsix_chunk(AVI);
+  if(AVI_flush(AVI)) ret = -1;
+
+  /* an OpenDML header describes the first RIFF */
+  riff_end = AVI->pos;
+  riff_frames = AVI->video_frames;
+  avi_odml_first_riff(AVI, &riff_end, &movi_len, &riff_frames);
    hasIndex = (ret==0);
    if(ret)
    {
@@ -936,7 +3920,7 @@ int AVI_output_file_fd_1(avi_t *AVI)
    /* The RIFF header */
 
    OUT4CC ("RIFF");
-   OUTLONG(AVI->pos - 8);    /* # of bytes to follow */
+   OUTLONG(riff_end - 8);    /* # of bytes to follow */
    OUT4CC ("AVI ");
 
    /* Start the header list */
@@ -958,12 +3942,9 @@ int AVI_output_file_fd_1(avi_t *AVI)
                                 /* Other sources call it 'reserved' */
 
    OUTLONG(2064);               /* Flags */
-   OUTLONG(AVI->video_frames);  /* TotalFrames */
+   OUTLONG(riff_frames);        /* TotalFrames */
    OUTLONG(0);                  /* InitialFrames */
-   if (AVI->audio_bytes)
-      { OUTLONG(2); }           /* Streams */
-   else
-      { OUTLONG(1); }           /* Streams */
+   OUTLONG(avi_streams(AVI));   /* Streams */
    OUTLONG(AVI->dwSuggestedBufferSize);                  /* SuggestedBufferSize */
    OUTLONG(AVI->width);         /* Width */
    OUTLONG(AVI->height);        /* Height */
@@ -1018,55 +3999,13 @@ int AVI_output_file_fd_1(avi_t *AVI)
 
    /* Finish stream list, i.e. put number of bytes in the list to proper pos */
 
-   long2str(AVI_header+strl_start-4,nhb-strl_start);
-
-   if (AVI->a_chans && AVI->audio_bytes)
-   {
-
-   sampsize = avi_sampsize(AVI);
-
-   /* Start the audio stream list ---------------------------------- */
-
-   OUT4CC ("LIST");
-   OUTLONG(0);        /* Length of list in bytes, don't know yet */
-   strl_start = nhb;  /* Store start position */
-   OUT4CC ("strl");
-
-   /* The audio stream header */
-
-   OUT4CC ("strh");
-   OUTLONG(64);            /* # of bytes to follow */
-   OUT4CC ("auds");
-   OUT4CC ("\0\0\0\0");
-   OUTLONG(0);             /* Flags */
-   OUTLONG(0);             /* Reserved, MS says: wPriority, wLanguage */
-   OUTLONG(0);             /* InitialFrames */
-   OUTLONG(sampsize);      /* Scale */
-   OUTLONG(sampsize*AVI->a_rate); /* Rate: Rate/Scale == samples/second */
-   OUTLONG(0);             /* Start */
-   OUTLONG(AVI->audio_bytes/sampsize);   /* Length */
-   OUTLONG(0);             /* SuggestedBufferSize */
-   OUTLONG(-1);            /* Quality */
-   OUTLONG(sampsize);      /* SampleSize */
-   OUTLONG(0);             /* Frame */
-   OUTLONG(0);             /* Frame */
-   OUTLONG(0);             /* Frame */
-   OUTLONG(0);             /* Frame */
-   /* The audio stream format */
-
-   OUT4CC ("strf");
-   OUTLONG(16);                   /* # of bytes to follow */
-   OUTSHRT(AVI->a_fmt);           /* Format */
-   OUTSHRT(AVI->a_chans);         /* Number of channels */
-   OUTLONG(AVI->a_rate);          /* SamplesPerSec */
-   OUTLONG(sampsize*AVI->a_rate); /* AvgBytesPerSec */
-   OUTSHRT(sampsize);             /* BlockAlign */
-   OUTSHRT(AVI->a_bits);          /* BitsPerSample */
-   /* Finish stream list, i.e. put number of bytes in the list to proper pos */
+   nhb = avi_odml_indx(AVI, AVI_header, nhb, 0);
 
    long2str(AVI_header+strl_start-4,nhb-strl_start);
 
-   }
+   nhb = avi_out_audio(AVI, AVI_header, nhb, 0);
+
+   nhb = avi_odml_dmlh(AVI, AVI_header, nhb);
 
    /* Finish header list */
 
@@ -1121,6 +4060,12 @@ int AVI_close_fd_1(avi_t *AVI)
 	{
 		 /* AVIͷ */
 		 ret = AVI_output_file_fd_1(AVI);
+		 avi_ckp_free(AVI, ret == 0);
+		 avi_durable_free(AVI);
+		 avi_tsix_free(AVI);
+		 avi_writer_free(AVI);
+		 free(AVI->odml);
+		 AVI->odml = NULL;
 		 /* д */
 		 //avi_add_chunk_fd(AVI,"idx1",(void*)AVI->idx,AVI->n_idx*16);
 		 /* رAVIļ */
@@ -1130,11 +4075,8 @@ int AVI_close_fd_1(avi_t *AVI)
 	else if(AVI->fdes <0)
 		ret = -1;
 	/* ͷռ */
-	if(NULL != AVI->idx)
-	{
-		free(AVI->idx);
-		AVI->idx = NULL;
-	}
+	avi_idx_free(AVI);
+	avi_tracks_free(AVI);
 
 	return ret;
 }
@@ -1335,8 +4277,9 @@ int avi_get_av_info_by_file_head(avi_t *AVI)
            			lasttag = 1; /* vids */
 				continue;
 			}
-			else if (strncasecmp ((char *)hdrl_data+i,"auds",4) ==0 && ! auds_strh_seen)
+			else if (strncasecmp ((char *)hdrl_data+i,"auds",4) ==0)
 			{
+				/* every track of AVI_set_audio_track, track n is stream n+1 */
 				AVI->aptr=AVI->anum;
 				++AVI->anum;
 				if(AVI->anum > AVI_MAX_TRACKS) {
@@ -1344,6 +4287,8 @@ int avi_get_av_info_by_file_head(avi_t *AVI)
 					//return(-1);
 					goto __exit_get_avi_head_info;
 				}
+				if(avi_tracks(AVI) == NULL)
+					goto __exit_get_avi_head_info;
 				audio_bytes = str2ulong(hdrl_data+i+32);
 				AVI->track[AVI->aptr].audio_strn = num_stream;
 				// if samplesize==0 -> vbr
@@ -1431,11 +4376,12 @@ int avi_get_av_info_by_file_head(avi_t *AVI)
 				AVI->track[AVI->aptr].mp3rate = 8*str2ulong(hdrl_data+i+8)/1000;
 				AVI->track[AVI->aptr].a_bits  = str2ushort(hdrl_data+i+14);
 				auds_strf_seen = 1;
-				AVI->track[AVI->aptr].audio_bytes = audio_bytes*avi_sampsize(AVI);
+				AVI->track[AVI->aptr].audio_bytes = audio_bytes*avi_track_sampsize(&AVI->track[AVI->aptr]);
 				//printf("The aptr is %d ,audio byte is %u\n",AVI->aptr,AVI->track[AVI->aptr].audio_bytes);
-				AVI_set_audio(AVI,AVI->track[AVI->aptr].a_chans,
-					AVI->track[AVI->aptr].a_rate,AVI->track[AVI->aptr].a_bits,
-					AVI->track[AVI->aptr].a_fmt);
+				if(AVI->aptr == 0)
+					AVI_set_audio(AVI,AVI->track[AVI->aptr].a_chans,
+						AVI->track[AVI->aptr].a_rate,AVI->track[AVI->aptr].a_bits,
+						AVI->track[AVI->aptr].a_fmt);
 			}
       		}
 		else
@@ -1452,7 +4398,7 @@ __exit_get_avi_head_info:
 		free(hdrl_data);
 		hdrl_data = NULL;
 	}
-	if(auds_exist_flag == 2)
+	if(auds_exist_flag >= 2)
 	{
 		if(vids_strh_seen && vids_strf_seen  && auds_strh_seen && auds_strf_seen)
 		{
@@ -1471,6 +4417,69 @@ __exit_get_avi_head_info:
   	return(-1);
 }
 
+/*******************************************************************
+ *                                                                 *
+ *    Chunk walker                                                 *
+ *                                                                 *
+ *******************************************************************/
+
+/* Walks the chunk headers of a movi list through AVI_WALK_BYTES blocks
+   read with pread, instead of a read() and lseek() per chunk. A header
+   that straddles the end of a block, or lies behind a chunk larger than
+   a block, makes the next block start at that header. The caller moves
+   wk.off past the chunk data. */
+
+#define AVI_WALK_BYTES         (4*1024*1024)
+
+typedef struct
+{
+   int    fd;
+   unsigned char *buf;
+   long   len;               /* valid bytes in buf */
+   off_t  buf_off;           /* file offset of buf[0] */
+   off_t  off;               /* file offset of the next chunk header */
+} avi_walk_t;
+
+static int avi_walk_init(avi_walk_t *wk, int fd, off_t start)
+{
+   wk->fd = fd;
+   wk->buf = (unsigned char *)malloc(AVI_WALK_BYTES);
+   wk->len = 0;
+   wk->buf_off = 0;
+   wk->off = start;
+
+   return wk->buf ? 0 : -1;
+}
+
+static void avi_walk_free(avi_walk_t *wk)
+{
+   free(wk->buf);
+   wk->buf = NULL;
+}
+
+/* Copies the next 8 byte chunk header to hdr and its offset to pos,
+   returns 0 at the end of the file */
+static int avi_walk_next(avi_walk_t *wk, unsigned char *hdr, off_t *pos)
+{
+   ssize_t r;
+
+   if(wk->off < wk->buf_off || wk->off + 8 > wk->buf_off + wk->len)
+   {
+      do
+         r = pread(wk->fd, wk->buf, AVI_WALK_BYTES, wk->off);
+      while(r < 0 && errno == EINTR);
+      if(r < 8) return 0;
+      wk->buf_off = wk->off;
+      wk->len = r;
+   }
+
+   memcpy(hdr, wk->buf + (wk->off - wk->buf_off), 8);
+   *pos = wk->off;
+   wk->off += 8;
+
+   return 1;
+}
+
 int AVI_write_frame_index(avi_t *AVI,int bytes)
 {
 	long pos;
@@ -1478,16 +4487,16 @@ int AVI_write_frame_index(avi_t *AVI,int bytes)
 	pos = AVI->pos;
 	int n;
 
-	/* Check for maximum file length */
+	/* Check for maximum file length, OpenDML segments have none */
 
-	if ( (AVI->pos + 8 + bytes + 8 + (AVI->n_idx+1)*16) > AVI->buf_len )
+	if ( AVI->odml == NULL && (AVI->pos + 8 + bytes + 8 + (AVI->n_idx+1)*16) > AVI->buf_len )
 	{
 		printf("avifile had beyond buf_len %d\n",AVI->buf_len);
 		return (-1);
 	}
 
 	/* Add index entry */
-	n = avi_add_index_entry(AVI,(unsigned char *)"00dc",0x10,AVI->pos,bytes);
+	n = avi_add_index_entry(AVI,(unsigned char *)"00dc",0x10,AVI->pos - avi_odml_base(AVI),bytes);
 	if(n)
 	{
 		return (-1);
@@ -1504,16 +4513,16 @@ int AVI_write_audio_index(avi_t *AVI, int bytes)
 {
 	int n;
 
-	/* Check for maximum file length */
+	/* Check for maximum file length, OpenDML segments have none */
 
-	if ( (AVI->pos + 8 + bytes + 8 + (AVI->n_idx+1)*16) > AVI->buf_len )
+	if ( AVI->odml == NULL && (AVI->pos + 8 + bytes + 8 + (AVI->n_idx+1)*16) > AVI->buf_len )
 	{
 		printf("avifile had beyond buf_len %d\n",AVI->buf_len);
 		return (-1);
 	}
 
 	/* Add index entry */
-	n = avi_add_index_entry(AVI,(unsigned char *)"01wb",0x00,AVI->pos,bytes);
+	n = avi_add_index_entry(AVI,(unsigned char *)"01wb",0x00,AVI->pos - avi_odml_base(AVI),bytes);
 	if(n)
 	{
 		return (-1);
@@ -1524,12 +4533,32 @@ int AVI_write_audio_index(avi_t *AVI, int bytes)
 	return 0;
 }
 
+/* Chunk of track track of AVI_set_audio_track, tagged "0Nwb" with N = track+1 */
+static int avi_write_track_index(avi_t *AVI, int track, unsigned char *tag, int bytes)
+{
+	if ( (AVI->pos + 8 + bytes + 8 + (AVI->n_idx+1)*16) > AVI->buf_len )
+	{
+		printf("avifile had beyond buf_len %d\n",AVI->buf_len);
+		return (-1);
+	}
+
+	if(avi_add_index_entry(AVI,tag,0x00,AVI->pos,bytes))
+	{
+		return (-1);
+	}
+	AVI->pos += 8 + PAD_EVEN(bytes);
+	AVI->track[track].audio_bytes += bytes;
+	return 0;
+}
+
 int AVI_deformity_file(char  *file_name, int duration,unsigned int *tm_len)
 {
 	int ret = RECORD_DEFORM_SUCCESS;
 	char data[16]={0};
-	void *ptr = NULL;
-	off_t oldpos=-1, newpos=-1;
+	avi_walk_t wk = { -1, NULL };
+	off_t chunk;
+	char *ckp;
+	int t;
 	unsigned int  length = 0;
 	avi_t			avi;
 	avi_t			*pAvi = &avi;
@@ -1573,14 +4602,8 @@ int AVI_deformity_file(char  *file_name, int duration,unsigned int *tm_len)
         	pAvi->dwSuggestedBufferSize =120008;
 	}
 	
-	ptr = malloc((duration*80+1024)*16);
-	if(NULL == ptr) 
-	{
-		printf("Can't malloc\n");
-		ret =  RECORD_DEFORM_FAIL;
-		goto __exit_deformity_file;
-	}
-	pAvi->idx = (unsigned char((*)[16])) ptr;
+	/* the index grows with the chunks found */
+	avi_idx_init(pAvi);
 
 	/* AVIļ1GB */
 	pAvi->buf_len = 1024*1024*1024;
@@ -1596,25 +4619,24 @@ int AVI_deformity_file(char  *file_name, int duration,unsigned int *tm_len)
 	//AVI_set_audio(pAvi,1,8000,16, 1);
 	pAvi->buf = NULL;
 	pAvi->pos = HEADERBYTES;
+	pAvi->last_pos = 0;
+	pAvi->last_len = 0;
+	pAvi->video_frames = 0;
+	pAvi->audio_bytes = 0;
+	for(t = 1; t < pAvi->anum; t++)
+		pAvi->track[t].audio_bytes = 0;
+
+	/* only scan what was written after the last checkpoint */
+	avi_ckp_load(pAvi, file_name, s.st_size);
 	
-	if (lseek(pAvi->fdes,pAvi->pos,SEEK_SET) < 0)
+	if (avi_walk_init(&wk, pAvi->fdes, pAvi->pos) < 0)
 	{
-		printf("lseek file %s err!\n",file_name);
+		printf("no memory to scan file %s!\n",file_name);
 		ret =  RECORD_DEFORM_FAIL;
 		goto __exit_deformity_file;
 	}
-	pAvi->last_pos = 0;
-	pAvi->last_len = 0;
-	pAvi->video_frames = 0;
-	pAvi->audio_bytes = 0;
-	while(1)
+	while(avi_walk_next(&wk, (unsigned char *)data, &chunk)) /* We assume it's EOF */
 	{
-		memset(data,0,sizeof(data));
-		if( avi_read(pAvi->fdes,data,8) != 8 ) break; /* We assume it's EOF */
-		newpos = lseek(pAvi->fdes,0,SEEK_CUR);		/*+8*/
-		if(oldpos == newpos) 
-			break;
-		oldpos = newpos;
 		if(strncasecmp(data,"00dc",4) == 0)  /*video*/
 		{	
 			length = str2ulong((unsigned char *)data+4);
@@ -1626,26 +4648,54 @@ int AVI_deformity_file(char  *file_name, int duration,unsigned int *tm_len)
 				goto __exit_deformity_file;
 			}
 		}
-		else if(strncasecmp(data,"01wb",4) == 0)  /*audio*/
+		else if(strncasecmp(data,"01wb",4) == 0)  /*audio*/
+		{
+			length = str2ulong((unsigned char *)data+4);
+			ret = AVI_write_audio_index(pAvi,length);
+			if(ret < 0)
+			{
+				printf("write audio err!\n");
+				ret =  RECORD_DEFORM_FAIL;
+				goto __exit_deformity_file;
+				
+			}
+		}
+		else if(strncasecmp(data+2,"wb",2) == 0)  /*audio of AVI_set_audio_track*/
 		{
 			length = str2ulong((unsigned char *)data+4);
-			ret = AVI_write_audio_index(pAvi,length);
-			if(ret < 0)
+			t = (data[0]-'0')*10 + data[1]-'0' - 1;
+			if(data[0] < '0' || data[0] > '9' || data[1] < '0' || data[1] > '9' ||
+			   t < 1 || t >= pAvi->anum)
+			{
+				/* a stream the header doesn't list */
+				pAvi->pos += 8 + PAD_EVEN(length);
+			}
+			else if(avi_write_track_index(pAvi,t,(unsigned char *)data,length) < 0)
 			{
 				printf("write audio err!\n");
 				ret =  RECORD_DEFORM_FAIL;
 				goto __exit_deformity_file;
-				
 			}
 		}
+		else if((t = avi_odml_repair_chunk(pAvi, (unsigned char *)data, chunk, s.st_size)) != 0)
+		{
+			/* ix##, idx1 and RIFF 'AVIX' of an OpenDML file */
+			if(t < 0)
+			{
+				printf("can't rebuild the OpenDML index of %s!\n",file_name);
+				ret =  RECORD_DEFORM_FAIL;
+				goto __exit_deformity_file;
+			}
+			wk.off = pAvi->pos;
+			continue;
+		}
 		else
 		{			
 			break;
 		}
-		if(length&1)
-			length = PAD_EVEN(length);
-		newpos = lseek(pAvi->fdes,length,SEEK_CUR);
+		wk.off += PAD_EVEN(length);
 	}
+	avi_odml_repair_end(pAvi);
 	if (lseek(pAvi->fdes,pAvi->pos,SEEK_SET) < 0)
 	{
 		printf("lseek file %s err!\n",file_name);
@@ -1656,21 +4706,67 @@ __exit_deformity_file:
 	 {
 	 	*tm_len = pAvi->video_frames/pAvi->fps;
 	 }
+	avi_walk_free(&wk);
 	AVI_close_fd(pAvi);
+	if(ret == RECORD_DEFORM_SUCCESS && (ckp = avi_ckp_name(file_name)) != NULL)
+	{
+		unlink(ckp);
+		free(ckp);
+	}
 	return ret;
 }
 
-int AVI_init_file_header(avi_t *AVI)
+/* Finished files have the movi length in the header and idx1 behind
+   the movi list; after a crash the header still has the movi length of
+   AVI_init_file_header and the journal of a checkpointed file is left */
+
+int AVI_check_file(char *file_name)
+{
+   unsigned char h[HEADERBYTES];
+   unsigned char c[8];
+   struct stat s;
+   off_t riff_end, idx;
+   char *ckp;
+   int fd, ret = 1;
+
+   if(stat(file_name, &s) != 0 || s.st_size <= HEADERBYTES) return RECORD_UNABLE_DEFORM;
+
+   if((ckp = avi_ckp_name(file_name)) != NULL)
+   {
+      fd = access(ckp, F_OK);
+      free(ckp);
+      if(fd == 0) return 1;
+   }
+
+   fd = open(file_name, O_RDONLY);
+   if(fd < 0) return RECORD_UNABLE_DEFORM;
+
+   if(pread(fd, h, HEADERBYTES, 0) == HEADERBYTES &&
+      memcmp(h, "RIFF", 4) == 0 && memcmp(h+8, "AVI ", 4) == 0 &&
+      memcmp(h+HEADERBYTES-12, "LIST", 4) == 0 && memcmp(h+HEADERBYTES-4, "movi", 4) == 0 &&
+      str2ulong(h+HEADERBYTES-8) > 4)
+   {
+      riff_end = (off_t)str2ulong(h+4) + 8;
+      idx = HEADERBYTES - 4 + (off_t)str2ulong(h+HEADERBYTES-8);
+      if(riff_end <= s.st_size && idx + 8 <= riff_end &&
+         pread(fd, c, 8, idx) == 8 && memcmp(c, "idx1", 4) == 0 &&
+         idx + 8 + (off_t)str2ulong(c+4) <= riff_end)
+         ret = 0;
+   }
+   close(fd);
+
+   return ret;
+}
+
+/* The header for the counts so far, without idx1 */
+
+static int avi_file_header(avi_t *AVI, unsigned char *AVI_header)
 {
-	int njunk, sampsize, hasIndex,  idxerror;
+	int njunk;
 	int movi_len, hdrl_start, strl_start;
-	unsigned char AVI_header[HEADERBYTES];
 	long nhb;
 
 	movi_len = AVI->pos - HEADERBYTES + 4;
-   
-	idxerror = 0;
-	hasIndex = 0;
   
 	/* Prepare the file header */
 	nhb = 0;
@@ -1702,10 +4798,7 @@ int AVI_init_file_header(avi_t *AVI)
 	OUTLONG(2064);               /* Flags */
 	OUTLONG(AVI->video_frames);  /* TotalFrames */
 	OUTLONG(0);                  /* InitialFrames */
-	if (AVI->audio_bytes)
-	  { OUTLONG(2); }           /* Streams */
-	else
-	  { OUTLONG(1); }           /* Streams */
+	OUTLONG(avi_streams(AVI));   /* Streams */
 	OUTLONG(AVI->dwSuggestedBufferSize);                  /* SuggestedBufferSize */
 	OUTLONG(AVI->width);         /* Width */
 	OUTLONG(AVI->height);        /* Height */
@@ -1764,171 +4857,576 @@ int AVI_init_file_header(avi_t *AVI)
 
 	/* Finish stream list, i.e. put number of bytes in the list to proper pos */
 
-	long2str(AVI_header+strl_start-4,nhb-strl_start);
+	long2str(AVI_header+strl_start-4,nhb-strl_start);
+
+	nhb = avi_out_audio(AVI, AVI_header, nhb, 1);
+
+	/* Finish header list */
+
+	long2str(AVI_header+hdrl_start-4,nhb-hdrl_start);
+
+	/* Calculate the needed amount of junk bytes, output junk */
+
+	njunk = HEADERBYTES - nhb - 8 - 12;
+
+	/* Safety first: if njunk <= 0, somebody has played with
+	  HEADERBYTES without knowing what (s)he did.
+	  This is a fatal error */
+
+	if(njunk<=0)
+	{
+		printf("AVI_close_output_file: # of header bytes too small\n");
+		return(1);
+	}
+
+	OUT4CC ("JUNK");
+	OUTLONG(njunk);
+	memset(AVI_header+nhb,0,njunk);
+	strcpy(AVI_header+nhb,"GrandStream");
+	nhb += njunk;
+
+	/* Start the movi list */
+
+	OUT4CC ("LIST");
+	OUTLONG(movi_len); /* Length of list in bytes */
+	OUT4CC ("movi");/*4: movi_len = AVI->pos - HEADERBYTES + 4;*/
+
+  	return 0;
+}
+
+int AVI_init_file_header(avi_t *AVI)
+{
+	unsigned char AVI_header[HEADERBYTES];
+	int ret;
+
+	ret = avi_file_header(AVI, AVI_header);
+	if(ret) return ret;
+
+	/* Output the header, report an error if someting goes wrong */
+	if ( avi_patch(AVI,0,AVI_header,HEADERBYTES) < 0 ||
+	lseek(AVI->fdes,AVI->pos,SEEK_SET)<0)
+	{
+		return (-1);
+	}
+  	return 0;
+}
+
+int AVI_Init_fd_1(avi_t *AVI, int width, int height, int fps, const char *compressor, int duration, const char *file_name)
+{
+	int ret,fd;
+	char recordFlag =1;
+	long start = avi_now_us();
+
+	/* the index grows with the recording */
+	AVI->pos = HEADERBYTES;
+	avi_idx_init(AVI);
+	AVI->writer = NULL;
+	AVI->odml = NULL;
+	AVI->ckp = NULL;
+	AVI->tsix = NULL;
+	AVI->durable = NULL;
+	AVI->input = NULL;
+	AVI->track = NULL;
+	AVI->anum = 0;
+	AVI->duration = duration;
+
+	/* AVIļ1GB */
+	AVI->buf_len = 1024*1024*1024;		
+	/* write avi head */
+	AVI_set_video(AVI, width, height, fps, compressor);
+	//if(AUDIO_ENC_FMT_AAC == CFG_GetAudioEncType())
+		//AVI_set_audio(AVI,1,16000,16,1);
+	//else
+		AVI_set_audio(AVI,1,8000,16, 1);
+
+	AVI->fdes = open(file_name, O_RDWR | O_NONBLOCK | O_CREAT | O_TRUNC, 00644);
+	if (AVI->fdes < 0) 
+	{
+		printf("create file %s err!\n",file_name);
+		AVI_close_fd(AVI);
+		return (-1);
+	}
+	usleep(10000);
+	fd=open("/var/run/hostPlus",O_WRONLY |O_NONBLOCK | O_CREAT | O_TRUNC, 00644);
+	//fd=open("/var/run/hostPlus",O_RDWR |O_NONBLOCK | O_CREAT | O_TRUNC, 00644);
+	if(fd>=0)
+	{
+		write(fd,&recordFlag,1);
+		fdatasync(fd);
+		close(fd);
+	}
+	usleep(10000);
+	ret = AVI_init_file_header(AVI);
+	//ret =  AVI_output_file_fd(AVI);
+	if(ret != 0)
+	{
+		printf("init file header err!\n");
+		AVI_close_fd(AVI);
+		return (-1);
+	}
+	AVI->pos = HEADERBYTES;
+	if (lseek(AVI->fdes,AVI->pos,SEEK_SET) < 0)
+	{
+		printf("lseek file %s err!\n",file_name);
+		AVI_close_fd(AVI);
+		return (-1);
+	}
+	AVI->buf = NULL;
+	AVI->bt = 0;
+	AVI->et = 0;
+	sync();
+	AVI->init_us = avi_now_us() - start;
+	return(1);
+}
+
+/* The marker of AVI_Init_fd_1 is written and synced once per process
+   and again only if it was removed; concurrent starts wait for the
+   first one instead of each syncing it */
+
+#define AVI_MARKER_FILE        "/var/run/hostPlus"
+
+static pthread_mutex_t avi_marker_lock = PTHREAD_MUTEX_INITIALIZER;
+static int avi_marker_done;
+
+static void avi_marker(void)
+{
+	struct stat st;
+	char recordFlag = 1;
+	int fd;
+
+	pthread_mutex_lock(&avi_marker_lock);
+	if(!avi_marker_done || stat(AVI_MARKER_FILE, &st) < 0)
+	{
+		avi_marker_done = 0;
+		fd = open(AVI_MARKER_FILE, O_WRONLY | O_NONBLOCK | O_CREAT | O_TRUNC, 00644);
+		if(fd >= 0)
+		{
+			if(write(fd, &recordFlag, 1) == 1 && fdatasync(fd) == 0)
+				avi_marker_done = 1;
+			close(fd);
+		}
+	}
+	pthread_mutex_unlock(&avi_marker_lock);
+}
+
+/* Same file as AVI_Init_fd_1, but without the sleeps and the sync() of
+   the whole system: only the new file and its directory are synced, by
+   the group commit thread together with the other files started in the
+   meantime */
+
+int AVI_Init_fd_fast(avi_t *AVI, int width, int height, int fps, const char *compressor, int duration, const char *file_name)
+{
+	char dir[PATH_MAX];
+	long start = avi_now_us();
+
+	/* the index grows with the recording */
+	AVI->pos = HEADERBYTES;
+	avi_idx_init(AVI);
+	AVI->writer = NULL;
+	AVI->odml = NULL;
+	AVI->ckp = NULL;
+	AVI->tsix = NULL;
+	AVI->durable = NULL;
+	AVI->input = NULL;
+	AVI->track = NULL;
+	AVI->anum = 0;
+	AVI->duration = duration;
+	AVI->buf_len = 1024*1024*1024;
+	AVI->buf = NULL;
+	AVI->bt = 0;
+	AVI->et = 0;
+
+	AVI_set_video(AVI, width, height, fps, compressor);
+	AVI_set_audio(AVI,1,8000,16, 1);
+
+	AVI->fdes = open(file_name, O_RDWR | O_NONBLOCK | O_CREAT | O_TRUNC, 00644);
+	if (AVI->fdes < 0)
+	{
+		printf("create file %s err!\n",file_name);
+		AVI_close_fd(AVI);
+		return (-1);
+	}
+	avi_marker();
+
+	if(AVI_init_file_header(AVI) != 0)
+	{
+		printf("init file header err!\n");
+		AVI_close_fd(AVI);
+		return (-1);
+	}
+	if(avi_group_new_file(AVI->fdes, file_name) != 0)
+	{
+		/* no thread, sync here */
+		if(fdatasync(AVI->fdes) != 0)
+		{
+			printf("init file header err!\n");
+			AVI_close_fd(AVI);
+			return (-1);
+		}
+		snprintf(dir, sizeof(dir), "%s", file_name);
+		avi_dir_of(dir);
+		avi_sync_dir(dir);
+	}
+
+	AVI->pos = HEADERBYTES;
+	if (lseek(AVI->fdes,AVI->pos,SEEK_SET) < 0)
+	{
+		printf("lseek file %s err!\n",file_name);
+		AVI_close_fd(AVI);
+		return (-1);
+	}
+	AVI->init_us = avi_now_us() - start;
+	return(1);
+}
+
+#ifdef AVI_READ
+/*******************************************************************
+ *                                                                 *
+ *    Utilities for reading video and audio from an AVI File       *
+ *                                                                 *
+ *******************************************************************/
+
+/*******************************************************************
+ *                                                                 *
+ *    mmap read mode                                               *
+ *                                                                 *
+ *******************************************************************/
+
+/* The file is mapped as a whole if it fits the address space budget,
+   otherwise through a window that is moved to the data asked for. The
+   madvise() advice follows the video access pattern: sequential after
+   a few frames read in order, random after seeks. */
+
+static int avi_read_fd(avi_t *AVI)
+{
+#ifdef FILE_OP
+   return fileno(AVI->fpFile);
+#else
+   return AVI->fdes;
+#endif
+}
+
+static int avi_pread(int fd, char *buf, long n, off_t pos)
+{
+   ssize_t r;
+
+   while(n > 0)
+   {
+      r = pread(fd, buf, n, pos);
+      if(r < 0 && errno == EINTR) continue;
+      if(r <= 0) return -AVI_ERR_READ;
+      buf += r;
+      pos += r;
+      n   -= r;
+   }
+
+   return 0;
+}
+
+/* Reads the contiguous file range at pos into the iovecs, which are
+   modified on a short read */
+static int avi_preadv(int fd, struct iovec *iov, int n, off_t pos)
+{
+   ssize_t r;
+
+   if(n == 1) return avi_pread(fd, (char *)iov[0].iov_base, iov[0].iov_len, pos);
+
+   while(n > 0)
+   {
+      r = preadv(fd, iov, n, pos);
+      if(r < 0 && errno == EINTR) continue;
+      if(r <= 0) return -AVI_ERR_READ;
+      pos += r;
+      while(n > 0 && (size_t)r >= iov->iov_len)
+      {
+         r -= iov->iov_len;
+         iov++;
+         n--;
+      }
+      if(n > 0)
+      {
+         iov->iov_base = (char *)iov->iov_base + r;
+         iov->iov_len -= r;
+      }
+   }
+
+   return 0;
+}
+
+/* The time index lists the keyframes. Without it a frame is read only
+   if its idx1 entry has the keyframe flag, which this writer sets on
+   all frames, and as much of it as AVI_frame_is_key looks at. */
+
+#define AVI_KEY_PROBE          256
+
+long AVI_key_before(avi_t *AVI, long frame, long scan)
+{
+   avi_tsix_t *t = (avi_tsix_t *)AVI->tsix;
+   unsigned char b[AVI_KEY_PROBE];
+   long n0, n1, n;
+
+   if(AVI->input == NULL || AVI->input->video_index == NULL ||
+      frame < 0 || frame >= AVI->video_frames) return frame;
+
+   if(t != NULL && t->nkeys > 0)
+   {
+      if(t->keys[0] > frame) return frame;
+
+      n0 = 0;
+      n1 = t->nkeys;
+      while(n0<n1-1)
+      {
+         n = (n0+n1)/2;
+         if(t->keys[n]>frame)
+            n1 = n;
+         else
+            n0 = n;
+      }
+      return t->keys[n0];
+   }
+
+   if(scan <= 0) scan = AVI_KEY_SCAN;
+   for(n = frame; n >= 0 && n > frame - scan; n--)
+   {
+      if(!(AVI->input->video_index[n].key & 0x10)) continue;
+      n0 = AVI->input->video_index[n].len < AVI_KEY_PROBE ? AVI->input->video_index[n].len : AVI_KEY_PROBE;
+      if(avi_pread(avi_read_fd(AVI), (char *)b, n0, AVI->input->video_index[n].pos) == 0 &&
+         AVI_frame_is_key(AVI, b, n0))
+         return n;
+   }
+   return frame;
+}
+
+typedef struct
+{
+   int    fd;
+   off_t  size;              /* file size */
+   long   page;
+   off_t  window;            /* bytes per mapping */
+   unsigned char *base;
+   off_t  off;               /* file offset of base */
+   size_t len;
+   int    advice;            /* current madvise() advice */
+   long   next_frame;        /* frame after the last one read */
+   int    seq;               /* frames read in order */
+} avi_map_t;
+
+static const unsigned char *avi_map_view(avi_t *AVI, off_t pos, long len)
+{
+   avi_map_t *m = (avi_map_t *)AVI->input->map;
+
+   if(pos < 0 || len < 0 || pos + len > m->size) return NULL;
+
+   if(m->base == NULL || pos < m->off || pos + len > m->off + (off_t)m->len)
+   {
+      if(m->base) munmap(m->base, m->len);
+      m->off = pos & ~(off_t)(m->page-1);
+      m->len = m->window;
+      if((off_t)m->len < pos + len - m->off) m->len = pos + len - m->off;
+      if(m->off + (off_t)m->len > m->size) m->len = m->size - m->off;
+      m->base = mmap(NULL, m->len, PROT_READ, MAP_SHARED, m->fd, m->off);
+      if(m->base == MAP_FAILED)
+      {
+         m->base = NULL;
+         return NULL;
+      }
+      madvise(m->base, m->len, m->advice);
+   }
+
+   return m->base + (pos - m->off);
+}
+
+static void avi_map_access(avi_t *AVI, long frame)
+{
+   avi_map_t *m = (avi_map_t *)AVI->input->map;
+   int advice = m->advice;
+
+   if(frame == m->next_frame)
+   {
+      if(++m->seq >= 3) advice = MADV_SEQUENTIAL;
+   }
+   else
+   {
+      m->seq = 0;
+      advice = MADV_RANDOM;
+   }
+   m->next_frame = frame + 1;
 
-	//if (AVI->a_chans && AVI->audio_bytes)
-	if (AVI->a_chans)
-	{
-		sampsize = avi_sampsize(AVI);
-
-		/* Start the audio stream list ---------------------------------- */
-
-		OUT4CC ("LIST");
-		OUTLONG(0);        /* Length of list in bytes, don't know yet */
-		strl_start = nhb;  /* Store start position */
-		OUT4CC ("strl");
-
-		/* The audio stream header */
-
-		OUT4CC ("strh");
-		OUTLONG(64);            /* # of bytes to follow */
-		OUT4CC ("auds");
-		OUT4CC ("\0\0\0\0");
-		OUTLONG(0);             /* Flags */
-		OUTLONG(0);             /* Reserved, MS says: wPriority, wLanguage */
-		OUTLONG(0);             /* InitialFrames */
-		OUTLONG(sampsize);      /* Scale */
-		OUTLONG(sampsize*AVI->a_rate); /* Rate: Rate/Scale == samples/second */
-		OUTLONG(0);             /* Start */
-		OUTLONG(AVI->audio_bytes/sampsize);   /* Length */
-		OUTLONG(0);             /* SuggestedBufferSize */
-		OUTLONG(-1);            /* Quality */
-		OUTLONG(sampsize);      /* SampleSize */
-		OUTLONG(0);             /* Frame */
-		OUTLONG(0);             /* Frame */
-		OUTLONG(0);             /* Frame */
-		OUTLONG(0);             /* Frame */
-
-		/* The audio stream format */
-
-		OUT4CC ("strf");
-		OUTLONG(16);                   /* # of bytes to follow */
-		OUTSHRT(AVI->a_fmt);           /* Format */
-		OUTSHRT(AVI->a_chans);         /* Number of channels */
-		OUTLONG(AVI->a_rate);          /* SamplesPerSec */
-		OUTLONG(sampsize*AVI->a_rate); /* AvgBytesPerSec */
-		OUTSHRT(sampsize);             /* BlockAlign */
-		OUTSHRT(AVI->a_bits);          /* BitsPerSample */
-
-		/* Finish stream list, i.e. put number of bytes in the list to proper pos */
-
-		long2str(AVI_header+strl_start-4,nhb-strl_start);
+   if(advice != m->advice)
+   {
+      m->advice = advice;
+      if(m->base) madvise(m->base, m->len, advice);
+   }
+}
 
-	}
+int AVI_set_mmap(avi_t *AVI, long window)
+{
+   avi_map_t *m;
+   struct stat st;
+   int fd;
 
-	/* Finish header list */
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(!AVI->input->video_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+   if(AVI->input->map) return 0;
+
+   fd = avi_read_fd(AVI);
+   if(fstat(fd, &st) < 0) { AVI_errno = AVI_ERR_READ; return -1; }
+
+   m = (avi_map_t *)malloc(sizeof(avi_map_t));
+   if(m == NULL) { AVI_errno = AVI_ERR_NO_MEM; return -1; }
+   memset(m, 0, sizeof(avi_map_t));
+   m->fd = fd;
+   m->size = st.st_size;
+   m->page = sysconf(_SC_PAGESIZE);
+   if(window <= 0)
+      window = st.st_size <= AVI_MMAP_BUDGET ? st.st_size : AVI_MMAP_WINDOW;
+   if(window > st.st_size) window = st.st_size;
+   m->window = (window + m->page - 1) & ~(off_t)(m->page-1);
+   m->advice = MADV_NORMAL;
+   m->next_frame = AVI->input->video_pos;
+   AVI->input->map = m;
+
+   /* map a file that fits right away, views stay valid until close */
+   if(m->window >= m->size && avi_map_view(AVI, 0, m->size) == NULL)
+   {
+      free(m);
+      AVI->input->map = NULL;
+      AVI_errno = AVI_ERR_NO_MEM;
+      return -1;
+   }
 
-	long2str(AVI_header+hdrl_start-4,nhb-hdrl_start);
+   return 0;
+}
 
-	/* Calculate the needed amount of junk bytes, output junk */
+static void avi_map_free(avi_t *AVI)
+{
+   avi_map_t *m = (avi_map_t *)AVI->input->map;
 
-	njunk = HEADERBYTES - nhb - 8 - 12;
+   if(m == NULL) return;
+   if(m->base) munmap(m->base, m->len);
+   free(m);
+   AVI->input->map = NULL;
+}
 
-	/* Safety first: if njunk <= 0, somebody has played with
-	  HEADERBYTES without knowing what (s)he did.
-	  This is a fatal error */
+long AVI_read_frame_view(avi_t *AVI, const unsigned char **data)
+{
+   const unsigned char *p;
+   long n;
 
-	if(njunk<=0)
-	{
-		printf("AVI_close_output_file: # of header bytes too small\n");
-		return(1);
-	}
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(!AVI->input->video_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+   if(!AVI->input->map && AVI_set_mmap(AVI, 0)) return -1;
 
-	OUT4CC ("JUNK");
-	OUTLONG(njunk);
-	memset(AVI_header+nhb,0,njunk);
-	strcpy(AVI_header+nhb,"GrandStream");
-	nhb += njunk;
+   if(AVI->input->video_pos < 0 || AVI->input->video_pos >= AVI->video_frames) return 0;
+   n = AVI->input->video_index[AVI->input->video_pos].len;
 
-	/* Start the movi list */
+   avi_map_access(AVI, AVI->input->video_pos);
+   p = avi_map_view(AVI, AVI->input->video_index[AVI->input->video_pos].pos, n);
+   if(p == NULL)
+   {
+      AVI_errno = AVI_ERR_READ;
+      return -1;
+   }
 
-	OUT4CC ("LIST");
-	OUTLONG(movi_len); /* Length of list in bytes */
-	OUT4CC ("movi");/*4: movi_len = AVI->pos - HEADERBYTES + 4;*/
+   *data = p;
+   AVI->input->video_pos++;
 
-	/* Output the header, truncate the file to the number of bytes
-	  actually written, report an error if someting goes wrong */
-	if ( lseek(AVI->fdes,0,SEEK_SET)<0 ||
-	avi_write(AVI->fdes,(char *)AVI_header,HEADERBYTES)!=HEADERBYTES ||
-	lseek(AVI->fdes,AVI->pos,SEEK_SET)<0)
-	{
-		return (-1);
-	}
-	if(idxerror) return (-1);
-  	return 0;
+   return n;
 }
 
-int AVI_Init_fd_1(avi_t *AVI, int width, int height, int fps, const char *compressor, int duration, const char *file_name)
+long AVI_read_audio_view(avi_t *AVI, const unsigned char **data, long bytes)
 {
-	int ret,fd;
-	char recordFlag =1;
-	void *ptr = NULL;
+   const unsigned char *p;
+   long left;
 
-	/* apply for index space */
-	ptr = malloc((duration*80+1024)*16);
-	if(NULL == ptr) 
-	{
-		printf("malloc err!\n");
-		return (-1);
-	}
-	AVI->pos = HEADERBYTES;
-	AVI->idx = (unsigned char((*)[16]) ) ptr;
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(!AVI->input->audio_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+   if(!AVI->input->map && AVI_set_mmap(AVI, 0)) return -1;
 
-	/* AVIļ1GB */
-	AVI->buf_len = 1024*1024*1024;		
-	/* write avi head */
-	AVI_set_video(AVI, width, height, fps, compressor);
-	//if(AUDIO_ENC_FMT_AAC == CFG_GetAudioEncType())
-		//AVI_set_audio(AVI,1,16000,16,1);
-	//else
-		AVI_set_audio(AVI,1,8000,16, 1);
+   while(1)
+   {
+      left = AVI->input->audio_index[AVI->input->audio_posc].len - AVI->input->audio_posb;
+      if(left > 0) break;
+      if(AVI->input->audio_posc>=AVI->audio_chunks-1) return 0;
+      AVI->input->audio_posc++;
+      AVI->input->audio_posb = 0;
+   }
+   if(bytes > left) bytes = left;
 
-	AVI->fdes = open(file_name, O_RDWR | O_NONBLOCK | O_CREAT | O_TRUNC, 00644);
-	if (AVI->fdes < 0) 
-	{
-		printf("create file %s err!\n",file_name);
-		AVI_close_fd(AVI);
-		return (-1);
-	}
-	usleep(10000);
-	fd=open("/var/run/hostPlus",O_WRONLY |O_NONBLOCK | O_CREAT | O_TRUNC, 00644);
-	//fd=open("/var/run/hostPlus",O_RDWR |O_NONBLOCK | O_CREAT | O_TRUNC, 00644);
-	if(fd>=0)
-	{
-		write(fd,&recordFlag,1);
-		fdatasync(fd);
-		close(fd);
-	}
-	usleep(10000);
-	ret = AVI_init_file_header(AVI);
-	//ret =  AVI_output_file_fd(AVI);
-	if(ret != 0)
-	{
-		printf("init file header err!\n");
-		AVI_close_fd(AVI);
-		return (-1);
-	}
-	AVI->pos = HEADERBYTES;
-	if (lseek(AVI->fdes,AVI->pos,SEEK_SET) < 0)
-	{
-		printf("lseek file %s err!\n",file_name);
-		AVI_close_fd(AVI);
-		return (-1);
-	}
-	AVI->buf = NULL;
-	AVI->bt = 0;
-	AVI->et = 0;
-	sync();
-	return(1);
+   p = avi_map_view(AVI, AVI->input->audio_index[AVI->input->audio_posc].pos + AVI->input->audio_posb, bytes);
+   if(p == NULL)
+   {
+      AVI_errno = AVI_ERR_READ;
+      return -1;
+   }
+
+   *data = p;
+   AVI->input->audio_posb += bytes;
+
+   return bytes;
 }
 
-#ifdef AVI_READ
 /*******************************************************************
  *                                                                 *
- *    Utilities for reading video and audio from an AVI File       *
+ *    Read-ahead                                                   *
  *                                                                 *
  *******************************************************************/
 
+/* AVI_read_frame/AVI_read_audio keep posix_fadvise(WILLNEED) ahead of
+   the chunk they read, topped up once less than half the window is
+   left. A seek outside the window only starts a new one: the pages
+   already read ahead stay cached, other sessions of the file or a
+   scrub back may still use them. */
+
+int AVI_set_readahead(avi_t *AVI, long window)
+{
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(!AVI->input->video_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+
+   AVI->input->ra_window = window < 0 ? 0 : (window ? window : AVI_READAHEAD_BYTES);
+   AVI->input->ra_pos = 0;
+   AVI->input->ra_end = 0;
+
+   return 0;
+}
+
+static void avi_readahead(avi_t *AVI, off_t pos)
+{
+   off_t from, to, last;
+
+   if(AVI->input->ra_window == 0 || AVI->video_frames <= 0) return;
+
+   AVI->input->ra_pos = pos;
+   if(pos + AVI->input->ra_window/2 < AVI->input->ra_end) return;
+
+   /* nothing lies behind the last indexed chunk */
+   last = AVI->input->video_index[AVI->video_frames-1].pos
+        + AVI->input->video_index[AVI->video_frames-1].len;
+   if(AVI->input->audio_index)
+   {
+      off_t a = AVI->input->audio_index[AVI->audio_chunks-1].pos
+              + AVI->input->audio_index[AVI->audio_chunks-1].len;
+      if(a > last) last = a;
+   }
+
+   from = pos > AVI->input->ra_end ? pos : AVI->input->ra_end;
+   to = pos + AVI->input->ra_window;
+   if(to > last) to = last;
+   if(to <= from) return;
+
+   posix_fadvise(avi_read_fd(AVI), from, to - from, POSIX_FADV_WILLNEED);
+   AVI->input->ra_end = to;
+}
+
+static void avi_readahead_seek(avi_t *AVI, off_t pos)
+{
+   if(AVI->input->ra_window == 0) return;
+   if(pos >= AVI->input->ra_pos && pos < AVI->input->ra_end) return;
+
+   AVI->input->ra_pos = pos;
+   AVI->input->ra_end = pos;
+}
+
 int AVI_close_1(avi_t *AVI)
 {
    int ret;
@@ -1937,7 +5435,12 @@ int AVI_close_1(avi_t *AVI)
       to be written */
 
    if(AVI->mode == AVI_MODE_WRITE)
+   {
       ret = AVI_output_file_fd_1(AVI);
+      avi_ckp_free(AVI, ret == 0);
+      avi_writer_free(AVI);
+      free(AVI->odml);
+   }
    else
       ret = 0;
 
@@ -1947,42 +5450,430 @@ int AVI_close_1(avi_t *AVI)
 #else
    close(AVI->fdes);
 #endif
-   if(AVI->idx) free(AVI->idx);
-   if(AVI->video_index) free(AVI->video_index);
-   if(AVI->audio_index) free(AVI->audio_index);
+   avi_tsix_free(AVI);
+   avi_idx_free(AVI);
+   avi_tracks_free(AVI);
+   if(AVI->input)
+   {
+      avi_map_free(AVI);
+      avi_demux_free(AVI);
+      if(AVI->input->video_index) free(AVI->input->video_index);
+      if(AVI->input->audio_index) free(AVI->input->audio_index);
+   }
    free(AVI);
 
    return ret;
 }
 
+/*******************************************************************
+ *                                                                 *
+ *    Opening                                                      *
+ *                                                                 *
+ *******************************************************************/
+
+/* The first AVI_OPEN_HEAD_BYTES of the file are read at once, that
+   covers the header list of the files we write (HEADERBYTES). Other
+   top level chunks are located with one pread each. */
+
+#define AVI_OPEN_HEAD_BYTES    (64*1024)
+
+/* FourCC as returned by str2ulong with the letters folded to lower
+   case, so tags compare as integers. Digits keep their value. */
+#define AVI_FCC(a,b,c,d)       ((u32)(a) | (u32)(b)<<8 | (u32)(c)<<16 | (u32)(d)<<24)
+#define AVI_FCC_FOLD(p)        (str2ulong((unsigned char *)(p)) | 0x20202020)
+
+static int avi_open_pread(int fd, unsigned char *head, long head_len,
+                          off_t off, void *buf, long n)
+{
+   if(off + n <= head_len)
+   {
+      memcpy(buf, head + off, n);
+      return 0;
+   }
+   return avi_pread(fd, (char *)buf, n, off);
+}
+
+/* Sidecar index: the video and audio index of a file in host byte
+   order, valid as long as size and mtime of the file don't change. */
+
+#define AVI_SIDECAR_MAGIC      "avilibix"
+#define AVI_SIDECAR_VERSION    1
+
+typedef struct
+{
+   char  magic[8];
+   u32   version;
+   u32   nvi;
+   u32   nai;
+   u32   reserved;
+   u64   size;               /* of the AVI file */
+   s64   mtime_sec;
+   s64   mtime_nsec;
+   u64   movi_start;
+} avi_sidecar_hdr_t;
+
+typedef struct
+{
+   u64   pos;
+   u32   len;
+   u32   key;
+} avi_sidecar_entry_t;
+
+static int avi_sidecar_load(avi_t *AVI, const char *indexfile, struct stat *st)
+{
+   avi_sidecar_hdr_t h;
+   avi_sidecar_entry_t *e = NULL;
+   struct stat sst;
+   long i, n;
+   off_t tot;
+   int fd;
+
+   fd = open(indexfile, O_RDONLY);
+   if(fd < 0) return -1;
+
+   if(fstat(fd, &sst) < 0 || avi_pread(fd, (char *)&h, sizeof(h), 0))
+      goto __exit_sidecar;
+   if(memcmp(h.magic, AVI_SIDECAR_MAGIC, 8) != 0 ||
+      h.version != AVI_SIDECAR_VERSION ||
+      h.size != (u64)st->st_size ||
+      h.mtime_sec != (s64)st->st_mtim.tv_sec ||
+      h.mtime_nsec != (s64)st->st_mtim.tv_nsec ||
+      h.nvi == 0)
+      goto __exit_sidecar;
+
+   n = (long)h.nvi + h.nai;
+   if((u64)sst.st_size != sizeof(h) + (u64)n*sizeof(avi_sidecar_entry_t))
+      goto __exit_sidecar;
+
+   e = (avi_sidecar_entry_t *)malloc(n*sizeof(avi_sidecar_entry_t));
+   AVI->input->video_index = (video_index_entry *)malloc(h.nvi*sizeof(video_index_entry));
+   if(h.nai)
+      AVI->input->audio_index = (audio_index_entry *)malloc(h.nai*sizeof(audio_index_entry));
+   if(e == NULL || AVI->input->video_index == NULL || (h.nai && AVI->input->audio_index == NULL))
+      goto __exit_sidecar;
+   if(avi_pread(fd, (char *)e, n*sizeof(avi_sidecar_entry_t), sizeof(h)))
+      goto __exit_sidecar;
+
+   for(i=0;i<h.nvi;i++)
+   {
+      AVI->input->video_index[i].pos = e[i].pos;
+      AVI->input->video_index[i].len = e[i].len;
+      AVI->input->video_index[i].key = e[i].key;
+   }
+   for(i=0,tot=0;i<h.nai;i++)
+   {
+      AVI->input->audio_index[i].pos = e[h.nvi+i].pos;
+      AVI->input->audio_index[i].len = e[h.nvi+i].len;
+      AVI->input->audio_index[i].tot = tot;
+      tot += e[h.nvi+i].len;
+   }
+
+   AVI->video_frames = h.nvi;
+   AVI->audio_chunks = h.nai;
+   AVI->audio_bytes  = tot;
+   AVI->input->movi_start   = h.movi_start;   /* the caller compares it with the file */
+
+   free(e);
+   close(fd);
+   return 0;
+
+__exit_sidecar:
+   free(e);
+   free(AVI->input->video_index);
+   free(AVI->input->audio_index);
+   AVI->input->video_index = NULL;
+   AVI->input->audio_index = NULL;
+   close(fd);
+   return -1;
+}
+
+static void avi_sidecar_save(avi_t *AVI, const char *indexfile, struct stat *st)
+{
+   avi_sidecar_hdr_t *h;
+   avi_sidecar_entry_t *e;
+   long i, n;
+   size_t len;
+   char *tmp;
+   int fd;
+
+   n = AVI->video_frames + AVI->audio_chunks;
+   len = sizeof(avi_sidecar_hdr_t) + n*sizeof(avi_sidecar_entry_t);
+   h = (avi_sidecar_hdr_t *)malloc(len);
+   if(h == NULL) return;
+   tmp = (char *)malloc(strlen(indexfile) + 8);
+   if(tmp == NULL) { free(h); return; }
+
+   memset(h, 0, sizeof(avi_sidecar_hdr_t));
+   memcpy(h->magic, AVI_SIDECAR_MAGIC, 8);
+   h->version    = AVI_SIDECAR_VERSION;
+   h->nvi        = AVI->video_frames;
+   h->nai        = AVI->audio_chunks;
+   h->size       = st->st_size;
+   h->mtime_sec  = st->st_mtim.tv_sec;
+   h->mtime_nsec = st->st_mtim.tv_nsec;
+   h->movi_start = AVI->input->movi_start;
+
+   e = (avi_sidecar_entry_t *)(h + 1);
+   for(i=0;i<AVI->video_frames;i++,e++)
+   {
+      e->pos = AVI->input->video_index[i].pos;
+      e->len = AVI->input->video_index[i].len;
+      e->key = AVI->input->video_index[i].key;
+   }
+   for(i=0;i<AVI->audio_chunks;i++,e++)
+   {
+      e->pos = AVI->input->audio_index[i].pos;
+      e->len = AVI->input->audio_index[i].len;
+      e->key = 0;
+   }
+
+   /* written next to it and renamed over it, so that a reader of the
+      sidecar never sees it half written */
+   sprintf(tmp, "%s.XXXXXX", indexfile);
+   fd = mkstemp(tmp);
+   if(fd >= 0)
+   {
+      if(fchmod(fd, 0644) || write(fd, h, len) != (ssize_t)len)
+      {
+         close(fd);
+         unlink(tmp);
+      }
+      else if(close(fd) || rename(tmp, indexfile))
+         unlink(tmp);
+   }
+   free(tmp);
+   free(h);
+}
+
+/* OpenDML: the entries of the ix## chunks the indx super index at off
+   points to, pos at the data like video_index. Returns the number of
+   entries, -1 if the index can't be used. */
+
+static long avi_odml_load_ix(int fd, off_t off, long len, video_index_entry **out)
+{
+   unsigned char *indx, *ix = NULL, *p;
+   video_index_entry *e = NULL;
+   long i, j, n, ne, cnt = 0, max = 0;
+   u64 base, ix_off;
+   u32 size;
+   void *q;
+
+   /* wLongsPerEntry, bIndexSubType, bIndexType, nEntriesInUse,
+      dwChunkId, dwReserved[3], then 16 bytes per ix## chunk */
+   if(len < 24 || (indx = (unsigned char *)malloc(len)) == NULL) return -1;
+   if(avi_pread(fd, (char *)indx, len, off) || indx[3] != AVI_INDEX_OF_INDEXES ||
+      (n = str2ulong(indx+4)) == 0 || 24 + n*16 > len)
+      goto __exit_ix;
+
+   for(i=0; i<n; i++)
+   {
+      p = indx + 24 + i*16;
+      ix_off = str2ulong(p) | (u64)str2ulong(p+4) << 32;
+      size = str2ulong(p+8);
+      if(size < 32 || (q = realloc(ix, size)) == NULL) goto __exit_ix;
+      ix = (unsigned char *)q;
+      if(avi_pread(fd, (char *)ix, size, ix_off) || ix[11] != AVI_INDEX_OF_CHUNKS ||
+         32 + (u64)(ne = str2ulong(ix+12))*8 > size)
+         goto __exit_ix;
+
+      if(cnt + ne > max)
+      {
+         max = (cnt + ne)*2;
+         q = realloc(e, max*sizeof(video_index_entry));
+         if(q == NULL) goto __exit_ix;
+         e = (video_index_entry *)q;
+      }
+      base = str2ulong(ix+20) | (u64)str2ulong(ix+24) << 32;
+      for(j=0; j<ne; j++, cnt++)
+      {
+         p = ix + 32 + j*8;
+         size = str2ulong(p+4);
+         e[cnt].pos = base + str2ulong(p);
+         e[cnt].len = size & 0x7fffffff;
+         e[cnt].key = size & 0x80000000 ? 0 : 0x10;
+      }
+   }
+
+   free(ix);
+   free(indx);
+   *out = e;
+   return cnt;
+
+__exit_ix:
+   free(e);
+   free(ix);
+   free(indx);
+   return -1;
+}
+
+/* Build video_index and audio_index of an OpenDML file from the super
+   indexes of its first video and audio stream, its idx1 only covers
+   the first RIFF. 1 if there is no usable super index. */
+
+static int avi_odml_build_index(avi_t *AVI, int fd, off_t *indx_off, long *indx_len)
+{
+   video_index_entry *vi, *ae = NULL;
+   audio_index_entry *ai;
+   long i, nvi, nai = 0;
+   off_t tot = 0;
+
+   if(!indx_off[0] || (nvi = avi_odml_load_ix(fd, indx_off[0], indx_len[0], &vi)) <= 0)
+      return 1;
+   if(AVI->a_chans && indx_off[1] && (nai = avi_odml_load_ix(fd, indx_off[1], indx_len[1], &ae)) < 0)
+      nai = 0;
+
+   ai = NULL;
+   if(nai > 0)
+   {
+      ai = (audio_index_entry *)malloc(nai*sizeof(audio_index_entry));
+      if(ai == NULL)
+      {
+         free(vi);
+         free(ae);
+         return AVI_ERR_NO_MEM;
+      }
+      for(i=0; i<nai; i++)
+      {
+         ai[i].pos = ae[i].pos;
+         ai[i].len = ae[i].len;
+         ai[i].tot = tot;
+         tot += ae[i].len;
+      }
+   }
+   free(ae);
+
+   AVI->input->video_index  = vi;
+   AVI->input->audio_index  = ai;
+   AVI->video_frames = nvi;
+   AVI->audio_chunks = nai > 0 ? nai : 0;
+   AVI->audio_bytes  = tot;
+   AVI->is_opendml   = 1;
+   AVI->total_frames = nvi;
+
+   return 0;
+}
+
+/* Build video_index and audio_index from the idx1 entries in one pass */
+
+static int avi_build_index(avi_t *AVI, long idx_type)
+{
+   video_index_entry *vi;
+   audio_index_entry *ai = NULL;
+   void *p;
+   u32 vtag, atag, t;
+   long i, nvi, nai;
+   off_t ioff, tot;
+
+   vi = (video_index_entry *)malloc(AVI->n_idx*sizeof(video_index_entry));
+   if(vi == NULL) return AVI_ERR_NO_MEM;
+   if(AVI->a_chans)
+   {
+      ai = (audio_index_entry *)malloc(AVI->n_idx*sizeof(audio_index_entry));
+      if(ai == NULL) { free(vi); return AVI_ERR_NO_MEM; }
+   }
+
+   vtag = AVI_FCC_FOLD(AVI->video_tag) & 0x00ffffff;
+   atag = AVI_FCC_FOLD(AVI->audio_tag);
+   ioff = idx_type == 1 ? 8 : AVI->input->movi_start+4;
+   nvi = nai = 0;
+   tot = 0;
+
+   for(i=0;i<AVI->n_idx;i++)
+   {
+      t = AVI_FCC_FOLD(AVI->idx[i]);
+      if((t & 0x00ffffff) == vtag)
+      {
+         vi[nvi].pos = str2ulong(AVI->idx[i]+ 8)+ioff;
+         vi[nvi].len = str2ulong(AVI->idx[i]+12);
+         vi[nvi].key = str2ulong(AVI->idx[i]+ 4);
+         nvi++;
+      }
+      else if(ai && t == atag)
+      {
+         ai[nai].pos = str2ulong(AVI->idx[i]+ 8)+ioff;
+         ai[nai].len = str2ulong(AVI->idx[i]+12);
+         ai[nai].tot = tot;
+         tot += ai[nai].len;
+         nai++;
+      }
+   }
+
+   if(nvi == 0)
+   {
+      free(vi);
+      free(ai);
+      return AVI_ERR_NO_VIDS;
+   }
+
+   /* give back what the other stream's entries took */
+   if((p = realloc(vi, nvi*sizeof(video_index_entry))) != NULL) vi = p;
+   AVI->input->video_index = vi;
+   if(nai)
+   {
+      if((p = realloc(ai, nai*sizeof(audio_index_entry))) != NULL) ai = p;
+      AVI->input->audio_index = ai;
+   }
+   else
+      free(ai);
+
+   AVI->video_frames = nvi;
+   AVI->audio_chunks = nai;
+   AVI->audio_bytes  = tot;
+
+   return 0;
+}
+
+/* avi_t of a reader with its avi_input_t behind it, freed together */
+
+static avi_t *avi_alloc(int input)
+{
+   avi_t *AVI;
+
+   AVI = (avi_t *)calloc(1, sizeof(avi_t) + (input ? sizeof(avi_input_t) : 0));
+   if(AVI != NULL && input) AVI->input = (avi_input_t *)(AVI + 1);
+   return AVI;
+}
+
 avi_t *AVI_open_input_file(char *filename, int getIndex)
+{
+   return AVI_open_input_indexfile(filename, getIndex, NULL);
+}
+
+avi_t *AVI_open_input_indexfile(char *filename, int getIndex, char *indexfile)
 {
    avi_t *AVI;
    long i, n, rate, scale, idx_type;
    unsigned char *hdrl_data;
    long hdrl_len;
-   long nvi, nai, ioff;
-   long tot;
+   unsigned char *head;
+   long head_len;
+   off_t off, idx1_off, side_movi, tsix_off, hdrl_off;
+   off_t indx_off[2] = { 0, 0 };
+   long indx_len[2] = { 0, 0 };
+   long tsix_len;
+   struct stat st;
+   u32 fcc, vtag;
+   int fd, err;
    int lasttag = 0;
+   int strl = 0;
    int vids_strh_seen = 0;
    int vids_strf_seen = 0;
    int auds_strh_seen = 0;
    int auds_strf_seen = 0;
    int num_stream = 0;
    char data[256];
-   int iFpos=0;
    /* Create avi_t structure */
 
 
-   AVI = (avi_t *) malloc(sizeof(avi_t));
+   AVI = avi_alloc(1);
    if(AVI==NULL)
    {
       AVI_errno = AVI_ERR_NO_MEM;
       return 0;
    }
-   memset((void *)AVI,0,sizeof(avi_t));
 
    AVI->mode = AVI_MODE_READ; /* open for reading */
+   AVI->input->index_file = indexfile;
 
    /* Open the file */
 #ifdef FILE_OP
@@ -2003,143 +5894,135 @@ avi_t *AVI_open_input_file(char *filename, int getIndex)
    }
 
 #endif
-   /* Read first 12 bytes and check that this is an AVI file */
-
-#ifdef  FILE_OP
-      if( fread( data,12,1,AVI->fpFile) != SUCCESS ) ERR_EXIT(AVI_ERR_READ)
+   fd = avi_read_fd(AVI);
+   if(fstat(fd, &st) < 0) ERR_EXIT(AVI_ERR_READ)
 
-#else
+   /* An up to date sidecar saves reading and parsing idx1 */
+   side_movi = 0;
+   if(getIndex && indexfile && avi_sidecar_load(AVI, indexfile, &st) == 0)
+      side_movi = AVI->input->movi_start;
 
-   if( read(AVI->fdes,data,12) != 12 ) ERR_EXIT(AVI_ERR_READ)
-   	
-#endif
+   /* Read the head of the file and check that this is an AVI file */
 
-   if( strncasecmp(data  ,"RIFF",4) !=0 ||
-       strncasecmp(data+8,"AVI ",4) !=0 ) ERR_EXIT(AVI_ERR_NO_AVI)
+   head = (unsigned char *)malloc(AVI_OPEN_HEAD_BYTES);
+   if(head == NULL) ERR_EXIT(AVI_ERR_NO_MEM)
+   head_len = pread(fd, head, AVI_OPEN_HEAD_BYTES, 0);
+   hdrl_data = 0;
+   hdrl_len = 0;
+   hdrl_off = 0;
+   idx1_off = 0;
+   tsix_off = 0;
+   tsix_len = 0;
+   err = AVI_ERR_READ;
+   if(head_len < 12) goto __exit_open;
+
+   err = AVI_ERR_NO_AVI;
+   if(AVI_FCC_FOLD(head  ) != AVI_FCC('r','i','f','f') ||
+      AVI_FCC_FOLD(head+8) != AVI_FCC('a','v','i',' ')) goto __exit_open;
 
    /* Go through the AVI file and extract the header list,
       the start position of the 'movi' list and an optionally
       present idx1 tag */
 
-   hdrl_data = 0;
+   AVI->input->movi_start = 0;
 
-   while(1)
+   for(off = 12;;)
    {
-
-#ifdef FILE_OP
-         if( fread(data,8,1,AVI->fpFile) != SUCCESS ) break; /* We assume it's EOF */
-#else   
-      if( read(AVI->fdes,data,8) != 8 ) break; /* We assume it's EOF */
-#endif
+      if(avi_open_pread(fd, head, head_len, off, data, 8)) break; /* We assume it's EOF */
       n = str2ulong((unsigned char *)data+4);
       n = PAD_EVEN(n);
+      off += 8;
 
-      if(strncasecmp(data,"LIST",4) == 0)
+      fcc = AVI_FCC_FOLD(data);
+      if(fcc == AVI_FCC('l','i','s','t'))
       {
-#ifdef FILE_OP
-         if( fread(data,4,1,AVI->fpFile) != SUCCESS ) ERR_EXIT(AVI_ERR_READ)
-#else
-         if( read(AVI->fdes,data,4) != 4 ) ERR_EXIT(AVI_ERR_READ)
-#endif		 	
+         err = AVI_ERR_READ;
+         if(avi_open_pread(fd, head, head_len, off, data, 4)) goto __exit_open;
+         off += 4;
          n -= 4;
-         if(strncasecmp(data,"hdrl",4) == 0)
+
+         fcc = AVI_FCC_FOLD(data);
+         if(fcc == AVI_FCC('h','d','r','l') && !hdrl_data)
          {
+            hdrl_off = off;
             hdrl_len = n;
             hdrl_data = (unsigned char *) malloc(n);
-            if(hdrl_data==0) ERR_EXIT(AVI_ERR_NO_MEM)
-#ifdef FILE_OP
-          if( fread( hdrl_data,n,1,AVI->fpFile) != SUCCESS ) ERR_EXIT(AVI_ERR_READ)
-
-#else
-            if( read(AVI->fdes,hdrl_data,n) != n ) ERR_EXIT(AVI_ERR_READ)
-#endif				
-         }
-         else if(strncasecmp(data,"movi",4) == 0)
-         {
-#ifdef FILE_OP    
-            fseek(AVI->fpFile,0,SEEK_CUR);
-            AVI->movi_start = ftell(AVI->fpFile);
-            fseek(AVI->fpFile,n,SEEK_CUR);
-#else
-              AVI->movi_start = lseek(AVI->fdes,0,SEEK_CUR);
-            lseek(AVI->fdes,n,SEEK_CUR);
-#endif
+            err = AVI_ERR_NO_MEM;
+            if(hdrl_data==0) goto __exit_open;
+            err = AVI_ERR_READ;
+            if(avi_open_pread(fd, head, head_len, off, hdrl_data, n)) goto __exit_open;
          }
-         else
-#ifdef FILE_OP		 	
-            fseek(AVI->fpFile,n,SEEK_CUR);
-#else
-            lseek(AVI->fdes,n,SEEK_CUR);
-
-#endif
+         else if(fcc == AVI_FCC('m','o','v','i') && !AVI->input->movi_start)
+            AVI->input->movi_start = off;
       }
-      else if(strncasecmp(data,"idx1",4) == 0)
+      else if(fcc == AVI_FCC('i','d','x','1'))
       {
          /* n must be a multiple of 16, but the reading does not
             break if this is not the case */
 
+         idx1_off = off;
          AVI->n_idx = AVI->max_idx = n/16;
-         AVI->idx = (unsigned  char((*)[16]) ) malloc(n);
-         if(AVI->idx==0) ERR_EXIT(AVI_ERR_NO_MEM)
-#ifdef FILE_OP
-                if( fread( AVI->idx,n,1,AVI->fpFile) != SUCCESS ) ERR_EXIT(AVI_ERR_READ)
-
-#else
-         if( read(AVI->fdes,AVI->idx,n) != n ) ERR_EXIT(AVI_ERR_READ)
-#endif		 	
       }
-      else
-#ifdef FILE_OP	  	
-         fseek(AVI->fpFile,n,SEEK_CUR);
-#else
-        lseek(AVI->fdes,n,SEEK_CUR);
-
-#endif
+      else if(fcc == AVI_FCC('t','s','i','x'))
+      {
+         tsix_off = off;
+         tsix_len = n;
+      }
+      off += n;
    }
 
-   if(!hdrl_data      ) ERR_EXIT(AVI_ERR_NO_HDRL)
-   if(!AVI->movi_start) ERR_EXIT(AVI_ERR_NO_MOVI)
+   free(head);
+   head = NULL;
+
+   err = AVI_ERR_NO_HDRL;
+   if(!hdrl_data      ) goto __exit_open;
+   err = AVI_ERR_NO_MOVI;
+   if(!AVI->input->movi_start) goto __exit_open;
 
    /* Interpret the header list */
 
    for(i=0;i<hdrl_len;)
    {
+      fcc = AVI_FCC_FOLD(hdrl_data+i);
+
       /* List tags are completly ignored */
 
-      if(strncasecmp((char *)hdrl_data+i,"LIST",4)==0) { i+= 12; continue; }
+      if(fcc == AVI_FCC('l','i','s','t')) { i+= 12; continue; }
 
       n = str2ulong(hdrl_data+i+4);
       n = PAD_EVEN(n);
 
       /* Interpret the tag and its args */
 
-      if(strncasecmp((char *)hdrl_data+i,"strh",4)==0)
+      if(fcc == AVI_FCC('s','t','r','h'))
       {
          i += 8;
-         if(strncasecmp((char *)hdrl_data+i,"vids",4) == 0 && !vids_strh_seen)
+         fcc = AVI_FCC_FOLD(hdrl_data+i);
+         if(fcc == AVI_FCC('v','i','d','s') && !vids_strh_seen)
          {
             memcpy(AVI->compressor,hdrl_data+i+4,4);
             AVI->compressor[4] = 0;
             scale = str2ulong(hdrl_data+i+20);
             rate  = str2ulong(hdrl_data+i+24);
             if(scale!=0) AVI->fps = (double)rate/(double)scale;
-            AVI->video_frames = str2ulong(hdrl_data+i+32);
+            if(!AVI->input->video_index) AVI->video_frames = str2ulong(hdrl_data+i+32);
             AVI->video_strn = num_stream;
             vids_strh_seen = 1;
             lasttag = 1; /* vids */
          }
-         else if (strncasecmp ((char *)hdrl_data+i,"auds",4) ==0 && ! auds_strh_seen)
+         else if (fcc == AVI_FCC('a','u','d','s') && ! auds_strh_seen)
          {
-            AVI->audio_bytes = str2ulong(hdrl_data+i+32)*avi_sampsize(AVI);
+            if(!AVI->input->video_index) AVI->audio_bytes = str2ulong(hdrl_data+i+32)*avi_sampsize(AVI);
             AVI->audio_strn = num_stream;
             auds_strh_seen = 1;
             lasttag = 2; /* auds */
          }
          else
             lasttag = 0;
+         strl = lasttag;
          num_stream++;
       }
-      else if(strncasecmp((char *)hdrl_data+i,"strf",4)==0)
+      else if(fcc == AVI_FCC('s','t','r','f'))
       {
          i += 8;
          if(lasttag == 1)
@@ -2158,6 +6041,17 @@ avi_t *AVI_open_input_file(char *filename, int getIndex)
          }
          lasttag = 0;
       }
+      else if(fcc == AVI_FCC('i','n','d','x'))
+      {
+         /* OpenDML super index of the stream of this strl */
+         i += 8;
+         if(strl && !indx_off[strl-1])
+         {
+            indx_off[strl-1] = hdrl_off + i;
+            indx_len[strl-1] = n;
+         }
+         lasttag = 0;
+      }
       else
       {
          i += 8;
@@ -2168,8 +6062,10 @@ avi_t *AVI_open_input_file(char *filename, int getIndex)
    }
 
    free(hdrl_data);
+   hdrl_data = NULL;
 
-   if(!vids_strh_seen || !vids_strf_seen || AVI->video_frames==0) ERR_EXIT(AVI_ERR_NO_VIDS)
+   err = AVI_ERR_NO_VIDS;
+   if(!vids_strh_seen || !vids_strf_seen || AVI->video_frames==0) goto __exit_open;
 
    AVI->video_tag[0] = AVI->video_strn/10 + '0';
    AVI->video_tag[1] = AVI->video_strn%10 + '0';
@@ -2185,15 +6081,42 @@ avi_t *AVI_open_input_file(char *filename, int getIndex)
    AVI->audio_tag[3] = 'b';
 
 #ifdef FILE_OP
-      fseek(AVI->fpFile,AVI->movi_start,SEEK_SET);
+      fseek(AVI->fpFile,AVI->input->movi_start,SEEK_SET);
 #else
-      lseek(AVI->fdes,AVI->movi_start,SEEK_SET);
+      lseek(AVI->fdes,AVI->input->movi_start,SEEK_SET);
 
 #endif
    /* get index if wanted */
 
    if(!getIndex) return AVI;
 
+   /* the sidecar belongs to another file if its movi list is elsewhere */
+
+   if(AVI->input->video_index)
+   {
+      if(side_movi == AVI->input->movi_start) goto __exit_index;
+
+      free(AVI->input->video_index);
+      free(AVI->input->audio_index);
+      AVI->input->video_index = NULL;
+      AVI->input->audio_index = NULL;
+   }
+
+   err = avi_odml_build_index(AVI, fd, indx_off, indx_len);
+   if(err == 0)
+   {
+      AVI->n_idx = AVI->max_idx = 0;
+      goto __exit_built;
+   }
+   if(err != 1) ERR_EXIT(err)
+
+   if(idx1_off && AVI->n_idx > 0)
+   {
+      AVI->idx = (unsigned  char((*)[16]) ) malloc(AVI->n_idx*16);
+      if(AVI->idx==0) ERR_EXIT(AVI_ERR_NO_MEM)
+      if(avi_pread(fd, (char *)AVI->idx, AVI->n_idx*16, idx1_off)) ERR_EXIT(AVI_ERR_READ)
+   }
+
    /* if the file has an idx1, check if this is relative
       to the start of the file or to the start of the movi list */
 
@@ -2206,33 +6129,22 @@ avi_t *AVI_open_input_file(char *filename, int getIndex)
       /* Search the first videoframe in the idx1 and look where
          it is in the file */
 
+      vtag = AVI_FCC_FOLD(AVI->video_tag) & 0x00ffffff;
       for(i=0;i<AVI->n_idx;i++)
-         if( strncasecmp((char*)AVI->idx[i],AVI->video_tag,3)==0 ) break;
+         if( (AVI_FCC_FOLD(AVI->idx[i]) & 0x00ffffff) == vtag ) break;
       if(i>=AVI->n_idx) ERR_EXIT(AVI_ERR_NO_VIDS)
 
       pos = str2ulong(AVI->idx[i]+ 8);
       len = str2ulong(AVI->idx[i]+12);
-#ifdef FILE_OP
-      fseek(AVI->fpFile,pos,SEEK_SET);
-      if(fread( data,8,1,AVI->fpFile)!=SUCCESS) ERR_EXIT(AVI_ERR_READ)
-#else
-     lseek(AVI->fdes,pos,SEEK_SET);
-      if(read(AVI->fdes,data,8)!=8) ERR_EXIT(AVI_ERR_READ)
-#endif
-      if( strncasecmp((char*)data,(char*)AVI->idx[i],4)==0 && str2ulong((unsigned char*)data+4)==len )
+      if(avi_pread(fd, data, 8, pos)) ERR_EXIT(AVI_ERR_READ)
+      if( AVI_FCC_FOLD(data) == AVI_FCC_FOLD(AVI->idx[i]) && str2ulong((unsigned char*)data+4)==len )
       {
          idx_type = 1; /* Index from start of file */
       }
       else
       {
-#ifdef FILE_OP      
-         fseek(AVI->fpFile,pos+AVI->movi_start-4,SEEK_SET);
-         if(fread( data,8,1,AVI->fpFile)!=SUCCESS) ERR_EXIT(AVI_ERR_READ)
-#else
-         lseek(AVI->fdes,pos+AVI->movi_start-4,SEEK_SET);
-         if(read(AVI->fdes,data,8)!=8) ERR_EXIT(AVI_ERR_READ)
-#endif
-         if( strncasecmp(data,(char*)AVI->idx[i],4)==0 && str2ulong((unsigned char*)data+4)==len )
+         if(avi_pread(fd, data, 8, pos+AVI->input->movi_start-4)) ERR_EXIT(AVI_ERR_READ)
+         if( AVI_FCC_FOLD(data) == AVI_FCC_FOLD(AVI->idx[i]) && str2ulong((unsigned char*)data+4)==len )
          {
             idx_type = 2; /* Index from start of movi list */
          }
@@ -2242,123 +6154,74 @@ avi_t *AVI_open_input_file(char *filename, int getIndex)
 
    if(idx_type == 0)
    {
-      /* we must search through the file to get the index */
-#ifdef FILE_OP
-     fseek(AVI->fpFile, AVI->movi_start, SEEK_SET);
-#else
-      lseek(AVI->fdes, AVI->movi_start, SEEK_SET);
+      avi_walk_t wk;
+      off_t pos;
 
-#endif
-      AVI->n_idx = 0;
+      /* we must search through the file to get the index, an idx1
+         that doesn't match the file is dropped, the entries found
+         go into index pages */
+      avi_idx_free(AVI);
+      if(avi_walk_init(&wk, fd, AVI->input->movi_start)) ERR_EXIT(AVI_ERR_NO_MEM)
 
-      while(1)
+      while(avi_walk_next(&wk, (unsigned char *)data, &pos))
       {
-#ifdef FILE_OP      
-         if( fread( data,8,1,AVI->fpFile) != SUCCESS ) break;
-#else
-        if( read(AVI->fdes,data,8) != 8 ) break;
-
-#endif
          n = str2ulong((unsigned char*)data+4);
+         fcc = AVI_FCC_FOLD(data);
 
-         /* The movi list may contain sub-lists, ignore them */
+         /* The movi list may contain sub-lists, ignore them, and
+            go on into the RIFF 'AVIX' segments of OpenDML */
 
-         if(strncasecmp(data,"LIST",4)==0)
+         if(fcc == AVI_FCC('l','i','s','t') || fcc == AVI_FCC('r','i','f','f'))
          {
-
-#ifdef FILE_OP		 
-            fseek(AVI->fpFile,4,SEEK_CUR);
-#else
-             lseek(AVI->fdes,4,SEEK_CUR);
-
-#endif
+            wk.off += 4;
             continue;
          }
 
          /* Check if we got a tag ##db, ##dc or ##wb */
 
-         if( ( (data[2]=='d' || data[2]=='D') &&
-               (data[3]=='b' || data[3]=='B' || data[3]=='c' || data[3]=='C') )
-          || ( (data[2]=='w' || data[2]=='W') &&
-               (data[3]=='b' || data[3]=='B') ) )
+         fcc >>= 16;
+         if(fcc == AVI_FCC('d','b',0,0) || fcc == AVI_FCC('d','c',0,0) ||
+            fcc == AVI_FCC('w','b',0,0))
          {
-
-#ifdef FILE_OP
-                iFpos=ftell(AVI->fpFile);
-                avi_add_index_entry(AVI,(unsigned char*)data,0,iFpos-8,n);
-
-#else
-            avi_add_index_entry(AVI,data,0,lseek(AVI->fdes,0,SEEK_CUR)-8,n);
-#endif
+            if(avi_add_index_entry(AVI,(unsigned char*)data,0,pos,n))
+            {
+               avi_walk_free(&wk);
+               ERR_EXIT(AVI_ERR_NO_MEM)
+            }
          }
-#ifdef FILE_OP
-         fseek(AVI->fpFile,PAD_EVEN(n),SEEK_CUR);
-#else
-                 lseek(AVI->fdes,PAD_EVEN(n),SEEK_CUR);
-
-#endif
+         wk.off += PAD_EVEN(n);
       }
+      avi_walk_free(&wk);
+      if(avi_idx_flatten(AVI)) ERR_EXIT(AVI_ERR_NO_MEM)
       idx_type = 1;
    }
 
    /* Now generate the video index and audio index arrays */
 
-   nvi = 0;
-   nai = 0;
-
-   for(i=0;i<AVI->n_idx;i++)
-   {
-      if(strncasecmp((char *)AVI->idx[i],AVI->video_tag,3) == 0) nvi++;
-      if(strncasecmp((char *)AVI->idx[i],AVI->audio_tag,4) == 0) nai++;
-   }
-
-   AVI->video_frames = nvi;
-   AVI->audio_chunks = nai;
-
-   if(AVI->video_frames==0) ERR_EXIT(AVI_ERR_NO_VIDS)
-   AVI->video_index = (video_index_entry *) malloc(nvi*sizeof(video_index_entry));
-   if(AVI->video_index==0) ERR_EXIT(AVI_ERR_NO_MEM)
-   if(AVI->audio_chunks)
-   {
-      AVI->audio_index = (audio_index_entry *) malloc(nai*sizeof(audio_index_entry));
-      if(AVI->audio_index==0) ERR_EXIT(AVI_ERR_NO_MEM)
-   }
-
-   nvi = 0;
-   nai = 0;
-   tot = 0;
-   ioff = idx_type == 1 ? 8 : AVI->movi_start+4;
+   err = avi_build_index(AVI, idx_type);
+   if(err) ERR_EXIT(err)
 
-   for(i=0;i<AVI->n_idx;i++)
-   {
-      if(strncasecmp((char *)AVI->idx[i],AVI->video_tag,3) == 0)
-      {
-         AVI->video_index[nvi].pos = str2ulong(AVI->idx[i]+ 8)+ioff;
-         AVI->video_index[nvi].len = str2ulong(AVI->idx[i]+12);
-         nvi++;
-      }
-      if(strncasecmp((char *)AVI->idx[i],AVI->audio_tag,4) == 0)
-      {
-         AVI->audio_index[nai].pos = str2ulong(AVI->idx[i]+ 8)+ioff;
-         AVI->audio_index[nai].len = str2ulong(AVI->idx[i]+12);
-         AVI->audio_index[nai].tot = tot;
-         tot += AVI->audio_index[nai].len;
-         nai++;
-      }
-   }
+__exit_built:
+   if(indexfile) avi_sidecar_save(AVI, indexfile, &st);
 
-   AVI->audio_bytes = tot;
+__exit_index:
+   if(tsix_off) avi_tsix_load(AVI, fd, tsix_off, tsix_len);
 
    /* Reposition the file */
 #ifdef FILE_OP
-      fseek(AVI->fpFile,AVI->movi_start,SEEK_SET);
+      fseek(AVI->fpFile,AVI->input->movi_start,SEEK_SET);
 
 #else
-   lseek(AVI->fdes,AVI->movi_start,SEEK_SET);
+   lseek(AVI->fdes,AVI->input->movi_start,SEEK_SET);
 #endif
-   AVI->video_pos = 0;
+   AVI->input->video_pos = 0;
 
    return AVI;
+
+__exit_open:
+   free(head);
+   free(hdrl_data);
+   ERR_EXIT(err)
 }
 
 long AVI_video_frames(avi_t *AVI)
@@ -2403,140 +6266,457 @@ long AVI_audio_bytes(avi_t *AVI)
    return AVI->audio_bytes;
 }
 
-long AVI_frame_size(avi_t *AVI, long frame)
+long AVI_frame_size(avi_t *AVI, long frame)
+{
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(!AVI->input->video_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+
+   if(frame < 0 || frame >= AVI->video_frames) return 0;
+   return(AVI->input->video_index[frame].len);
+}
+
+int AVI_seek_start(avi_t *AVI)
+{
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+#ifdef FILE_OP
+   fseek(AVI->fpFile,AVI->input->movi_start,SEEK_SET);
+
+#else
+   lseek(AVI->fdes,AVI->input->movi_start,SEEK_SET);
+#endif
+   AVI->input->video_pos = 0;
+   avi_demux_rewind(AVI);
+   if(AVI->input->video_index && AVI->video_frames > 0)
+      avi_readahead_seek(AVI, AVI->input->video_index[0].pos);
+   return 0;
+}
+
+int AVI_set_video_position(avi_t *AVI, long frame)
+{
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(!AVI->input->video_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+
+   if (frame < 0 ) frame = 0;
+   AVI->input->video_pos = frame;
+   if(frame < AVI->video_frames)
+      avi_readahead_seek(AVI, AVI->input->video_index[frame].pos);
+   return 0;
+}
+      
+
+long AVI_read_frame(avi_t *AVI, char *vidbuf)
+{
+   long n;
+
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(!AVI->input->video_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+
+   if(AVI->input->video_pos < 0 || AVI->input->video_pos >= AVI->video_frames) return 0;
+   n = AVI->input->video_index[AVI->input->video_pos].len;
+   avi_readahead(AVI, AVI->input->video_index[AVI->input->video_pos].pos);
+
+   if(AVI->input->map)
+   {
+      const unsigned char *p;
+
+      avi_map_access(AVI, AVI->input->video_pos);
+      p = avi_map_view(AVI, AVI->input->video_index[AVI->input->video_pos].pos, n);
+      if(p == NULL)
+      {
+         AVI_errno = AVI_ERR_READ;
+         return -1;
+      }
+      memcpy(vidbuf, p, n);
+      AVI->input->video_pos++;
+      return n;
+   }
+
+#ifdef  FILE_OP
+
+     fseek(AVI->fpFile, AVI->input->video_index[AVI->input->video_pos].pos, SEEK_SET);
+   if (fread(vidbuf,n,1,AVI->fpFile) != SUCCESS)
+#else
+   lseek(AVI->fdes, AVI->input->video_index[AVI->input->video_pos].pos, SEEK_SET);
+   if (read(AVI->fdes,vidbuf,n) != n)
+#endif   	
+   {
+      AVI_errno = AVI_ERR_READ;
+      return -1;
+   }
+
+   AVI->input->video_pos++;
+
+   return n;
+}
+
+/* Shared by the avi_t cursor and the avi_reader_t cursors: they only
+   read the index and position the file with pread(), so several of them
+   can work on one avi_t. Errors are returned as -AVI_ERR_*. */
+
+static void avi_audio_seek(avi_t *AVI, long byte, long *posc, long *posb)
+{
+   long n0, n1, n;
+
+   if(byte < 0) byte = 0;
+
+   /* Binary search in the audio chunks */
+
+   n0 = 0;
+   n1 = AVI->audio_chunks;
+
+   while(n0<n1-1)
+   {
+      n = (n0+n1)/2;
+      if(AVI->input->audio_index[n].tot>byte)
+         n1 = n;
+      else
+         n0 = n;
+   }
+
+   *posc = n0;
+   *posb = byte - AVI->input->audio_index[n0].tot;
+}
+
+/* The chunks are read with one preadv() per run of chunks that are at
+   most AVI_AUDIO_GAP apart, the headers and other data between them go
+   to a scratch buffer. Chunks adjacent in the file and in audbuf share
+   an iovec, so a contiguous range is a single pread(). */
+
+#define AVI_AUDIO_IOV          64
+#define AVI_AUDIO_GAP          4096
+
+/* fd < 0 copies from the mapping of AVI_set_mmap */
+static long avi_audio_read(avi_t *AVI, int fd, long *posc, long *posb,
+                           char *audbuf, long bytes)
+{
+   struct iovec iov[AVI_AUDIO_IOV];
+   char gap[AVI_AUDIO_GAP];
+   const unsigned char *p;
+   long nr, left, todo, c, b;
+   off_t pos, start, end;
+   int niov;
+
+   nr = 0; /* total number of bytes read */
+   niov = 0;
+   start = end = 0; /* file range covered by iov */
+   c = *posc;
+   b = *posb;
+
+   while(bytes>0)
+   {
+      left = AVI->input->audio_index[c].len - b;
+      if(left==0)
+      {
+         if(c>=AVI->audio_chunks-1) break;
+         c++;
+         b = 0;
+         continue;
+      }
+      if(bytes<left)
+         todo = bytes;
+      else
+         todo = left;
+      pos = AVI->input->audio_index[c].pos + b;
+
+      if(fd < 0)
+      {
+         if((p = avi_map_view(AVI, pos, todo)) == NULL) return -AVI_ERR_READ;
+         memcpy(audbuf+nr, p, todo);
+      }
+      else
+      {
+         if(niov > 0 && (pos < end || pos - end > AVI_AUDIO_GAP || niov > AVI_AUDIO_IOV-2))
+         {
+            if(avi_preadv(fd, iov, niov, start)) return -AVI_ERR_READ;
+            niov = 0;
+         }
+         if(niov == 0) start = end = pos;
+
+         if(pos > end)
+         {
+            iov[niov].iov_base = gap;
+            iov[niov].iov_len  = pos - end;
+            niov++;
+         }
+         if(niov > 0 && (char *)iov[niov-1].iov_base + iov[niov-1].iov_len == audbuf+nr)
+            iov[niov-1].iov_len += todo;
+         else
+         {
+            iov[niov].iov_base = audbuf+nr;
+            iov[niov].iov_len  = todo;
+            niov++;
+         }
+         end = pos + todo;
+      }
+
+      bytes -= todo;
+      nr    += todo;
+      b     += todo;
+   }
+
+   if(niov > 0 && avi_preadv(fd, iov, niov, start)) return -AVI_ERR_READ;
+
+   *posc = c;
+   *posb = b;
+
+   return nr;
+}
+
+int AVI_set_audio_position(avi_t *AVI, long byte)
+{
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(!AVI->input->audio_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+
+   avi_audio_seek(AVI, byte, &AVI->input->audio_posc, &AVI->input->audio_posb);
+   avi_readahead_seek(AVI, AVI->input->audio_index[AVI->input->audio_posc].pos + AVI->input->audio_posb);
+
+   return 0;
+}
+
+long AVI_read_audio(avi_t *AVI, char *audbuf, long bytes)
+{
+   long nr;
+
+   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
+   if(!AVI->input->audio_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+
+   avi_readahead(AVI, AVI->input->audio_index[AVI->input->audio_posc].pos + AVI->input->audio_posb);
+   nr = avi_audio_read(AVI, AVI->input->map ? -1 : avi_read_fd(AVI),
+                       &AVI->input->audio_posc, &AVI->input->audio_posb, audbuf, bytes);
+   if(nr < 0)
+   {
+      AVI_errno = -nr;
+      return -1;
+   }
+
+   return nr;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Concurrent readers                                           *
+ *                                                                 *
+ *******************************************************************/
+
+/* The index arrays and counts of an opened avi_t are written only while
+   it is opened (idx1 or sidecar, tsix keys), so the cursors share them
+   without a lock. They never touch video_pos, audio_pos*, map, demux or
+   ra_*, which the avi_t's own read calls change. */
+
+struct avi_reader_s
+{
+   avi_t *AVI;               /* opened file, only its index is read */
+   int    fd;
+   long   video_pos;
+   long   audio_posc;
+   long   audio_posb;
+};
+
+avi_reader_t *AVI_reader_new(avi_t *AVI)
+{
+   avi_reader_t *r;
+
+   if(AVI->mode==AVI_MODE_WRITE) return NULL;
+
+   r = (avi_reader_t *)malloc(sizeof(avi_reader_t));
+   if(r == NULL) return NULL;
+   memset(r, 0, sizeof(avi_reader_t));
+   r->AVI = AVI;
+   r->fd  = avi_read_fd(AVI);
+
+   return r;
+}
+
+void AVI_reader_free(avi_reader_t *r)
+{
+   free(r);
+}
+
+int AVI_reader_set_video_position(avi_reader_t *r, long frame)
+{
+   if(!r->AVI->input->video_index) return -AVI_ERR_NO_IDX;
+
+   if(frame < 0) frame = 0;
+   r->video_pos = frame;
+   return 0;
+}
+
+long AVI_reader_read_frame(avi_reader_t *r, char *vidbuf)
 {
-   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
-   if(!AVI->video_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+   avi_t *AVI = r->AVI;
+   long n;
 
-   if(frame < 0 || frame >= AVI->video_frames) return 0;
-   return(AVI->video_index[frame].len);
+   if(!AVI->input->video_index) return -AVI_ERR_NO_IDX;
+
+   if(r->video_pos >= AVI->video_frames) return 0;
+   n = AVI->input->video_index[r->video_pos].len;
+
+   if(avi_pread(r->fd, vidbuf, n, AVI->input->video_index[r->video_pos].pos))
+      return -AVI_ERR_READ;
+
+   r->video_pos++;
+
+   return n;
 }
 
-int AVI_seek_start(avi_t *AVI)
+int AVI_reader_set_audio_position(avi_reader_t *r, long byte)
 {
-   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
-#ifdef FILE_OP
-   fseek(AVI->fpFile,AVI->movi_start,SEEK_SET);
+   if(!r->AVI->input->audio_index) return -AVI_ERR_NO_IDX;
+
+   avi_audio_seek(r->AVI, byte, &r->audio_posc, &r->audio_posb);
 
-#else
-   lseek(AVI->fdes,AVI->movi_start,SEEK_SET);
-#endif
-   AVI->video_pos = 0;
    return 0;
 }
 
-int AVI_set_video_position(avi_t *AVI, long frame)
+long AVI_reader_read_audio(avi_reader_t *r, char *audbuf, long bytes)
 {
-   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
-   if(!AVI->video_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+   if(!r->AVI->input->audio_index) return -AVI_ERR_NO_IDX;
 
-   if (frame < 0 ) frame = 0;
-   AVI->video_pos = frame;
-   return 0;
+   return avi_audio_read(r->AVI, r->fd, &r->audio_posc, &r->audio_posb,
+                         audbuf, bytes);
 }
-      
 
-long AVI_read_frame(avi_t *AVI, char *vidbuf)
-{
-   long n;
+/*******************************************************************
+ *                                                                 *
+ *    Sequential demuxer                                           *
+ *                                                                 *
+ *******************************************************************/
 
-   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
-   if(!AVI->video_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+/* AVI_read_data parses the chunk headers from AVI_DEMUX_BYTES blocks
+   read with pread and copies the payload out of them. It keeps its
+   own position, starting where the file offset was on the first call;
+   AVI_seek_start moves it back to the movi list. A chunk that runs past
+   the end of the file, or is larger than AVI_DEMUX_MAX for the view,
+   ends the data: its length is garbage, not something to allocate. */
 
-   if(AVI->video_pos < 0 || AVI->video_pos >= AVI->video_frames) return 0;
-   n = AVI->video_index[AVI->video_pos].len;
+#define AVI_DEMUX_BYTES        (1024*1024)
+#define AVI_DEMUX_MAX          (64*1024*1024)
 
-#ifdef  FILE_OP
+typedef struct
+{
+   unsigned char *buf;
+   long   size;              /* of buf */
+   long   len;               /* valid bytes in buf */
+   off_t  buf_off;           /* file offset of buf[0] */
+   off_t  off;               /* next chunk header */
+   off_t  file_size;         /* when last checked */
+} avi_demux_t;
+
+static avi_demux_t *avi_demux_get(avi_t *AVI)
+{
+   avi_demux_t *d = (avi_demux_t *)AVI->input->demux;
 
-     fseek(AVI->fpFile, AVI->video_index[AVI->video_pos].pos, SEEK_SET);
-   if (fread(vidbuf,n,1,AVI->fpFile) != SUCCESS)
-#else
-   lseek(AVI->fdes, AVI->video_index[AVI->video_pos].pos, SEEK_SET);
-   if (read(AVI->fdes,vidbuf,n) != n)
-#endif   	
+   if(d != NULL) return d;
+
+   d = (avi_demux_t *)malloc(sizeof(avi_demux_t));
+   if(d == NULL) return NULL;
+   memset(d, 0, sizeof(avi_demux_t));
+   d->buf = (unsigned char *)malloc(AVI_DEMUX_BYTES);
+   if(d->buf == NULL)
    {
-      AVI_errno = AVI_ERR_READ;
-      return -1;
+      free(d);
+      return NULL;
    }
+   d->size = AVI_DEMUX_BYTES;
+#ifdef FILE_OP
+   d->off = ftell(AVI->fpFile);
+#else
+   d->off = lseek(AVI->fdes, 0, SEEK_CUR);
+#endif
+   AVI->input->demux = d;
 
-   AVI->video_pos++;
-
-   return n;
+   return d;
 }
 
-int AVI_set_audio_position(avi_t *AVI, long byte)
+static void avi_demux_rewind(avi_t *AVI)
 {
-   long n0, n1, n;
+   avi_demux_t *d = (avi_demux_t *)AVI->input->demux;
 
-   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
-   if(!AVI->audio_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
+   if(d != NULL) d->off = AVI->input->movi_start;
+}
 
-   if(byte < 0) byte = 0;
+static void avi_demux_free(avi_t *AVI)
+{
+   avi_demux_t *d = (avi_demux_t *)AVI->input->demux;
 
-   /* Binary search in the audio chunks */
+   if(d == NULL) return;
+   free(d->buf);
+   free(d);
+   AVI->input->demux = NULL;
+}
 
-   n0 = 0;
-   n1 = AVI->audio_chunks;
+/* Returns the n bytes at off from the buffer, reading them if needed,
+   NULL at the end of the file */
+static unsigned char *avi_demux_fill(avi_t *AVI, avi_demux_t *d, off_t off, long n)
+{
+   unsigned char *buf;
+   ssize_t r;
 
-   while(n0<n1-1)
+   if(off >= d->buf_off && off + n <= d->buf_off + d->len)
+      return d->buf + (off - d->buf_off);
+
+   if(n > d->size)
    {
-      n = (n0+n1)/2;
-      if(AVI->audio_index[n].tot>byte)
-         n1 = n;
-      else
-         n0 = n;
+      buf = (unsigned char *)realloc(d->buf, n);
+      if(buf == NULL) return NULL;
+      d->buf = buf;
+      d->size = n;
    }
 
-   AVI->audio_posc = n0;
-   AVI->audio_posb = byte - AVI->audio_index[n0].tot;
+   do
+      r = pread(avi_read_fd(AVI), d->buf, d->size, off);
+   while(r < 0 && errno == EINTR);
+   d->buf_off = off;
+   d->len = r > 0 ? r : 0;
 
-   return 0;
+   return d->len >= n ? d->buf : NULL;
 }
 
-long AVI_read_audio(avi_t *AVI, char *audbuf, long bytes)
+/* Move to the next video or audio chunk, returns 1 for video, 2 for
+   audio with the padded length in len, 0 at the end of the file */
+static int avi_demux_next(avi_t *AVI, avi_demux_t *d, long *len)
 {
-   long nr, pos, left, todo;
-
-   if(AVI->mode==AVI_MODE_WRITE) { AVI_errno = AVI_ERR_NOT_PERM; return -1; }
-   if(!AVI->audio_index)         { AVI_errno = AVI_ERR_NO_IDX;   return -1; }
-
-   nr = 0; /* total number of bytes read */
+   unsigned char *h;
+   struct stat st;
+   u32 fcc;
+   long n;
 
-   while(bytes>0)
+   while((h = avi_demux_fill(AVI, d, d->off, 8)) != NULL)
    {
-      left = AVI->audio_index[AVI->audio_posc].len - AVI->audio_posb;
-      if(left==0)
+      fcc = AVI_FCC_FOLD(h);
+      n = PAD_EVEN(str2ulong(h+4));
+
+      /* the file may have grown since the last check */
+      if(fcc != AVI_FCC('l','i','s','t') && fcc != AVI_FCC('r','i','f','f') &&
+         d->off + 8 + n > d->file_size)
       {
-         if(AVI->audio_posc>=AVI->audio_chunks-1) return nr;
-         AVI->audio_posc++;
-         AVI->audio_posb = 0;
-         continue;
+         if(fstat(avi_read_fd(AVI), &st) == 0) d->file_size = st.st_size;
+         if(d->off + 8 + n > d->file_size) return 0;
       }
-      if(bytes<left)
-         todo = bytes;
-      else
-         todo = left;
-      pos = AVI->audio_index[AVI->audio_posc].pos + AVI->audio_posb;
+      d->off += 8;
 
+      /* if we got a list tag or a RIFF 'AVIX' of OpenDML, ignore it */
 
-#ifdef FILE_OP 
-         fseek(AVI->fpFile, pos, SEEK_SET);
-      if (fread( audbuf+nr,todo,1,AVI->fpFile) != SUCCESS)
+      if(fcc == AVI_FCC('l','i','s','t') || fcc == AVI_FCC('r','i','f','f'))
+      {
+         d->off += 4;
+         continue;
+      }
 
-#else	  
-      lseek(AVI->fdes, pos, SEEK_SET);
-      if (read(AVI->fdes,audbuf+nr,todo) != todo)
-#endif	  	
+      if((fcc & 0x00ffffff) == (AVI_FCC_FOLD(AVI->video_tag) & 0x00ffffff))
       {
-         AVI_errno = AVI_ERR_READ;
-         return -1;
+         *len = n;
+         return 1;
       }
-      bytes -= todo;
-      nr    += todo;
-      AVI->audio_posb += todo;
+      if(fcc == AVI_FCC_FOLD(AVI->audio_tag))
+      {
+         *len = n;
+         return 2;
+      }
+      d->off += n;
    }
 
-   return nr;
+   return 0;
 }
 
 /* AVI_read_data: Special routine for reading the next audio or video chunk
@@ -2557,88 +6737,371 @@ int AVI_read_data(avi_t *AVI, char *vidbuf, long max_vidbuf,
  *   -2 = audio buffer too small
  */
 
-   int n;
-   char data[8];
+   avi_demux_t *d;
+   unsigned char *p;
+   char *buf;
+   long n;
+   int ret;
 
    if(AVI->mode==AVI_MODE_WRITE) return 0;
+   if((d = avi_demux_get(AVI)) == NULL) { AVI_errno = AVI_ERR_NO_MEM; return 0; }
 
-   while(1)
+   ret = avi_demux_next(AVI, d, &n);
+   if(ret == 0) return 0;
+
+   *len = n;
+   if(ret == 1)
    {
-      /* Read tag and length */
+      AVI->input->video_pos++;
+      buf = vidbuf;
+      if(n>max_vidbuf) ret = -1;
+   }
+   else
+   {
+      buf = audbuf;
+      if(n>max_audbuf) ret = -2;
+   }
+   if(ret < 0)
+   {
+      d->off += n;
+      return ret;
+   }
 
-#ifdef FILE_OP
-          if( fread(data,8,1,AVI->fpFile) != SUCCESS ) return 0;
+   /* a chunk larger than the buffer goes straight to the caller */
+   if(n > d->size)
+   {
+      if(avi_pread(avi_read_fd(AVI), buf, n, d->off)) return 0;
+   }
+   else
+   {
+      if((p = avi_demux_fill(AVI, d, d->off, n)) == NULL) return 0;
+      memcpy(buf, p, n);
+   }
+   d->off += n;
+
+   return ret;
+}
+
+int AVI_read_data_view(avi_t *AVI, const unsigned char **data, long *len)
+{
+   avi_demux_t *d;
+   unsigned char *p;
+   long n;
+   int ret;
+
+   if(AVI->mode==AVI_MODE_WRITE) return 0;
+   if((d = avi_demux_get(AVI)) == NULL) { AVI_errno = AVI_ERR_NO_MEM; return 0; }
+
+   ret = avi_demux_next(AVI, d, &n);
+   if(ret == 0) return 0;
+   if(n > AVI_DEMUX_MAX)
+   {
+      d->off -= 8;           /* stays the end */
+      return 0;
+   }
+   if((p = avi_demux_fill(AVI, d, d->off, n)) == NULL) return 0;
+   if(ret == 1) AVI->input->video_pos++;
+
+   *data = p;
+   *len = n;
+   d->off += n;
+
+   return ret;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Clips                                                        *
+ *                                                                 *
+ *******************************************************************/
+
+/* Trim and concat copy the movi bytes of frame ranges into the output
+   with copy_file_range(), which shares the blocks on filesystems with
+   reflinks, and only write header and idx1 themselves. A range runs
+   from the chunk header of its first frame up to the header of the
+   frame behind it, so the interleaved audio chunks go along. */
+
+#define AVI_CLIP_COPY_BYTES    (1024*1024)
 
+static ssize_t avi_copy_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len)
+{
+#ifdef __NR_copy_file_range
+   return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, off_out, len, 0);
 #else
-      if( read(AVI->fdes,data,8) != 8 ) return 0;
+   errno = ENOSYS;
+   return -1;
 #endif
-      /* if we got a list tag, ignore it */
+}
+
+static int avi_clip_copy(int fd_in, off_t off_in, int fd_out, off_t off_out, off_t len)
+{
+   char *buf;
+   ssize_t n;
+   long m;
 
-      if(strncasecmp(data,"LIST",4) == 0)
+   while(len > 0)
+   {
+      n = avi_copy_range(fd_in, &off_in, fd_out, &off_out, len);
+      if(n > 0) { len -= n; continue; }
+      if(n == 0) return -1;
+      if(errno == EINTR) continue;
+      if(errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) return -1;
+      break;
+   }
+   if(len == 0) return 0;
+
+   /* not between these files, through a buffer then */
+
+   if((buf = (char *)malloc(AVI_CLIP_COPY_BYTES)) == NULL) return -1;
+   while(len > 0)
+   {
+      m = len < AVI_CLIP_COPY_BYTES ? len : AVI_CLIP_COPY_BYTES;
+      if(avi_pread(fd_in, buf, m, off_in) || avi_pwrite(fd_out, buf, m, off_out) != m)
       {
-#ifdef FILE_OP
-       fseek(AVI->fpFile,4,SEEK_CUR);
+         free(buf);
+         return -1;
+      }
+      off_in  += m;
+      off_out += m;
+      len     -= m;
+   }
+   free(buf);
+   return 0;
+}
+
+/* Turn the chunks in off..end of in, which are not in the index of the
+   clip, into JUNK in out: the audio of further tracks, which the header
+   of the clip does not declare, and the indexes and RIFF 'AVIX' / LIST
+   'movi' headers between the segments of an OpenDML file. Only the tags
+   are written; such a 12 byte list header becomes a JUNK chunk of 4. */
 
-#else	  
-         lseek(AVI->fdes,4,SEEK_CUR);
-#endif		 
+static int avi_clip_junk(avi_t *out, avi_t *in, off_t off, off_t end, off_t shift)
+{
+   unsigned char c[12], j[8];
+
+   memcpy(j, "JUNK", 4);
+   long2str(j+4, 4);
+   while(off + 8 <= end)
+   {
+      if(avi_pread(in->fdes, (char *)c, 8, off)) return -1;
+      if(strncasecmp((char *)c, "RIFF", 4) == 0 || strncasecmp((char *)c, "LIST", 4) == 0)
+      {
+         if(off + 12 > end || avi_pread(in->fdes, (char *)c+8, 4, off+8)) return -1;
+         if((strncasecmp((char *)c+8, "AVIX", 4) == 0 || strncasecmp((char *)c+8, "movi", 4) == 0) &&
+            avi_pwrite(out->fdes, (char *)j, 8, off+shift) != 8)
+            return -1;
+         off += 12;
          continue;
       }
+      if(strncasecmp((char *)c, "JUNK", 4) != 0 && avi_pwrite(out->fdes, "JUNK", 4, off+shift) != 4)
+         return -1;
+      off += 8 + PAD_EVEN(str2ulong(c+4));
+   }
+   return 0;
+}
 
-      n = PAD_EVEN(str2ulong((unsigned char*)data+4));
+/* Append frames first..last-1 of in to out */
 
-      if(strncasecmp(data,AVI->video_tag,3) == 0)
-      {
-         *len = n;
-         AVI->video_pos++;
-         if(n>max_vidbuf)
-         {
-#ifdef FILE_OP
-        fseek(AVI->fpFile,n,SEEK_CUR);
+static int avi_clip_add(avi_t *out, avi_t *in, long first, long last)
+{
+   video_index_entry *vi = in->input->video_index;
+   audio_index_entry *ai = in->input->audio_index;
+   off_t begin, end, shift, pos, prev;
+   long v, a, a0, a1, n0, len;
+
+   begin = vi[first].pos - 8;
+   if(last < in->video_frames)
+      end = vi[last].pos - 8;
+   else
+   {
+      end = vi[last-1].pos + PAD_EVEN(vi[last-1].len);
+      if(in->audio_chunks > 0 && ai[in->audio_chunks-1].pos > begin &&
+         ai[in->audio_chunks-1].pos + PAD_EVEN(ai[in->audio_chunks-1].len) > end)
+         end = ai[in->audio_chunks-1].pos + PAD_EVEN(ai[in->audio_chunks-1].len);
+   }
 
-#else		 
-            lseek(AVI->fdes,n,SEEK_CUR);
-#endif			
-            return -1;
-         }
-#ifdef FILE_OP
-               if(fread(vidbuf,n,1,AVI->fpFile) != SUCCESS ) return 0;
+   /* the audio chunks within the range */
+   a0 = 0;
+   a1 = in->audio_chunks;
+   while(a0 < a1)
+   {
+      a = (a0+a1)/2;
+      if(ai[a].pos < begin) a0 = a+1; else a1 = a;
+   }
+   for(a1 = a0; a1 < in->audio_chunks && ai[a1].pos < end; a1++);
 
-#else		 
-         if(read(AVI->fdes,vidbuf,n) != n ) return 0;
-#endif		 
-         return 1;
+   if(out->pos + (end-begin) + 8 + (out->n_idx + (last-first) + (a1-a0))*16 > out->buf_len)
+   {
+      AVI_errno = AVI_ERR_SIZELIM;
+      return -1;
+   }
+
+   if(avi_clip_copy(in->fdes, begin, out->fdes, out->pos, end-begin))
+   {
+      AVI_errno = AVI_ERR_WRITE;
+      return -1;
+   }
+
+   /* index the chunks in file order, the gaps between them hold other
+      streams */
+   shift = out->pos - begin;
+   n0 = out->n_idx;
+   prev = begin;
+   for(v = first, a = a0; v < last || a < a1; )
+   {
+      if(a >= a1 || (v < last && vi[v].pos < ai[a].pos))
+      {
+         pos = vi[v].pos - 8;
+         len = vi[v].len;
+         if(avi_add_index_entry(out, (unsigned char *)"00dc", vi[v].key, pos+shift, len)) goto __exit_add;
+         out->video_frames++;
+         v++;
       }
-      else if(strncasecmp(data,AVI->audio_tag,4) == 0)
+      else
       {
-         *len = n;
-         if(n>max_audbuf)
-         {
-#ifdef FILE_OP
-            fseek(AVI->fpFile,n,SEEK_CUR);
+         pos = ai[a].pos - 8;
+         len = ai[a].len;
+         if(avi_add_index_entry(out, (unsigned char *)"01wb", 0x00, pos+shift, len)) goto __exit_add;
+         out->audio_bytes += len;
+         a++;
+      }
+      if(pos > prev && avi_clip_junk(out, in, prev, pos, shift)) goto __exit_junk;
+      prev = pos + 8 + PAD_EVEN(len);
+   }
+   if(end > prev && avi_clip_junk(out, in, prev, end, shift)) goto __exit_junk;
 
-#else		 
-            lseek(AVI->fdes,n,SEEK_CUR);
-#endif			
-            return -2;
-         }
-#ifdef  FILE_OP
-         if(fread( audbuf,n,1,AVI->fpFile) != SUCCESS ) return 0;
+   out->last_pos = vi[last-1].pos-8+shift;
+   out->last_len = vi[last-1].len;
+   out->pos += end-begin;
 
-#else		 
-         if(read(AVI->fdes,audbuf,n) != n ) return 0;
-#endif		 
-         return 2;
+   return 0;
+
+__exit_junk:
+   AVI_errno = AVI_ERR_WRITE;
+__exit_add:
+   out->n_idx = n0;
+   return -1;
+}
+
+static avi_t *avi_clip_open(char *file_name)
+{
+   avi_t *AVI;
+
+   if((AVI = AVI_open_input_file(file_name, 1)) == NULL) return NULL;
+   if(AVI->input->video_index == NULL || AVI->video_frames <= 0)
+   {
+      AVI_close_1(AVI);
+      AVI_errno = AVI_ERR_NO_IDX;
+      return NULL;
+   }
+   return AVI;
+}
+
+static avi_t *avi_clip_create(avi_t *in, char *file_name)
+{
+   avi_t *AVI;
+
+   if((AVI = avi_alloc(0)) == NULL)
+   {
+      AVI_errno = AVI_ERR_NO_MEM;
+      return NULL;
+   }
+   if(AVI_Init_fd_fast(AVI, in->width, in->height, (int)(AVI_frame_rate(in)+0.5),
+                       in->compressor, 0, file_name) < 0)
+   {
+      free(AVI);
+      AVI_errno = AVI_ERR_OPEN;
+      return NULL;
+   }
+   if(in->a_chans > 0) AVI_set_audio(AVI, in->a_chans, in->a_rate, in->a_bits, in->a_fmt);
+   return AVI;
+}
+
+static int avi_clip_finish(avi_t *AVI, char *file_name, int ok)
+{
+   int ret = -1;
+
+   if(ok)
+   {
+      ret = AVI_close_fd_1(AVI);
+      if(ret) AVI_errno = AVI_ERR_CLOSE;
+   }
+   else
+   {
+      close(AVI->fdes);
+      AVI->fdes = -1;
+      AVI_close(AVI);
+   }
+   if(ret) unlink(file_name);
+   free(AVI);
+   return ret;
+}
+
+int AVI_trim(char *in_file, char *out_file, double start, double end)
+{
+   avi_t *in, *out;
+   double fps;
+   long first, last;
+   int ret;
+
+   if((in = avi_clip_open(in_file)) == NULL) return -1;
+
+   fps = AVI_frame_rate(in) > 0 ? AVI_frame_rate(in) : 25;
+   first = start > 0 ? (long)(start*fps) : 0;
+   if(first >= in->video_frames)
+   {
+      AVI_close_1(in);
+      AVI_errno = AVI_ERR_NO_VIDS;
+      return -1;
+   }
+   first = AVI_key_before(in, first, AVI_KEY_SCAN);
+   last = end < 0 ? in->video_frames : (long)(end*fps + 0.999);
+   if(last > in->video_frames) last = in->video_frames;
+   if(last <= first) last = first + 1;
+
+   if((out = avi_clip_create(in, out_file)) == NULL)
+   {
+      AVI_close_1(in);
+      return -1;
+   }
+   ret = avi_clip_add(out, in, first, last);
+   AVI_close_1(in);
+
+   return avi_clip_finish(out, out_file, ret == 0);
+}
+
+int AVI_concat(char **in_files, int n, char *out_file)
+{
+   avi_t *in, *out = NULL;
+   int i, ret = 0;
+
+   for(i = 0; i < n && ret == 0; i++)
+   {
+      if((in = avi_clip_open(in_files[i])) == NULL)
+      {
+         ret = -1;
          break;
       }
+      if(out == NULL && (out = avi_clip_create(in, out_file)) == NULL)
+      {
+         AVI_close_1(in);
+         return -1;
+      }
+      if(in->width != out->width || in->height != out->height ||
+         strncmp(in->compressor, out->compressor, 4) != 0 ||
+         (in->a_chans > 0 && (in->a_chans != out->a_chans || in->a_rate != out->a_rate ||
+                              in->a_bits != out->a_bits || in->a_fmt != out->a_fmt)))
+      {
+         AVI_errno = AVI_ERR_NOT_PERM;
+         ret = -1;
+      }
       else
-#ifdef FILE_OP
-               if(fseek(AVI->fpFile,n,SEEK_CUR)<0)  return 0;
-
-#else
-         if(lseek(AVI->fdes,n,SEEK_CUR)<0)  return 0;
-#endif		 
+         ret = avi_clip_add(out, in, 0, in->video_frames);
+      AVI_close_1(in);
    }
+   if(out == NULL) return -1;
+
+   return avi_clip_finish(out, out_file, ret == 0);
 }
 
 /* AVI_print_error: Print most recent error (similar to perror) */
@@ -2659,7 +7122,8 @@ char *(avi_errors[]) =
   /* 11 */ "avilib - AVI file has no MOVI list (corrupted?)",
   /* 12 */ "avilib - AVI file has no video data",
   /* 13 */ "avilib - operation needs an index",
-  /* 14 */ "avilib - Unkown Error"
+  /* 14 */ "avilib - Writer busy, try again",
+  /* 15 */ "avilib - Unkown Error"
 };
 static int num_avi_errors = sizeof(avi_errors)/sizeof(char*);
 
@@ -2685,6 +7149,12 @@ void AVI_print_error(char *str)
    }
 }
 
+const char *AVI_errstr(int err)
+{
+   if(err < 0) err = -err;
+   return avi_errors[err<num_avi_errors ? err : num_avi_errors-1];
+}
+
 char *AVI_strerror()
 {
    int aerrno;
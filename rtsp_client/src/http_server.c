@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include "avilib.h"
+#include "rtsp_client.h"
+#include "rtsp_server.h"
+#include "http_server.h"
+
+#define HTTP_SERVER_NAME			"ECSINO_IPC Server"
+
+struct http_server
+{
+	struct event_base		*pstBase;
+	struct evhttp			*pstHttp;
+	char					cRootDir[256];
+};
+
+/*******************************************************************
+ *    Ranges                                                       *
+ *******************************************************************/
+
+/* Single byte range of a Range header, [*plBegin, *plEnd).
+   Returns 0 for a range, 1 to ignore the header (no bytes unit, several
+   ranges, bad syntax) and -1 if the range is not satisfiable. */
+static int http_byte_range(const char *cRange, off_t lSize, off_t *plBegin, off_t *plEnd)
+{
+	const char *p;
+	char *e;
+	long long llFirst, llLast;
+
+	if(strncasecmp(cRange, "bytes=", 6) != 0 || strchr(cRange, ',') != NULL)
+		return 1;
+	p = cRange + 6;
+	while(*p == ' ')
+		p++;
+
+	if(*p == '-')
+	{
+		/* the last n bytes */
+		llLast = strtoll(p + 1, &e, 10);
+		if(e == p + 1 || llLast < 0)
+			return 1;
+		if(llLast == 0 || lSize == 0)
+			return -1;
+		*plBegin = llLast < lSize ? lSize - llLast : 0;
+		*plEnd = lSize;
+		return 0;
+	}
+
+	llFirst = strtoll(p, &e, 10);
+	if(e == p || *e != '-' || llFirst < 0)
+		return 1;
+	p = e + 1;
+	if(*p == '\0' || *p == ' ')
+		llLast = lSize - 1;
+	else
+	{
+		llLast = strtoll(p, &e, 10);
+		if(e == p || llLast < llFirst)
+			return 1;
+		if(llLast >= lSize)
+			llLast = lSize - 1;
+	}
+	if(llFirst >= lSize)
+		return -1;
+
+	*plBegin = llFirst;
+	*plEnd = llLast + 1;
+	return 0;
+}
+
+/* Bytes of the chunks from the keyframe at or before dStart up to the
+   frame at dEnd (< 0: the last frame), [*plBegin, *plEnd). Times are
+   seconds from the first frame, counted with the frame rate like npt
+   in the RTSP server. The keyframe comes from AVI_key_before. This runs
+   on the event loop: the index is read from the sidecar the RTSP server
+   keeps next to the file, so idx1 is parsed once per file, not once
+   per request. */
+static int http_time_range(const char *cPath, double dStart, double dEnd, off_t *plBegin, off_t *plEnd)
+{
+	char cIndex[512 + sizeof(RTSP_SERVER_INDEX_EXT)];
+	avi_t *pAvi;
+	double dFps;
+	long lFrames, lFirst, lLast;
+
+	if(snprintf(cIndex, sizeof(cIndex), "%s%s", cPath, RTSP_SERVER_INDEX_EXT) >= (int)sizeof(cIndex))
+		return -1;
+	pAvi = AVI_open_input_indexfile((char *)cPath, 1, cIndex);
+	if(pAvi == NULL)
+	{
+		DEBUG_PRT(ERR,FALSE,"open %s: %s", cPath, AVI_strerror());
+		return -1;
+	}
+	lFrames = AVI_video_frames(pAvi);
+	if(lFrames <= 0 || pAvi->input->video_index == NULL)
+	{
+		AVI_close_1(pAvi);
+		return -1;
+	}
+	dFps = AVI_frame_rate(pAvi);
+	if(dFps <= 0)
+		dFps = 25;
+
+	if(dStart < 0)
+		dStart = 0;
+	lFirst = (long)(dStart * dFps);
+	if(lFirst >= lFrames)
+	{
+		AVI_close_1(pAvi);
+		return -1;
+	}
+	lFirst = AVI_key_before(pAvi, lFirst, AVI_KEY_SCAN);
+
+	lLast = dEnd < 0 ? lFrames : (long)(dEnd * dFps + 0.999);
+	if(lLast > lFrames)
+		lLast = lFrames;
+	if(lLast <= lFirst)
+		lLast = lFirst + 1;
+
+	/* from the chunk header of the first frame up to the header of the
+	   frame behind the range, audio chunks in between included */
+	*plBegin = pAvi->input->video_index[lFirst].pos - 8;
+	if(lLast < lFrames)
+		*plEnd = pAvi->input->video_index[lLast].pos - 8;
+	else
+		*plEnd = pAvi->input->video_index[lFrames - 1].pos + ((pAvi->input->video_index[lFrames - 1].len + 1) & ~1);
+
+	AVI_close_1(pAvi);
+	return 0;
+}
+
+/*******************************************************************
+ *    Requests                                                     *
+ *******************************************************************/
+
+static const char *http_content_type(const char *cPath)
+{
+	const char *p = strrchr(cPath, '.');
+
+	if(p != NULL && strcasecmp(p, ".avi") == 0)
+		return "video/x-msvideo";
+	if(p != NULL && strcasecmp(p, ".mp4") == 0)
+		return "video/mp4";
+	return "application/octet-stream";
+}
+
+/* File below the root dir of the request path, -1 for paths leaving it */
+static int http_file_path(ty_http_server *pstServer, struct evhttp_request *pstReq, char *cPath, int iLen)
+{
+	const char *cUriPath;
+	char *cDecoded;
+	int iRet = 0;
+
+	cUriPath = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(pstReq));
+	if(cUriPath == NULL)
+		return -1;
+	cDecoded = evhttp_uridecode(cUriPath, 0, NULL);
+	if(cDecoded == NULL)
+		return -1;
+	if(strstr(cDecoded, "..") != NULL ||
+		snprintf(cPath, iLen, "%s/%s", pstServer->cRootDir, cDecoded + (cDecoded[0] == '/')) >= iLen)
+		iRet = -1;
+	free(cDecoded);
+	return iRet;
+}
+
+static void http_request_cb(struct evhttp_request *pstReq, void *arg)
+{
+	ty_http_server *pstServer = (ty_http_server *)arg;
+	struct evkeyvalq *pstHeaders = evhttp_request_get_output_headers(pstReq);
+	struct evkeyvalq stQuery;
+	const char *cQuery, *cValue;
+	char cPath[512];
+	char cHeader[96];
+	struct stat stStat;
+	off_t lBegin, lEnd, lBase, lSize, lFirst, lLast;
+	double dStart, dEnd;
+	int fd, iRet, iPartial = 0;
+
+	if(http_file_path(pstServer, pstReq, cPath, sizeof(cPath)) < 0)
+	{
+		evhttp_send_error(pstReq, HTTP_BADREQUEST, NULL);
+		return;
+	}
+	fd = open(cPath, O_RDONLY);
+	if(fd < 0)
+	{
+		evhttp_send_error(pstReq, HTTP_NOTFOUND, NULL);
+		return;
+	}
+	if(fstat(fd, &stStat) < 0 || !S_ISREG(stStat.st_mode))
+	{
+		close(fd);
+		evhttp_send_error(pstReq, HTTP_NOTFOUND, NULL);
+		return;
+	}
+	lBegin = 0;
+	lEnd = stStat.st_size;
+	iRet = 0;
+
+	cQuery = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(pstReq));
+	cValue = NULL;
+	memset(&stQuery, 0, sizeof(stQuery));
+	if(cQuery != NULL && evhttp_parse_query_str(cQuery, &stQuery) == 0)
+		cValue = evhttp_find_header(&stQuery, "t");
+	if(cValue != NULL)
+	{
+		/* t=[npt:]start[,end] */
+		if(strncmp(cValue, "npt:", 4) == 0)
+			cValue += 4;
+		dStart = atof(cValue);
+		cValue = strchr(cValue, ',');
+		dEnd = cValue != NULL ? atof(cValue + 1) : -1;
+		iRet = http_time_range(cPath, dStart, dEnd, &lBegin, &lEnd);
+		if(iRet == 0 && (lBegin < 0 || lEnd > stStat.st_size || lBegin >= lEnd))
+			iRet = -1;
+	}
+	evhttp_clear_headers(&stQuery);
+
+	/* the chunks of a t= query are the entity, a Range selects bytes of
+	   them and only then is the reply partial */
+	lBase = lBegin;
+	lSize = iRet == 0 ? lEnd - lBegin : stStat.st_size;
+	if(iRet == 0 && (cValue = evhttp_find_header(evhttp_request_get_input_headers(pstReq), "Range")) != NULL)
+	{
+		iRet = http_byte_range(cValue, lSize, &lFirst, &lLast);
+		if(iRet == 0)
+		{
+			lBegin = lBase + lFirst;
+			lEnd = lBase + lLast;
+			iPartial = 1;
+		}
+		else if(iRet > 0)
+			iRet = 0;
+	}
+
+	if(iRet < 0)
+	{
+		close(fd);
+		snprintf(cHeader, sizeof(cHeader), "bytes */%lld", (long long)lSize);
+		evhttp_add_header(pstHeaders, "Content-Range", cHeader);
+		evhttp_send_reply(pstReq, 416, "Requested Range Not Satisfiable", NULL);
+		return;
+	}
+
+	evhttp_add_header(pstHeaders, "Server", HTTP_SERVER_NAME);
+	evhttp_add_header(pstHeaders, "Content-Type", http_content_type(cPath));
+	evhttp_add_header(pstHeaders, "Accept-Ranges", "bytes");
+	snprintf(cHeader, sizeof(cHeader), "%lld", (long long)(lEnd - lBegin));
+	evhttp_add_header(pstHeaders, "Content-Length", cHeader);
+	if(iPartial)
+	{
+		snprintf(cHeader, sizeof(cHeader), "bytes %lld-%lld/%lld",
+			(long long)(lBegin - lBase), (long long)(lEnd - lBase) - 1, (long long)lSize);
+		evhttp_add_header(pstHeaders, "Content-Range", cHeader);
+	}
+
+	/* evbuffer_add_file owns fd from here on and sends the bytes with
+	   sendfile when the connection writes them */
+	if(evhttp_request_get_command(pstReq) == EVHTTP_REQ_HEAD || lEnd == lBegin)
+		close(fd);
+	else if(evbuffer_add_file(evhttp_request_get_output_buffer(pstReq), fd, lBegin, lEnd - lBegin) < 0)
+	{
+		close(fd);
+		evhttp_send_error(pstReq, HTTP_INTERNAL, NULL);
+		return;
+	}
+
+	if(iPartial)
+		evhttp_send_reply(pstReq, 206, "Partial Content", NULL);
+	else
+		evhttp_send_reply(pstReq, HTTP_OK, "OK", NULL);
+}
+
+ty_http_server *http_server_new(struct event_base *pstBase, int iPort, const char *cRootDir)
+{
+	ty_http_server *pstServer;
+
+	pstServer = (ty_http_server *)calloc(1, sizeof(ty_http_server));
+	if(pstServer == NULL)
+		return NULL;
+	pstServer->pstBase = pstBase;
+	strncpy(pstServer->cRootDir, cRootDir, sizeof(pstServer->cRootDir) - 1);
+
+	pstServer->pstHttp = evhttp_new(pstBase);
+	if(pstServer->pstHttp == NULL)
+	{
+		free(pstServer);
+		return NULL;
+	}
+	evhttp_set_allowed_methods(pstServer->pstHttp, EVHTTP_REQ_GET | EVHTTP_REQ_HEAD);
+	evhttp_set_timeout(pstServer->pstHttp, HTTP_SERVER_TIMEOUT);
+	evhttp_set_gencb(pstServer->pstHttp, http_request_cb, pstServer);
+
+	if(evhttp_bind_socket(pstServer->pstHttp, "0.0.0.0", iPort) < 0)
+	{
+		DEBUG_PRT(ERR,TRUE,"http server bind port %d error", iPort);
+		evhttp_free(pstServer->pstHttp);
+		free(pstServer);
+		return NULL;
+	}
+
+	return pstServer;
+}
+
+void http_server_free(ty_http_server *pstServer)
+{
+	if(pstServer == NULL)
+		return;
+	evhttp_free(pstServer->pstHttp);
+	free(pstServer);
+}
@@ -0,0 +1,1074 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include "avilib.h"
+#include "rtsp_client.h"
+#include "rtsp_server.h"
+
+#define RTSP_SERVER_NAME			"ECSINO_IPC Server"
+#define RTSP_VER					"RTSP/1.0"
+#define RTSP_MAX_REQUEST			4096
+#define RTSP_AUDIO_PACKET_MS		20
+#define RTSP_VIDEO_CLOCK			90000
+#define RTSP_VIDEO_PT				96
+#define RTSP_L16_PT					97
+
+enum
+{
+	TRACK_VIDEO = 0,
+	TRACK_AUDIO = 1,
+	TRACK_NUM
+};
+
+typedef struct rtsp_track
+{
+	int				iSetup;			/* SETUP done for this track */
+	int				iChannel;		/* interleaved RTP channel, RTCP is iChannel+1 */
+	int				iPayload;		/* RTP payload type */
+	unsigned short	usSeq;
+	unsigned int	uiSsrc;
+	unsigned int	uiTsBase;
+	unsigned int	uiPackets;
+	unsigned int	uiOctets;
+}ty_rtsp_track;
+
+typedef struct rtsp_session
+{
+	struct rtsp_session	*pstNext;
+	ty_rtsp_server		*pstServer;
+	struct bufferevent	*pstBev;
+	struct event		*pstPaceEv;
+	char				cSessionId[32];
+	char				cUrl[256];		/* aggregate control url */
+	char				cPath[256];		/* file on disk */
+	char				cIndex[264];	/* its sidecar index */
+	avi_t				*pAvi;
+	ty_rtsp_track		stTrack[TRACK_NUM];
+	int					iPlaying;
+	int					iEos;
+	double				dFps;
+	int					iSampSize;		/* bytes per audio sample (all channels) */
+	long				lFrame;			/* next video frame to send */
+	long				lFrameBase;		/* first frame of this PLAY */
+	long				lAudioByte;		/* next audio byte to send */
+	long				lAudioBase;		/* first audio byte of this PLAY */
+	struct timeval		stPlayStart;	/* wall clock matching lFrameBase/lAudioBase */
+	char				*pFrameBuf;
+	long				lFrameBufLen;
+	char				*pAudioBuf;
+	long				lAudioPacket;	/* audio bytes per RTP packet */
+}ty_rtsp_session;
+
+struct rtsp_server
+{
+	struct event_base		*pstBase;
+	struct evconnlistener	*pstListener;
+	char					cRootDir[256];
+	ty_rtsp_session			*pstSessions;
+	int						iSessionCount;
+	unsigned int			uiSessionSeq;
+};
+
+static void rtsp_session_pace_cb(evutil_socket_t fd, short events, void *arg);
+static void rtsp_session_event_cb(struct bufferevent *pstBev, short events, void *arg);
+
+/*******************************************************************
+ *    Helpers                                                      *
+ *******************************************************************/
+
+static int rtsp_is_h264(avi_t *pAvi)
+{
+	char *cComp = AVI_video_compressor(pAvi);
+
+	return (strncasecmp(cComp, "H264", 4) == 0 ||
+			strncasecmp(cComp, "X264", 4) == 0 ||
+			strncasecmp(cComp, "AVC1", 4) == 0);
+}
+
+/* payload type for the audio track, -1 if the format can't be streamed */
+static int rtsp_audio_payload(avi_t *pAvi)
+{
+	if(AVI_audio_channels(pAvi) <= 0 || AVI_audio_bytes(pAvi) <= 0)
+		return -1;
+
+	switch(AVI_audio_format(pAvi))
+	{
+	case WAVE_FORMAT_MULAW:
+	case IBM_FORMAT_MULAW:
+		return 0;
+	case WAVE_FORMAT_ALAW:
+	case IBM_FORMAT_ALAW:
+		return 8;
+	case WAVE_FORMAT_PCM:
+		if(AVI_audio_bits(pAvi) == 16)
+			return RTSP_L16_PT;
+		return -1;
+	default:
+		return -1;
+	}
+}
+
+/* Find next Annex B start code in [p,end), returns pointer to the NAL
+   following it. *ppEnd is set to the end of the NAL before it, without
+   the zero bytes of a 4 byte start code. */
+static unsigned char *rtsp_find_nal(unsigned char *p, unsigned char *end, unsigned char **ppEnd)
+{
+	unsigned char *begin = p;
+
+	while(p + 3 <= end)
+	{
+		if(p[0] == 0 && p[1] == 0 && p[2] == 1)
+			break;
+		p++;
+	}
+	if(ppEnd)
+	{
+		*ppEnd = p + 3 <= end ? p : end;
+		while(*ppEnd > begin && (*ppEnd)[-1] == 0)
+			(*ppEnd)--;
+	}
+	return p + 3 <= end ? p + 3 : NULL;
+}
+
+static void rtsp_base64(const unsigned char *src, int len, char *dst)
+{
+	static const char tbl[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	int i;
+
+	for(i = 0; i + 2 < len; i += 3)
+	{
+		*dst++ = tbl[src[i] >> 2];
+		*dst++ = tbl[((src[i] & 0x03) << 4) | (src[i+1] >> 4)];
+		*dst++ = tbl[((src[i+1] & 0x0f) << 2) | (src[i+2] >> 6)];
+		*dst++ = tbl[src[i+2] & 0x3f];
+	}
+	if(i < len)
+	{
+		*dst++ = tbl[src[i] >> 2];
+		if(i + 1 < len)
+		{
+			*dst++ = tbl[((src[i] & 0x03) << 4) | (src[i+1] >> 4)];
+			*dst++ = tbl[(src[i+1] & 0x0f) << 2];
+		}
+		else
+		{
+			*dst++ = tbl[(src[i] & 0x03) << 4];
+			*dst++ = '=';
+		}
+		*dst++ = '=';
+	}
+	*dst = '\0';
+}
+
+/* Build "profile-level-id=..;sprop-parameter-sets=.." from the SPS/PPS
+   found in the first video frame. */
+static void rtsp_h264_fmtp(avi_t *pAvi, char *cFmtp, int iLen)
+{
+	unsigned char *pBuf, *p, *end, *nal, *next, *nalEnd;
+	long n;
+	char cSps[256] = {0}, cPps[128] = {0};
+	char cProfile[8] = {0};
+
+	cFmtp[0] = '\0';
+	n = AVI_frame_size(pAvi, 0);
+	if(n <= 0)
+		return;
+	pBuf = (unsigned char *)malloc(n);
+	if(pBuf == NULL)
+		return;
+	AVI_set_video_position(pAvi, 0);
+	if(AVI_read_frame(pAvi, (char *)pBuf) != n)
+	{
+		free(pBuf);
+		return;
+	}
+
+	end = pBuf + n;
+	nal = rtsp_find_nal(pBuf, end, NULL);
+	while(nal != NULL && nal < end)
+	{
+		next = rtsp_find_nal(nal, end, &nalEnd);
+		p = nal;
+		if((p[0] & 0x1f) == 7 && nalEnd - p >= 4 && nalEnd - p < 190 && !cSps[0])
+		{
+			sprintf(cProfile, "%02x%02x%02x", p[1], p[2], p[3]);
+			rtsp_base64(p, nalEnd - p, cSps);
+		}
+		else if((p[0] & 0x1f) == 8 && nalEnd - p < 90 && !cPps[0])
+		{
+			rtsp_base64(p, nalEnd - p, cPps);
+		}
+		nal = next;
+	}
+	free(pBuf);
+
+	if(cSps[0] && cPps[0])
+		snprintf(cFmtp, iLen, ";profile-level-id=%s;sprop-parameter-sets=%s,%s", cProfile, cSps, cPps);
+}
+
+static int rtsp_get_header(const char *cReq, const char *cName, char *cValue, int iLen)
+{
+	const char *p = cReq;
+	const char *end;
+	int n = strlen(cName);
+
+	while((p = strstr(p, "\r\n")) != NULL)
+	{
+		p += 2;
+		if(strncasecmp(p, cName, n) == 0 && p[n] == ':')
+		{
+			p += n + 1;
+			while(*p == ' ' || *p == '\t')
+				p++;
+			end = strstr(p, "\r\n");
+			if(end == NULL)
+				end = p + strlen(p);
+			n = end - p;
+			if(n >= iLen)
+				n = iLen - 1;
+			memcpy(cValue, p, n);
+			cValue[n] = '\0';
+			return 0;
+		}
+	}
+	cValue[0] = '\0';
+	return -1;
+}
+
+/* rtsp://host[:port]/path[/trackID=n] -> path relative to root */
+static int rtsp_url_path(const char *cUrl, char *cPath, int iLen, int *piTrack)
+{
+	const char *p;
+	char *t;
+
+	*piTrack = -1;
+	if(strncasecmp(cUrl, "rtsp://", 7) != 0)
+		return -1;
+	p = strchr(cUrl + 7, '/');
+	if(p == NULL)
+		return -1;
+	p++;
+	if(strlen(p) >= (size_t)iLen || strstr(p, "..") != NULL)
+		return -1;
+	strcpy(cPath, p);
+
+	t = strstr(cPath, "/trackID=");
+	if(t != NULL)
+	{
+		*piTrack = atoi(t + strlen("/trackID="));
+		*t = '\0';
+	}
+	t = strchr(cPath, '?');
+	if(t != NULL)
+		*t = '\0';
+	t = cPath + strlen(cPath);
+	if(t > cPath && t[-1] == '/')
+		t[-1] = '\0';
+	return 0;
+}
+
+static double rtsp_elapsed(const struct timeval *pstStart)
+{
+	struct timeval stNow;
+
+	gettimeofday(&stNow, NULL);
+	return (stNow.tv_sec - pstStart->tv_sec) + (stNow.tv_usec - pstStart->tv_usec) / 1000000.0;
+}
+
+/*******************************************************************
+ *    RTP output                                                   *
+ *******************************************************************/
+
+static void rtsp_send_rtp(ty_rtsp_session *pstSess, ty_rtsp_track *pstTrack, unsigned int uiTs, int iMarker,
+						const unsigned char *pHead, int iHeadLen, const unsigned char *pData, int iDataLen)
+{
+	struct evbuffer *pstOut = bufferevent_get_output(pstSess->pstBev);
+	unsigned char cHdr[16];
+	int iLen = 12 + iHeadLen + iDataLen;
+
+	cHdr[0] = '$';
+	cHdr[1] = pstTrack->iChannel;
+	cHdr[2] = (iLen >> 8) & 0xff;
+	cHdr[3] = iLen & 0xff;
+	cHdr[4] = 0x80;
+	cHdr[5] = (iMarker ? 0x80 : 0) | pstTrack->iPayload;
+	cHdr[6] = (pstTrack->usSeq >> 8) & 0xff;
+	cHdr[7] = pstTrack->usSeq & 0xff;
+	cHdr[8] = (uiTs >> 24) & 0xff;
+	cHdr[9] = (uiTs >> 16) & 0xff;
+	cHdr[10] = (uiTs >> 8) & 0xff;
+	cHdr[11] = uiTs & 0xff;
+	cHdr[12] = (pstTrack->uiSsrc >> 24) & 0xff;
+	cHdr[13] = (pstTrack->uiSsrc >> 16) & 0xff;
+	cHdr[14] = (pstTrack->uiSsrc >> 8) & 0xff;
+	cHdr[15] = pstTrack->uiSsrc & 0xff;
+
+	evbuffer_add(pstOut, cHdr, 16);
+	if(iHeadLen)
+		evbuffer_add(pstOut, pHead, iHeadLen);
+	if(iDataLen)
+		evbuffer_add(pstOut, pData, iDataLen);
+
+	pstTrack->usSeq++;
+	pstTrack->uiPackets++;
+	pstTrack->uiOctets += iHeadLen + iDataLen;
+}
+
+/* RTCP BYE so clients notice the end of the stream */
+static void rtsp_send_bye(ty_rtsp_session *pstSess, ty_rtsp_track *pstTrack)
+{
+	unsigned char cPkt[12];
+
+	cPkt[0] = '$';
+	cPkt[1] = pstTrack->iChannel + 1;
+	cPkt[2] = 0;
+	cPkt[3] = 8;
+	cPkt[4] = 0x81;		/* V=2, SC=1 */
+	cPkt[5] = 203;		/* BYE */
+	cPkt[6] = 0;
+	cPkt[7] = 1;
+	cPkt[8] = (pstTrack->uiSsrc >> 24) & 0xff;
+	cPkt[9] = (pstTrack->uiSsrc >> 16) & 0xff;
+	cPkt[10] = (pstTrack->uiSsrc >> 8) & 0xff;
+	cPkt[11] = pstTrack->uiSsrc & 0xff;
+	evbuffer_add(bufferevent_get_output(pstSess->pstBev), cPkt, sizeof(cPkt));
+}
+
+static void rtsp_send_h264(ty_rtsp_session *pstSess, unsigned char *pFrame, long lLen, unsigned int uiTs)
+{
+	ty_rtsp_track *pstTrack = &pstSess->stTrack[TRACK_VIDEO];
+	unsigned char *end = pFrame + lLen;
+	unsigned char *nal, *next, *nalEnd;
+	unsigned char cFu[2];
+	int iLast, iLen, iChunk;
+
+	nal = rtsp_find_nal(pFrame, end, NULL);
+	if(nal == NULL)
+		nal = pFrame;	/* no start code, treat the frame as one NAL */
+
+	while(nal != NULL && nal < end)
+	{
+		next = rtsp_find_nal(nal, end, &nalEnd);
+		iLast = (next == NULL);
+		iLen = nalEnd - nal;
+		if(iLen <= 0)
+		{
+			nal = next;
+			continue;
+		}
+
+		if(iLen <= RTSP_SERVER_RTP_MTU)
+		{
+			rtsp_send_rtp(pstSess, pstTrack, uiTs, iLast, NULL, 0, nal, iLen);
+		}
+		else
+		{
+			/* FU-A */
+			cFu[0] = (nal[0] & 0xe0) | 28;
+			cFu[1] = 0x80 | (nal[0] & 0x1f);
+			nal++;
+			iLen--;
+			while(iLen > 0)
+			{
+				iChunk = iLen > RTSP_SERVER_RTP_MTU - 2 ? RTSP_SERVER_RTP_MTU - 2 : iLen;
+				if(iChunk == iLen)
+					cFu[1] |= 0x40;
+				rtsp_send_rtp(pstSess, pstTrack, uiTs, iLast && iChunk == iLen, cFu, 2, nal, iChunk);
+				cFu[1] &= ~0x80;
+				nal += iChunk;
+				iLen -= iChunk;
+			}
+		}
+		nal = next;
+	}
+}
+
+static int rtsp_send_video(ty_rtsp_session *pstSess)
+{
+	long n;
+	unsigned int uiTs;
+
+	n = AVI_frame_size(pstSess->pAvi, pstSess->lFrame);
+	if(n <= 0)
+		return n < 0 ? -1 : 0;
+	if(n > pstSess->lFrameBufLen)
+	{
+		char *p = (char *)realloc(pstSess->pFrameBuf, n);
+		if(p == NULL)
+			return -1;
+		pstSess->pFrameBuf = p;
+		pstSess->lFrameBufLen = n;
+	}
+
+	AVI_set_video_position(pstSess->pAvi, pstSess->lFrame);
+	if(AVI_read_frame(pstSess->pAvi, pstSess->pFrameBuf) != n)
+		return -1;
+
+	uiTs = pstSess->stTrack[TRACK_VIDEO].uiTsBase +
+		(unsigned int)(pstSess->lFrame * (double)RTSP_VIDEO_CLOCK / pstSess->dFps);
+	rtsp_send_h264(pstSess, (unsigned char *)pstSess->pFrameBuf, n, uiTs);
+	return 0;
+}
+
+static int rtsp_send_audio(ty_rtsp_session *pstSess, long lBytes)
+{
+	ty_rtsp_track *pstTrack = &pstSess->stTrack[TRACK_AUDIO];
+	unsigned char *p;
+	long n, i;
+	unsigned char c;
+
+	AVI_set_audio_position(pstSess->pAvi, pstSess->lAudioByte);
+	n = AVI_read_audio(pstSess->pAvi, pstSess->pAudioBuf, lBytes);
+	if(n <= 0)
+		return n;
+
+	/* L16 is big endian, AVI PCM is little endian */
+	if(pstTrack->iPayload == RTSP_L16_PT)
+	{
+		p = (unsigned char *)pstSess->pAudioBuf;
+		for(i = 0; i + 1 < n; i += 2)
+		{
+			c = p[i];
+			p[i] = p[i+1];
+			p[i+1] = c;
+		}
+	}
+
+	rtsp_send_rtp(pstSess, pstTrack,
+		pstTrack->uiTsBase + (unsigned int)(pstSess->lAudioByte / pstSess->iSampSize),
+		0, NULL, 0, (unsigned char *)pstSess->pAudioBuf, n);
+	pstSess->lAudioByte += n;
+	return n;
+}
+
+static void rtsp_session_schedule(ty_rtsp_session *pstSess, double dDelay)
+{
+	struct timeval tv;
+
+	if(dDelay < 0)
+		dDelay = 0;
+	tv.tv_sec = (long)dDelay;
+	tv.tv_usec = (long)((dDelay - tv.tv_sec) * 1000000);
+	evtimer_add(pstSess->pstPaceEv, &tv);
+}
+
+static void rtsp_session_pace_cb(evutil_socket_t fd, short events, void *arg)
+{
+	ty_rtsp_session *pstSess = (ty_rtsp_session *)arg;
+	ty_rtsp_track *pstVideo = &pstSess->stTrack[TRACK_VIDEO];
+	ty_rtsp_track *pstAudio = &pstSess->stTrack[TRACK_AUDIO];
+	double dElapsed, dNext = 1.0;
+	long lDue;
+	int iVideoDone, iAudioDone, iRet;
+
+	if(!pstSess->iPlaying)
+		return;
+
+	/* Client is not reading fast enough: hold playback instead of
+	   queueing unbounded data, and shift the clock by the stall */
+	if(evbuffer_get_length(bufferevent_get_output(pstSess->pstBev)) > RTSP_SERVER_MAX_QUEUE)
+	{
+		pstSess->stPlayStart.tv_usec += 10000;
+		if(pstSess->stPlayStart.tv_usec >= 1000000)
+		{
+			pstSess->stPlayStart.tv_sec++;
+			pstSess->stPlayStart.tv_usec -= 1000000;
+		}
+		rtsp_session_schedule(pstSess, 0.01);
+		return;
+	}
+
+	dElapsed = rtsp_elapsed(&pstSess->stPlayStart);
+
+	iVideoDone = 1;
+	if(pstVideo->iSetup)
+	{
+		while(pstSess->lFrame < AVI_video_frames(pstSess->pAvi) &&
+			(pstSess->lFrame - pstSess->lFrameBase) / pstSess->dFps <= dElapsed)
+		{
+			if(rtsp_send_video(pstSess) < 0)
+			{
+				DEBUG_PRT(ERR,FALSE,"session %s: read frame %ld error", pstSess->cSessionId, pstSess->lFrame);
+				pstSess->lFrame = AVI_video_frames(pstSess->pAvi);
+				break;
+			}
+			pstSess->lFrame++;
+		}
+		if(pstSess->lFrame < AVI_video_frames(pstSess->pAvi))
+		{
+			iVideoDone = 0;
+			dNext = (pstSess->lFrame - pstSess->lFrameBase) / pstSess->dFps - dElapsed;
+		}
+	}
+
+	iAudioDone = 1;
+	if(pstAudio->iSetup)
+	{
+		lDue = pstSess->lAudioBase + (long)(dElapsed * AVI_audio_rate(pstSess->pAvi)) * pstSess->iSampSize;
+		iRet = 1;
+		while(pstSess->lAudioByte < lDue && pstSess->lAudioByte < AVI_audio_bytes(pstSess->pAvi))
+		{
+			iRet = rtsp_send_audio(pstSess, pstSess->lAudioPacket);
+			if(iRet <= 0)
+				break;
+		}
+		if(iRet > 0 && pstSess->lAudioByte < AVI_audio_bytes(pstSess->pAvi))
+		{
+			iAudioDone = 0;
+			if(RTSP_AUDIO_PACKET_MS / 1000.0 < dNext)
+				dNext = RTSP_AUDIO_PACKET_MS / 1000.0;
+		}
+	}
+
+	if(iVideoDone && iAudioDone)
+	{
+		if(pstVideo->iSetup)
+			rtsp_send_bye(pstSess, pstVideo);
+		if(pstAudio->iSetup)
+			rtsp_send_bye(pstSess, pstAudio);
+		pstSess->iPlaying = 0;
+		pstSess->iEos = 1;
+		return;
+	}
+
+	rtsp_session_schedule(pstSess, dNext);
+}
+
+/*******************************************************************
+ *    Sessions                                                     *
+ *******************************************************************/
+
+static void rtsp_session_free(ty_rtsp_session *pstSess)
+{
+	ty_rtsp_server *pstServer = pstSess->pstServer;
+	ty_rtsp_session **pp;
+
+	for(pp = &pstServer->pstSessions; *pp != NULL; pp = &(*pp)->pstNext)
+	{
+		if(*pp == pstSess)
+		{
+			*pp = pstSess->pstNext;
+			pstServer->iSessionCount--;
+			break;
+		}
+	}
+
+	if(pstSess->pstPaceEv)
+		event_free(pstSess->pstPaceEv);
+	if(pstSess->pstBev)
+		bufferevent_free(pstSess->pstBev);
+	if(pstSess->pAvi)
+		AVI_close_1(pstSess->pAvi);
+	free(pstSess->pFrameBuf);
+	free(pstSess->pAudioBuf);
+	free(pstSess);
+}
+
+/* Open the file of the request url, reusing the session's file if the
+   same one is already open. */
+static int rtsp_session_open(ty_rtsp_session *pstSess, const char *cRelPath)
+{
+	char cPath[512];
+	avi_t *pAvi;
+
+	snprintf(cPath, sizeof(cPath), "%s/%s", pstSess->pstServer->cRootDir, cRelPath);
+	if(pstSess->pAvi != NULL)
+		return strcmp(cPath, pstSess->cPath) == 0 ? 0 : -1;
+
+	/* The reads run on the event loop: the sidecar saves parsing idx1
+	   again for every session of a file, and the read-ahead keeps the
+	   chunks of the next frames in the page cache before they are due */
+	if(snprintf(pstSess->cIndex, sizeof(pstSess->cIndex), "%s%s", cPath, RTSP_SERVER_INDEX_EXT) >= (int)sizeof(pstSess->cIndex))
+		return -1;
+	pAvi = AVI_open_input_indexfile(cPath, 1, pstSess->cIndex);
+	if(pAvi == NULL)
+	{
+		DEBUG_PRT(ERR,FALSE,"open %s: %s", cPath, AVI_strerror());
+		return -1;
+	}
+	if(!rtsp_is_h264(pAvi))
+	{
+		DEBUG_PRT(ERR,FALSE,"%s: unsupported video %s", cPath, AVI_video_compressor(pAvi));
+		AVI_close_1(pAvi);
+		return -1;
+	}
+
+	if(AVI_set_readahead(pAvi, RTSP_SERVER_READAHEAD) < 0)
+		DEBUG_PRT(ERR,FALSE,"%s: no read-ahead: %s", cPath, AVI_strerror());
+
+	pstSess->pAvi = pAvi;
+	strncpy(pstSess->cPath, cPath, sizeof(pstSess->cPath) - 1);
+	pstSess->dFps = AVI_frame_rate(pAvi);
+	if(pstSess->dFps <= 0)
+		pstSess->dFps = 25;
+	pstSess->iSampSize = ((AVI_audio_bits(pAvi) + 7) / 8) * AVI_audio_channels(pAvi);
+	if(pstSess->iSampSize <= 0)
+		pstSess->iSampSize = 1;
+	pstSess->lAudioPacket = AVI_audio_rate(pAvi) * RTSP_AUDIO_PACKET_MS / 1000 * pstSess->iSampSize;
+	if(pstSess->lAudioPacket <= 0 || pstSess->lAudioPacket > RTSP_SERVER_RTP_MTU)
+		pstSess->lAudioPacket = RTSP_SERVER_RTP_MTU / pstSess->iSampSize * pstSess->iSampSize;
+	pstSess->stTrack[TRACK_VIDEO].iPayload = RTSP_VIDEO_PT;
+	pstSess->stTrack[TRACK_AUDIO].iPayload = rtsp_audio_payload(pAvi);
+	return 0;
+}
+
+static void rtsp_reply(ty_rtsp_session *pstSess, int iCode, const char *cReason, int iCseq,
+					const char *cExtra, const char *cBody)
+{
+	struct evbuffer *pstOut = bufferevent_get_output(pstSess->pstBev);
+
+	evbuffer_add_printf(pstOut, "%s %d %s\r\nCSeq: %d\r\nServer: %s\r\n",
+		RTSP_VER, iCode, cReason, iCseq, RTSP_SERVER_NAME);
+	if(pstSess->cSessionId[0] && iCode == 200)
+		evbuffer_add_printf(pstOut, "Session: %s;timeout=60\r\n", pstSess->cSessionId);
+	if(cExtra)
+		evbuffer_add(pstOut, cExtra, strlen(cExtra));
+	if(cBody)
+		evbuffer_add_printf(pstOut, "Content-Type: application/sdp\r\nContent-Length: %d\r\n\r\n%s",
+			(int)strlen(cBody), cBody);
+	else
+		evbuffer_add(pstOut, "\r\n", 2);
+}
+
+static void rtsp_handle_describe(ty_rtsp_session *pstSess, const char *cUrl, const char *cPath, int iCseq)
+{
+	char cSdp[2048];
+	char cFmtp[512];
+	char cExtra[300];
+	avi_t *pAvi;
+	int iLen, iPt;
+	double dDuration;
+
+	if(rtsp_session_open(pstSess, cPath) != 0)
+	{
+		rtsp_reply(pstSess, 404, "Not Found", iCseq, NULL, NULL);
+		return;
+	}
+	pAvi = pstSess->pAvi;
+	strncpy(pstSess->cUrl, cUrl, sizeof(pstSess->cUrl) - 1);
+	dDuration = AVI_video_frames(pAvi) / pstSess->dFps;
+	rtsp_h264_fmtp(pAvi, cFmtp, sizeof(cFmtp));
+
+	iLen = snprintf(cSdp, sizeof(cSdp),
+		"v=0\r\n"
+		"o=- %u 1 IN IP4 0.0.0.0\r\n"
+		"s=%s\r\n"
+		"t=0 0\r\n"
+		"a=control:*\r\n"
+		"a=range:npt=0-%.3f\r\n"
+		"m=video 0 RTP/AVP %d\r\n"
+		"a=rtpmap:%d H264/%d\r\n"
+		"a=fmtp:%d packetization-mode=1%s\r\n"
+		"a=control:trackID=%d\r\n",
+		pstSess->pstServer->uiSessionSeq, RTSP_SERVER_NAME, dDuration,
+		RTSP_VIDEO_PT, RTSP_VIDEO_PT, RTSP_VIDEO_CLOCK, RTSP_VIDEO_PT, cFmtp, TRACK_VIDEO);
+
+	iPt = pstSess->stTrack[TRACK_AUDIO].iPayload;
+	if(iPt >= 0 && iLen < (int)sizeof(cSdp))
+	{
+		iLen += snprintf(cSdp + iLen, sizeof(cSdp) - iLen, "m=audio 0 RTP/AVP %d\r\n", iPt);
+		if(iPt == RTSP_L16_PT)
+			iLen += snprintf(cSdp + iLen, sizeof(cSdp) - iLen, "a=rtpmap:%d L16/%ld/%d\r\n",
+				iPt, AVI_audio_rate(pAvi), AVI_audio_channels(pAvi));
+		else
+			iLen += snprintf(cSdp + iLen, sizeof(cSdp) - iLen, "a=rtpmap:%d %s/%ld\r\n",
+				iPt, iPt == 0 ? "PCMU" : "PCMA", AVI_audio_rate(pAvi));
+		snprintf(cSdp + iLen, sizeof(cSdp) - iLen, "a=control:trackID=%d\r\n", TRACK_AUDIO);
+	}
+
+	snprintf(cExtra, sizeof(cExtra), "Content-Base: %s/\r\n", cUrl);
+	rtsp_reply(pstSess, 200, "OK", iCseq, cExtra, cSdp);
+}
+
+static void rtsp_handle_setup(ty_rtsp_session *pstSess, const char *cReq, const char *cPath, int iTrack, int iCseq)
+{
+	char cTransport[256];
+	char cExtra[300];
+	ty_rtsp_track *pstTrack;
+	char *p;
+	int iChannel;
+
+	if(rtsp_session_open(pstSess, cPath) != 0)
+	{
+		rtsp_reply(pstSess, 404, "Not Found", iCseq, NULL, NULL);
+		return;
+	}
+	if(iTrack < 0)
+		iTrack = TRACK_VIDEO;
+	if(iTrack >= TRACK_NUM || pstSess->stTrack[iTrack].iPayload < 0)
+	{
+		rtsp_reply(pstSess, 404, "Not Found", iCseq, NULL, NULL);
+		return;
+	}
+
+	rtsp_get_header(cReq, "Transport", cTransport, sizeof(cTransport));
+	p = strstr(cTransport, "interleaved=");
+	if(strstr(cTransport, "TCP") == NULL || p == NULL)
+	{
+		rtsp_reply(pstSess, 461, "Unsupported Transport", iCseq, NULL, NULL);
+		return;
+	}
+	iChannel = atoi(p + strlen("interleaved="));
+
+	pstTrack = &pstSess->stTrack[iTrack];
+	pstTrack->iSetup = 1;
+	pstTrack->iChannel = iChannel;
+	pstTrack->uiSsrc = (unsigned int)random();
+	pstTrack->usSeq = (unsigned short)random();
+	pstTrack->uiTsBase = (unsigned int)random();
+
+	if(!pstSess->cSessionId[0])
+		snprintf(pstSess->cSessionId, sizeof(pstSess->cSessionId), "%08X%04X",
+			(unsigned int)random(), ++pstSess->pstServer->uiSessionSeq & 0xffff);
+	if(!pstSess->cUrl[0])
+	{
+		/* SETUP without DESCRIBE: rebuild the aggregate url */
+		p = strstr(cReq, " ");
+		if(p != NULL)
+		{
+			snprintf(pstSess->cUrl, sizeof(pstSess->cUrl), "%.*s", (int)strcspn(p + 1, " "), p + 1);
+			p = strstr(pstSess->cUrl, "/trackID=");
+			if(p != NULL)
+				*p = '\0';
+		}
+	}
+
+	snprintf(cExtra, sizeof(cExtra), "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d;ssrc=%08X\r\n",
+		iChannel, iChannel + 1, pstTrack->uiSsrc);
+	rtsp_reply(pstSess, 200, "OK", iCseq, cExtra, NULL);
+}
+
+static void rtsp_handle_play(ty_rtsp_session *pstSess, const char *cReq, int iCseq)
+{
+	char cRange[64];
+	char cExtra[600];
+	double dNpt = -1;
+	int iLen = 0;
+	ty_rtsp_track *pstTrack;
+	long lFrames;
+
+	if(pstSess->pAvi == NULL || (!pstSess->stTrack[TRACK_VIDEO].iSetup && !pstSess->stTrack[TRACK_AUDIO].iSetup))
+	{
+		rtsp_reply(pstSess, 455, "Method Not Valid in This State", iCseq, NULL, NULL);
+		return;
+	}
+
+	if(rtsp_get_header(cReq, "Range", cRange, sizeof(cRange)) == 0 &&
+		strncmp(cRange, "npt=", 4) == 0 && strncmp(cRange + 4, "now", 3) != 0)
+		dNpt = atof(cRange + 4);
+
+	lFrames = AVI_video_frames(pstSess->pAvi);
+	if(dNpt >= 0 || (!pstSess->iPlaying && pstSess->lFrameBase == 0 && pstSess->lFrame == 0))
+	{
+		if(dNpt < 0)
+			dNpt = 0;
+		pstSess->lFrame = (long)(dNpt * pstSess->dFps);
+		if(pstSess->lFrame > lFrames)
+			pstSess->lFrame = lFrames;
+		pstSess->lAudioByte = (long)(dNpt * AVI_audio_rate(pstSess->pAvi)) * pstSess->iSampSize;
+		if(AVI_set_video_position(pstSess->pAvi, pstSess->lFrame) < 0)
+		{
+			rtsp_reply(pstSess, 457, "Invalid Range", iCseq, NULL, NULL);
+			return;
+		}
+		pstSess->iEos = 0;
+	}
+	else
+	{
+		/* resume after PAUSE */
+		dNpt = pstSess->lFrame / pstSess->dFps;
+	}
+	pstSess->lFrameBase = pstSess->lFrame;
+	pstSess->lAudioBase = pstSess->lAudioByte;
+	gettimeofday(&pstSess->stPlayStart, NULL);
+
+	iLen = snprintf(cExtra, sizeof(cExtra), "Range: npt=%.3f-%.3f\r\nRTP-Info: ",
+		dNpt, lFrames / pstSess->dFps);
+	pstTrack = &pstSess->stTrack[TRACK_VIDEO];
+	if(pstTrack->iSetup)
+		iLen += snprintf(cExtra + iLen, sizeof(cExtra) - iLen, "url=%s/trackID=%d;seq=%u;rtptime=%u",
+			pstSess->cUrl, TRACK_VIDEO, pstTrack->usSeq,
+			pstTrack->uiTsBase + (unsigned int)(pstSess->lFrame * (double)RTSP_VIDEO_CLOCK / pstSess->dFps));
+	pstTrack = &pstSess->stTrack[TRACK_AUDIO];
+	if(pstTrack->iSetup)
+		iLen += snprintf(cExtra + iLen, sizeof(cExtra) - iLen, "%surl=%s/trackID=%d;seq=%u;rtptime=%u",
+			pstSess->stTrack[TRACK_VIDEO].iSetup ? "," : "", pstSess->cUrl, TRACK_AUDIO, pstTrack->usSeq,
+			pstTrack->uiTsBase + (unsigned int)(pstSess->lAudioByte / pstSess->iSampSize));
+	snprintf(cExtra + iLen, sizeof(cExtra) - iLen, "\r\n");
+
+	rtsp_reply(pstSess, 200, "OK", iCseq, cExtra, NULL);
+
+	pstSess->iPlaying = 1;
+	rtsp_session_schedule(pstSess, 0);
+}
+
+/* Handle one complete request, returns -1 if the connection must be closed */
+static int rtsp_handle_request(ty_rtsp_session *pstSess, char *cReq)
+{
+	char cMethod[32] = {0};
+	char cUrl[256] = {0};
+	char cValue[64];
+	char cPath[256];
+	int iCseq = 0, iTrack;
+
+	if(sscanf(cReq, "%31s %255s", cMethod, cUrl) != 2)
+		return -1;
+	if(rtsp_get_header(cReq, "CSeq", cValue, sizeof(cValue)) == 0)
+		iCseq = atoi(cValue);
+
+	if(strcmp(cMethod, "OPTIONS") == 0)
+	{
+		rtsp_reply(pstSess, 200, "OK", iCseq,
+			"Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, GET_PARAMETER, TEARDOWN\r\n", NULL);
+		return 0;
+	}
+	if(strcmp(cMethod, "GET_PARAMETER") == 0)
+	{
+		rtsp_reply(pstSess, 200, "OK", iCseq, NULL, NULL);
+		return 0;
+	}
+
+	if(strcmp(cMethod, "DESCRIBE") == 0 || strcmp(cMethod, "SETUP") == 0)
+	{
+		if(rtsp_url_path(cUrl, cPath, sizeof(cPath), &iTrack) != 0)
+		{
+			rtsp_reply(pstSess, 400, "Bad Request", iCseq, NULL, NULL);
+			return 0;
+		}
+		if(cMethod[0] == 'D')
+			rtsp_handle_describe(pstSess, cUrl, cPath, iCseq);
+		else
+			rtsp_handle_setup(pstSess, cReq, cPath, iTrack, iCseq);
+		return 0;
+	}
+
+	/* the remaining methods need a session */
+	if(!pstSess->cSessionId[0] || rtsp_get_header(cReq, "Session", cValue, sizeof(cValue)) != 0 ||
+		strncmp(cValue, pstSess->cSessionId, strlen(pstSess->cSessionId)) != 0)
+	{
+		rtsp_reply(pstSess, 454, "Session Not Found", iCseq, NULL, NULL);
+		return 0;
+	}
+
+	if(strcmp(cMethod, "PLAY") == 0)
+	{
+		rtsp_handle_play(pstSess, cReq, iCseq);
+	}
+	else if(strcmp(cMethod, "PAUSE") == 0)
+	{
+		pstSess->iPlaying = 0;
+		evtimer_del(pstSess->pstPaceEv);
+		rtsp_reply(pstSess, 200, "OK", iCseq, NULL, NULL);
+	}
+	else if(strcmp(cMethod, "TEARDOWN") == 0)
+	{
+		pstSess->iPlaying = 0;
+		evtimer_del(pstSess->pstPaceEv);
+		rtsp_reply(pstSess, 200, "OK", iCseq, NULL, NULL);
+		return -1;
+	}
+	else
+	{
+		rtsp_reply(pstSess, 501, "Not Implemented", iCseq, NULL, NULL);
+	}
+	return 0;
+}
+
+static void rtsp_session_close_cb(struct bufferevent *pstBev, void *arg)
+{
+	ty_rtsp_session *pstSess = (ty_rtsp_session *)arg;
+
+	if(evbuffer_get_length(bufferevent_get_output(pstBev)) == 0)
+		rtsp_session_free(pstSess);
+}
+
+static void rtsp_session_read_cb(struct bufferevent *pstBev, void *arg)
+{
+	ty_rtsp_session *pstSess = (ty_rtsp_session *)arg;
+	struct evbuffer *pstIn = bufferevent_get_input(pstBev);
+	struct evbuffer_ptr stEnd;
+	unsigned char *p;
+	char cReq[RTSP_MAX_REQUEST];
+	char cValue[16];
+	size_t len;
+	int iBody;
+
+	while((len = evbuffer_get_length(pstIn)) > 0)
+	{
+		p = evbuffer_pullup(pstIn, len < 4 ? len : 4);
+		if(p[0] == '$')
+		{
+			/* interleaved data from the client (RTCP receiver reports) */
+			if(len < 4 || len < (size_t)(4 + ((p[2] << 8) | p[3])))
+				return;
+			evbuffer_drain(pstIn, 4 + ((p[2] << 8) | p[3]));
+			continue;
+		}
+
+		stEnd = evbuffer_search(pstIn, "\r\n\r\n", 4, NULL);
+		if(stEnd.pos < 0)
+		{
+			if(len >= RTSP_MAX_REQUEST)
+				goto close;
+			return;
+		}
+		if(stEnd.pos + 4 >= RTSP_MAX_REQUEST)
+			goto close;
+
+		evbuffer_copyout(pstIn, cReq, stEnd.pos + 4);
+		cReq[stEnd.pos + 4] = '\0';
+		iBody = 0;
+		if(rtsp_get_header(cReq, "Content-Length", cValue, sizeof(cValue)) == 0)
+			iBody = atoi(cValue);
+		if(iBody < 0 || len < (size_t)(stEnd.pos + 4 + iBody))
+			return;
+		evbuffer_drain(pstIn, stEnd.pos + 4 + iBody);
+
+		if(rtsp_handle_request(pstSess, cReq) < 0)
+			goto close;
+	}
+	return;
+
+close:
+	/* flush the last reply, then free the session */
+	bufferevent_disable(pstBev, EV_READ);
+	if(evbuffer_get_length(bufferevent_get_output(pstBev)) == 0)
+	{
+		rtsp_session_free(pstSess);
+		return;
+	}
+	bufferevent_setcb(pstBev, NULL, rtsp_session_close_cb, rtsp_session_event_cb, pstSess);
+}
+
+static void rtsp_session_event_cb(struct bufferevent *pstBev, short events, void *arg)
+{
+	ty_rtsp_session *pstSess = (ty_rtsp_session *)arg;
+
+	if(events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+	{
+		DEBUG_PRT(DEBUG,FALSE,"session %s closed", pstSess->cSessionId);
+		rtsp_session_free(pstSess);
+	}
+}
+
+static void rtsp_server_accept_cb(struct evconnlistener *pstListener, evutil_socket_t fd,
+							struct sockaddr *pstAddr, int iLen, void *arg)
+{
+	ty_rtsp_server *pstServer = (ty_rtsp_server *)arg;
+	ty_rtsp_session *pstSess;
+	int iOn = 1;
+
+	if(pstServer->iSessionCount >= RTSP_SERVER_MAX_SESSIONS)
+	{
+		DEBUG_PRT(ERR,FALSE,"too many sessions");
+		evutil_closesocket(fd);
+		return;
+	}
+
+	pstSess = (ty_rtsp_session *)calloc(1, sizeof(ty_rtsp_session));
+	if(pstSess == NULL)
+	{
+		evutil_closesocket(fd);
+		return;
+	}
+	pstSess->pstServer = pstServer;
+	pstSess->stTrack[TRACK_AUDIO].iPayload = -1;
+	pstSess->pstBev = bufferevent_socket_new(pstServer->pstBase, fd, BEV_OPT_CLOSE_ON_FREE);
+	pstSess->pstPaceEv = evtimer_new(pstServer->pstBase, rtsp_session_pace_cb, pstSess);
+	pstSess->pAudioBuf = (char *)malloc(RTSP_SERVER_RTP_MTU);
+	if(pstSess->pstBev == NULL || pstSess->pstPaceEv == NULL || pstSess->pAudioBuf == NULL)
+	{
+		if(pstSess->pstBev == NULL)
+			evutil_closesocket(fd);
+		pstSess->pstNext = NULL;
+		rtsp_session_free(pstSess);
+		return;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &iOn, sizeof(iOn));
+
+	pstSess->pstNext = pstServer->pstSessions;
+	pstServer->pstSessions = pstSess;
+	pstServer->iSessionCount++;
+
+	bufferevent_setcb(pstSess->pstBev, rtsp_session_read_cb, NULL, rtsp_session_event_cb, pstSess);
+	bufferevent_enable(pstSess->pstBev, EV_READ | EV_WRITE);
+}
+
+ty_rtsp_server *rtsp_server_new(struct event_base *pstBase, int iPort, const char *cRootDir)
+{
+	ty_rtsp_server *pstServer;
+	struct sockaddr_in stAddr;
+
+	pstServer = (ty_rtsp_server *)calloc(1, sizeof(ty_rtsp_server));
+	if(pstServer == NULL)
+		return NULL;
+	pstServer->pstBase = pstBase;
+	strncpy(pstServer->cRootDir, cRootDir, sizeof(pstServer->cRootDir) - 1);
+
+	memset(&stAddr, 0, sizeof(stAddr));
+	stAddr.sin_family = AF_INET;
+	stAddr.sin_port = htons(iPort);
+	stAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	pstServer->pstListener = evconnlistener_new_bind(pstBase, rtsp_server_accept_cb, pstServer,
+		LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1, (struct sockaddr *)&stAddr, sizeof(stAddr));
+	if(pstServer->pstListener == NULL)
+	{
+		DEBUG_PRT(ERR,TRUE,"rtsp server bind port %d error", iPort);
+		free(pstServer);
+		return NULL;
+	}
+
+	return pstServer;
+}
+
+void rtsp_server_free(ty_rtsp_server *pstServer)
+{
+	if(pstServer == NULL)
+		return;
+	while(pstServer->pstSessions != NULL)
+		rtsp_session_free(pstServer->pstSessions);
+	evconnlistener_free(pstServer->pstListener);
+	free(pstServer);
+}
+
+int rtsp_server_session_count(ty_rtsp_server *pstServer)
+{
+	return pstServer->iSessionCount;
+}
+
+#if 0
+int main()
+{
+	struct event_base *pstBase;
+	ty_rtsp_server *pstServer;
+
+	pstBase = event_base_new();
+	pstServer = rtsp_server_new(pstBase, RTSP_SERVER_PORT, "/mnt/record");
+	if(pstServer == NULL)
+	{
+		DEBUG_PRT(ERR,FALSE,"rtsp_server_new error");
+		return -1;
+	}
+	event_base_dispatch(pstBase);
+	rtsp_server_free(pstServer);
+	event_base_free(pstBase);
+
+	return 0;
+}
+#endif
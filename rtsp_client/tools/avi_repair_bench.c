@@ -0,0 +1,213 @@
+/*
+ * Benchmark of the movi scan used by AVI_deformity_file and by
+ * AVI_open_input_file for files without idx1.
+ *
+ * Writes a synthetic recording (H264 sized frames, PCM audio) that is
+ * left unclosed like after a crash, and the same recording closed, then
+ * times on fresh copies of them:
+ *
+ *   truncated     repair of the unclosed one cut in the middle of a chunk
+ *   garbage       the same followed by random bytes
+ *   open          AVI_open_input_file of the closed one without its idx1
+ *
+ * usage: avi_repair_bench [-d dir] [-f frames] [-r runs] [-c]
+ *   -c drops the copy from the page cache before each run
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "avilib.h"
+
+#define BENCH_FPS          25
+#define BENCH_GOP          25
+#define BENCH_I_BYTES      40000
+#define BENCH_P_BYTES      4096
+#define BENCH_AUDIO_BYTES  640       /* 8 kHz 16 bit mono per frame */
+#define BENCH_GARBAGE      (64*1024)
+
+static double bench_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+/* Recording of frames frames; with crash set the fd is closed without
+   writing header and idx1 */
+
+static int bench_record(const char *name, long frames, int crash)
+{
+   static unsigned char v[BENCH_I_BYTES], a[BENCH_AUDIO_BYTES];
+   avi_t avi;
+   long i, len;
+
+   memset(&avi, 0, sizeof(avi));
+   if(AVI_Init_fd_fast(&avi, 640, 480, BENCH_FPS, "H264", frames/BENCH_FPS + 1, name) < 0)
+      return -1;
+   AVI_set_audio(&avi, 1, 8000, 16, WAVE_FORMAT_PCM);
+
+   for(i=0; i<(long)sizeof(v); i++) v[i] = rand();
+   v[0] = 0; v[1] = 0; v[2] = 0; v[3] = 1;
+   for(i=0; i<frames; i++)
+   {
+      len = i%BENCH_GOP ? BENCH_P_BYTES : BENCH_I_BYTES;
+      v[4] = i%BENCH_GOP ? 0x41 : 0x65;
+      if(AVI_write_frame(&avi, v, len, i/BENCH_FPS) ||
+         AVI_write_audio(&avi, a, sizeof(a), i/BENCH_FPS))
+         return -1;
+   }
+
+   if(!crash)
+      return AVI_close_fd_1(&avi);
+
+   /* no AVI_close_fd */
+   close(avi.fdes);
+   AVI_close(&avi);
+   return 0;
+}
+
+/* Copy the first len bytes of src to dst, then garbage random bytes */
+
+static int bench_copy(const char *src, const char *dst, off_t len, long garbage, int cold)
+{
+   static char buf[1024*1024];
+   int in, out, ret = -1;
+   ssize_t n;
+   long i;
+
+   in = open(src, O_RDONLY);
+   out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+   if(in < 0 || out < 0) goto __exit_copy;
+
+   while(len > 0)
+   {
+      n = read(in, buf, len < (off_t)sizeof(buf) ? len : (off_t)sizeof(buf));
+      if(n <= 0 || write(out, buf, n) != n) goto __exit_copy;
+      len -= n;
+   }
+   while(garbage > 0)
+   {
+      n = garbage < (long)sizeof(buf) ? garbage : (long)sizeof(buf);
+      for(i=0; i<n; i++) buf[i] = rand();
+      if(write(out, buf, n) != n) goto __exit_copy;
+      garbage -= n;
+   }
+
+   /* clean pages can be dropped */
+   if(cold && (fdatasync(out) || posix_fadvise(out, 0, 0, POSIX_FADV_DONTNEED)))
+      goto __exit_copy;
+   ret = 0;
+
+__exit_copy:
+   if(in >= 0) close(in);
+   if(out >= 0) close(out);
+   return ret;
+}
+
+static void bench_report(const char *what, double *ms, int runs, off_t bytes)
+{
+   double min = ms[0], sum = 0;
+   int i;
+
+   for(i=0; i<runs; i++)
+   {
+      sum += ms[i];
+      if(ms[i] < min) min = ms[i];
+   }
+   printf("%-10s %8.2f ms min %8.2f ms avg %8.1f MB/s\n",
+          what, min, sum/runs, bytes/1048576.0/(min/1e3));
+}
+
+int main(int argc, char **argv)
+{
+   const char *dir = "/tmp";
+   char src[512], dst[512], closed[512];
+   long frames = 9000;
+   int runs = 5, cold = 0;
+   unsigned int tm_len;
+   struct stat st, cst;
+   double *ms;
+   off_t cut, movi;
+   avi_t *avi;
+   int c, i, ret;
+
+   while((c = getopt(argc, argv, "d:f:r:c")) != -1)
+   {
+      switch(c)
+      {
+         case 'd': dir = optarg; break;
+         case 'f': frames = atol(optarg); break;
+         case 'r': runs = atoi(optarg); break;
+         case 'c': cold = 1; break;
+         default:
+            fprintf(stderr, "usage: %s [-d dir] [-f frames] [-r runs] [-c]\n", argv[0]);
+            return 1;
+      }
+   }
+   if(frames <= 0 || runs <= 0) return 1;
+
+   snprintf(src, sizeof(src), "%s/avi_bench_src.avi", dir);
+   snprintf(dst, sizeof(dst), "%s/avi_bench.avi", dir);
+   snprintf(closed, sizeof(closed), "%s/avi_bench_closed.avi", dir);
+   ms = (double *)malloc(runs*sizeof(double));
+   srand(1);
+   if(ms == NULL || bench_record(src, frames, 1) || stat(src, &st) ||
+      bench_record(closed, frames, 0) || stat(closed, &cst))
+   {
+      fprintf(stderr, "can't write the recordings to %s\n", dir);
+      return 1;
+   }
+
+   /* cut inside the data of a chunk near the end */
+   cut = st.st_size - BENCH_I_BYTES/2 - 3;
+   printf("%ld frames, %.1f MB, %d runs, %s cache\n",
+          frames, cut/1048576.0, runs, cold ? "cold" : "warm");
+
+   for(i=0; i<runs; i++)
+   {
+      if(bench_copy(src, dst, cut, 0, cold)) return 1;
+      ms[i] = bench_ms();
+      ret = AVI_deformity_file(dst, frames/BENCH_FPS + 1, &tm_len);
+      ms[i] = bench_ms() - ms[i];
+      if(ret != RECORD_DEFORM_SUCCESS) { fprintf(stderr, "truncated: repair failed\n"); return 1; }
+   }
+   bench_report("truncated", ms, runs, cut);
+
+   for(i=0; i<runs; i++)
+   {
+      if(bench_copy(src, dst, cut, BENCH_GARBAGE, cold)) return 1;
+      ms[i] = bench_ms();
+      ret = AVI_deformity_file(dst, frames/BENCH_FPS + 1, &tm_len);
+      ms[i] = bench_ms() - ms[i];
+      if(ret != RECORD_DEFORM_SUCCESS) { fprintf(stderr, "garbage: repair failed\n"); return 1; }
+   }
+   bench_report("garbage", ms, runs, cut + BENCH_GARBAGE);
+
+   /* idx1 is the last chunk, one entry per video frame and audio chunk */
+   movi = cst.st_size - 8 - frames*2*16;
+   for(i=0; i<runs; i++)
+   {
+      if(bench_copy(closed, dst, movi, 0, cold)) return 1;
+      ms[i] = bench_ms();
+      avi = AVI_open_input_file(dst, 1);
+      ms[i] = bench_ms() - ms[i];
+      if(avi == NULL) { fprintf(stderr, "open: %s\n", AVI_strerror()); return 1; }
+      ret = AVI_video_frames(avi) != frames;
+      AVI_close_1(avi);
+      if(ret) { fprintf(stderr, "open: frames missing\n"); return 1; }
+   }
+   bench_report("open", ms, runs, movi);
+
+   unlink(dst);
+   unlink(src);
+   unlink(closed);
+   free(ms);
+   return 0;
+}
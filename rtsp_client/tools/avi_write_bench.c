@@ -0,0 +1,154 @@
+/*
+ * Benchmark of many recorders writing at the same time, like an NVR
+ * with one avi_t per camera.
+ *
+ * Opens n recorders with AVI_Init_fd_fast and writes frames rounds of
+ * one frame (H264 sized, an I frame every BENCH_GOP) and one audio chunk
+ * to each of them in turn, then closes them. Reports the memory of a
+ * recorder, sizeof(avi_t) and what it has on the heap after
+ * AVI_Init_fd_fast and after the writes, and the chunk writes per
+ * second of the best run.
+ *
+ * usage: avi_write_bench [-d dir] [-n recorders] [-f frames] [-r runs] [-c bytes]
+ *   -c enables the coalescing writer with a buffer of bytes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <time.h>
+
+#include "avilib.h"
+
+#define BENCH_FPS          25
+#define BENCH_GOP          25
+#define BENCH_I_BYTES      40000
+#define BENCH_P_BYTES      1500
+#define BENCH_AUDIO_BYTES  320       /* 8 kHz 16 bit mono per frame */
+
+static double bench_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+/* Bytes in use on the heap */
+
+static long bench_heap(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+   struct mallinfo2 mi = mallinfo2();
+#else
+   struct mallinfo mi = mallinfo();
+#endif
+
+   return (long)mi.uordblks + (long)mi.hblkhd;
+}
+
+/* Heap per recorder since base, what the last run freed can make it
+   come out below 0 */
+
+static long bench_per(long base, int n)
+{
+   long d = (bench_heap() - base)/n;
+
+   return d > 0 ? d : 0;
+}
+
+static void bench_name(char *name, size_t len, const char *dir, int i)
+{
+   snprintf(name, len, "%s/avi_wbench_%03d.avi", dir, i);
+}
+
+int main(int argc, char **argv)
+{
+   static unsigned char v[BENCH_I_BYTES], a[BENCH_AUDIO_BYTES];
+   const char *dir = "/tmp";
+   char name[512];
+   long frames = 400, i, k, writes, len;
+   int n = 500, runs = 3, coalesce = 0;
+   double ms, best = 0;
+   long base, heap = 0, used = 0;
+   avi_t *avi;
+   int c, run;
+
+   while((c = getopt(argc, argv, "d:n:f:r:c:")) != -1)
+   {
+      switch(c)
+      {
+         case 'd': dir = optarg; break;
+         case 'n': n = atoi(optarg); break;
+         case 'f': frames = atol(optarg); break;
+         case 'r': runs = atoi(optarg); break;
+         case 'c': coalesce = atoi(optarg); break;
+         default:
+            fprintf(stderr, "usage: %s [-d dir] [-n recorders] [-f frames] [-r runs] [-c bytes]\n", argv[0]);
+            return 1;
+      }
+   }
+   if(n <= 0 || frames <= 0 || runs <= 0) return 1;
+
+   avi = (avi_t *)calloc(n, sizeof(avi_t));
+   if(avi == NULL) return 1;
+   srand(1);
+   for(i=0; i<(long)sizeof(v); i++) v[i] = rand();
+   v[0] = 0; v[1] = 0; v[2] = 0; v[3] = 1;
+
+   for(run=0; run<runs; run++)
+   {
+      base = bench_heap();
+      for(i=0; i<n; i++)
+      {
+         bench_name(name, sizeof(name), dir, i);
+         memset(&avi[i], 0, sizeof(avi_t));
+         if(AVI_Init_fd_fast(&avi[i], 640, 480, BENCH_FPS, "H264", frames/BENCH_FPS + 1, name) < 0)
+         {
+            fprintf(stderr, "can't open %s\n", name);
+            return 1;
+         }
+         AVI_set_audio(&avi[i], 1, 8000, 16, WAVE_FORMAT_PCM);
+         if(coalesce > 0) AVI_set_write_coalesce(&avi[i], coalesce, -1);
+      }
+      heap = bench_per(base, n);
+
+      writes = 0;
+      ms = bench_ms();
+      for(k=0; k<frames; k++)
+      {
+         len = k%BENCH_GOP ? BENCH_P_BYTES : BENCH_I_BYTES;
+         v[4] = k%BENCH_GOP ? 0x41 : 0x65;
+         for(i=0; i<n; i++)
+         {
+            if(AVI_write_frame(&avi[i], v, len, k/BENCH_FPS) ||
+               AVI_write_audio(&avi[i], a, sizeof(a), k/BENCH_FPS))
+            {
+               fprintf(stderr, "write failed\n");
+               return 1;
+            }
+            writes += 2;
+         }
+      }
+      ms = bench_ms() - ms;
+      if(writes/ms > best) best = writes/ms;
+      used = bench_per(base, n);
+
+      for(i=0; i<n; i++)
+      {
+         AVI_close_fd_1(&avi[i]);
+         bench_name(name, sizeof(name), dir, i);
+         unlink(name);
+      }
+   }
+
+   printf("%d recorders, %ld frames, %d runs%s\n", n, frames, runs, coalesce > 0 ? ", coalescing" : "");
+   printf("sizeof(avi_t) %lu, heap per recorder %ld bytes after init, %ld after the writes\n",
+          (unsigned long)sizeof(avi_t), heap, used);
+   printf("%.0f writes/s (best run)\n", best*1e3);
+
+   free(avi);
+   return 0;
+}